@@ -0,0 +1,354 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "Clock.h"
+#include "EventLoop.h"
+#include "FrameQueue.h"
+#include "ClientShard.h"
+
+// Counts heap allocations of the whole process (the shard is single-threaded here).
+static std::atomic<uint64_t> AllocationsNumber(0);
+
+void* operator new(std::size_t size) {
+  AllocationsNumber += 1;
+  
+  void* ptr = std::malloc(size != 0 ? size : 1);
+  if (nullptr == ptr) {
+    std::abort();
+  }
+  
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+// Counts send calls of the shard. They are forwarded to the kernel directly.
+static std::atomic<uint64_t> WriteCallsNumber(0);
+static std::atomic<uint64_t> WritevCallsNumber(0);
+
+extern "C" ssize_t write(int fd, const void* data, size_t size) {
+  WriteCallsNumber += 1;
+  return ::syscall(SYS_write, fd, data, size);
+}
+
+extern "C" ssize_t writev(int fd, const iovec* ioVectors, int ioVectorsNumber) {
+  WritevCallsNumber += 1;
+  return ::syscall(SYS_writev, fd, ioVectors, ioVectorsNumber);
+}
+
+namespace {
+  
+  const uint32_t DefaultClientsNumber = 1000U;
+  const uint32_t DefaultFramesNumber = 200U;
+  const uint32_t DefaultFrameSizeKb = 16U;
+  const uint32_t VideoBuffersNumber = 8U;
+  
+  const char StreamRequest[] = "GET /stream HTTP/1.1\r\n\r\n";
+  
+  /*
+   * @brief Bench serves MJPEG streams of synthetic frames to local clients 
+   *        (socket pairs) from a single ClientShard. The bench reads the other
+   *        ends of socket pairs so clients are never slow.
+   * 
+   * */
+  class Bench
+  {
+  public:
+    
+    explicit Bench(uint32_t frameSize)
+      : _shard(std::vector<ClientShard::Camera>(1, ClientShard::Camera {std::string(), &_queue}))
+      , _frame(frameSize, 0)
+      , _videoBuffers(VideoBuffersNumber)
+      , _sequence(0)
+      , _readBuffer(256 * 1024) {
+    }
+    
+    bool Init() {
+      // A frame is a JPEG image with SOF0 marker (a Huffman table is inserted before it).
+      _frame[0] = 0xFF;
+      _frame[1] = 0xD8;
+      _frame[2] = 0xFF;
+      _frame[3] = 0xC0;
+      _frame[_frame.size() - 2] = 0xFF;
+      _frame[_frame.size() - 1] = 0xD9;
+      
+      for (uint32_t idx = 0; idx < VideoBuffersNumber; ++idx) {
+        std::memset(&_videoBuffers[idx], 0, sizeof(VideoBuffer));
+        _videoBuffers[idx].Data = _frame.data();
+        _videoBuffers[idx].Size = static_cast<uint32_t>(_frame.size());
+        _videoBuffers[idx].Length = static_cast<uint32_t>(_frame.size());
+        _videoBuffers[idx].Idx = idx;
+        _freeVideoBuffers.push_back(&_videoBuffers[idx]);
+      }
+      
+      _queue.Init(0, 0);
+      
+      ClientShard::Config config;
+      config.IsZeroCopy = false;
+      config.SkipLagBytes = 0;
+      config.DowngradeLagMs = 0;
+      config.DisconnectLagMs = 0;
+      config.RateLimitBytes = 0;
+      config.IsLatencyMode = false;
+      config.IdleTimeoutMs = 0;
+      
+      return _eventLoop.Init() && _shard.Init(&_eventLoop, config);
+    }
+    
+    // @brief Connects clients which request the stream. Returns false if sockets can not be created.
+    bool Connect(uint32_t clientsNumber) {
+      for (uint32_t idx = 0; idx < clientsNumber; ++idx) {
+        int fds[2] = {-1, -1};
+        if (-1 == ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds)) {
+          std::perror("socketpair()");
+          return false;
+        }
+        
+        if (-1 == ::write(fds[1], StreamRequest, sizeof(StreamRequest) - 1)) {
+          std::perror("write()");
+          return false;
+        }
+        
+        _peerFds.push_back(fds[1]);
+        _shard.AddClient(fds[0]);
+      }
+      
+      Drain();
+      
+      return true;
+    }
+    
+    // @brief Closes all clients. The shard keeps its pool of client states.
+    void Disconnect() {
+      _shard.Shutdown();
+      
+      for (int peerFd : _peerFds) {
+        ::close(peerFd);
+      }
+      
+      _peerFds.clear();
+    }
+    
+    // @brief Queues a frame and returns the time of its fan-out to all clients in microseconds.
+    uint64_t SendFrame() {
+      while (const VideoBuffer* videoBuffer = _queue.DequeueBuffer()) {
+        _freeVideoBuffers.push_back(videoBuffer);
+      }
+      
+      if (_freeVideoBuffers.empty()) {
+        return 0;
+      }
+      
+      VideoBuffer* videoBuffer = const_cast<VideoBuffer*>(_freeVideoBuffers.back());
+      _freeVideoBuffers.pop_back();
+      
+      const uint64_t timestampUs = Clock::GetMonotonicTimeUs();
+      videoBuffer->V4l2Buffer.sequence = ++_sequence;
+      videoBuffer->V4l2Buffer.timestamp.tv_sec = static_cast<time_t>(timestampUs / 1000000U);
+      videoBuffer->V4l2Buffer.timestamp.tv_usec = static_cast<suseconds_t>(timestampUs % 1000000U);
+      
+      if (!_queue.QueueBuffer(videoBuffer)) {
+        _freeVideoBuffers.push_back(videoBuffer);
+        return 0;
+      }
+      
+      const uint64_t startUs = Clock::GetMonotonicTimeUs();
+      
+      _shard.NotifyNewBuffer(0);
+      _shard.ServeRequests();
+      
+      const uint64_t fanOutUs = Clock::GetMonotonicTimeUs() - startUs;
+      
+      Drain();
+      
+      return fanOutUs;
+    }
+    
+    std::size_t GetClientsNumber() const { return _shard.GetClientsNumber(); }
+    
+    // @brief Returns the number of pieces (HTTP header, JPEG parts, boundary) of the newest frame.
+    uint32_t GetFramePiecesNumber() {
+      const timeval oldestTimestamp = {0, 0};
+      FrameQueue::QueueItem* queueItem = _queue.SelectBufferForSending(oldestTimestamp);
+      if (nullptr == queueItem) {
+        return 0;
+      }
+      
+      const uint32_t piecesNumber = static_cast<uint32_t>(queueItem->Data.size());
+      _queue.ReleaseBuffer(queueItem);
+      
+      return piecesNumber;
+    }
+    
+    void Shutdown() {
+      Disconnect();
+      _eventLoop.Shutdown();
+    }
+    
+  private:
+    
+    // @brief Reads client ends and lets the shard finish frames which did not fit into socket buffers.
+    void Drain() {
+      bool hasData = true;
+      while (hasData) {
+        hasData = false;
+        
+        for (int peerFd : _peerFds) {
+          while (::read(peerFd, _readBuffer.data(), _readBuffer.size()) > 0) {
+            hasData = true;
+          }
+        }
+        
+        if (_eventLoop.Wait(0) > 0) {
+          hasData = true;
+        }
+      }
+    }
+    
+    FrameQueue _queue;
+    EventLoop _eventLoop;
+    ClientShard _shard;
+    
+    std::vector<uint8_t> _frame;
+    std::vector<VideoBuffer> _videoBuffers;
+    std::vector<const VideoBuffer*> _freeVideoBuffers;
+    uint32_t _sequence;
+    
+    std::vector<int> _peerFds;
+    std::vector<uint8_t> _readBuffer;
+  };
+  
+  bool SetFilesLimit(uint32_t clientsNumber) {
+    rlimit limit = {0};
+    if (-1 == ::getrlimit(RLIMIT_NOFILE, &limit)) {
+      return false;
+    }
+    
+    // Every client takes two descriptors.
+    const rlim_t neededNumber = 2 * clientsNumber + 64;
+    if (limit.rlim_cur >= neededNumber) {
+      return true;
+    }
+    
+    limit.rlim_cur = std::min(neededNumber, limit.rlim_max);
+    
+    return 0 == ::setrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur == neededNumber;
+  }
+}
+
+// Usage: uvc2http_bench [CLIENTS [FRAMES [FRAME_KB]]]
+int main(int argc, char **argv) {
+  
+  const uint32_t clientsNumber = (argc > 1) ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : DefaultClientsNumber;
+  const uint32_t framesNumber = (argc > 2) ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : DefaultFramesNumber;
+  const uint32_t frameSizeKb = (argc > 3) ? static_cast<uint32_t>(std::strtoul(argv[3], nullptr, 10)) : DefaultFrameSizeKb;
+  
+  if (0 == clientsNumber || 0 == framesNumber || 0 == frameSizeKb || frameSizeKb > 16 * 1024) {
+    std::printf("Usage: uvc2http_bench [CLIENTS [FRAMES [FRAME_KB]]]\n");
+    return -1;
+  }
+  
+  const uint32_t frameSize = frameSizeKb * 1024;
+  
+  if (!SetFilesLimit(clientsNumber)) {
+    std::printf("Failed to allow %u descriptors (see ulimit -n).\n", 2 * clientsNumber + 64);
+    return -1;
+  }
+  
+  Bench bench(frameSize);
+  if (!bench.Init()) {
+    std::printf("Failed to initialize the shard.\n");
+    return -1;
+  }
+  
+  // The first clients fill the pool of client states, the next ones reuse it.
+  uint64_t allocationsNumber = AllocationsNumber;
+  if (!bench.Connect(clientsNumber)) {
+    return -1;
+  }
+  
+  const uint64_t firstConnectAllocations = AllocationsNumber - allocationsNumber;
+  
+  bench.Disconnect();
+  
+  allocationsNumber = AllocationsNumber;
+  if (!bench.Connect(clientsNumber)) {
+    return -1;
+  }
+  
+  const uint64_t nextConnectAllocations = AllocationsNumber - allocationsNumber;
+  
+  if (bench.GetClientsNumber() != clientsNumber) {
+    std::printf("Only %u of %u clients are connected.\n", static_cast<uint32_t>(bench.GetClientsNumber()), clientsNumber);
+    return -1;
+  }
+  
+  // Warm up the queue and socket buffers.
+  bench.SendFrame();
+  
+  uint64_t totalUs = 0;
+  uint64_t minUs = UINT64_MAX;
+  allocationsNumber = AllocationsNumber;
+  const uint64_t writeCallsNumber = WriteCallsNumber;
+  const uint64_t writevCallsNumber = WritevCallsNumber;
+  
+  for (uint32_t frameIdx = 0; frameIdx < framesNumber; ++frameIdx) {
+    const uint64_t fanOutUs = bench.SendFrame();
+    totalUs += fanOutUs;
+    minUs = std::min(minUs, fanOutUs);
+  }
+  
+  const uint64_t frameAllocations = AllocationsNumber - allocationsNumber;
+  const uint64_t frameWriteCalls = WriteCallsNumber - writeCallsNumber;
+  const uint64_t frameWritevCalls = WritevCallsNumber - writevCallsNumber;
+  
+  std::printf("clients: %u, frames: %u, frame size: %u\n", clientsNumber, framesNumber, frameSize);
+  std::printf("allocations per connection: %.2f (first clients), %.2f (reused states)\n", 
+              static_cast<double>(firstConnectAllocations) / clientsNumber,
+              static_cast<double>(nextConnectAllocations) / clientsNumber);
+  std::printf("fan-out per frame: %.1f us average, %llu us min, %.1f ns per client\n",
+              static_cast<double>(totalUs) / framesNumber, static_cast<unsigned long long>(minUs),
+              1000.0 * totalUs / framesNumber / clientsNumber);
+  std::printf("allocations per frame: %.2f\n", static_cast<double>(frameAllocations) / framesNumber);
+  
+  // Partial writes which are finished by the event loop are counted too.
+  const double framesPerClient = static_cast<double>(framesNumber) * clientsNumber;
+  std::printf("send calls per frame per client: %.2f writev(), %.2f write() (%u pieces per frame)\n",
+              frameWritevCalls / framesPerClient, frameWriteCalls / framesPerClient, bench.GetFramePiecesNumber());
+  
+  bench.Shutdown();
+  
+  return 0;
+}
@@ -0,0 +1,143 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "BufferSizer.h"
+
+namespace {
+  const uint64_t WindowMs = 10000;
+  
+  // The driver needs a buffer which is being filled and a queued one to not drop frames.
+  const uint32_t DriverBuffersNumber = 2;
+  
+  // Spare buffers are released only if they were not needed for a minute.
+  const uint32_t ShrinkWindowsNumber = 6;
+  
+  // A larger gap means that the sequence was restarted (e.g. by STREAMON).
+  const uint32_t MaxSequenceGap = 1000;
+}
+
+BufferSizer::BufferSizer(uint32_t minBuffersNumber, uint32_t maxBuffersNumber)
+  : _minBuffersNumber(minBuffersNumber),
+    _maxBuffersNumber(maxBuffersNumber),
+    _hasSequence(false),
+    _lastSequence(0),
+    _windowStartMs(0),
+    _windowFramesNumber(0),
+    _windowDropsNumber(0),
+    _maxDequeuedNumber(0),
+    _maxPinMs(0),
+    _cleanWindowsNumber(0)
+{
+}
+
+void BufferSizer::Reset(uint64_t nowMs)
+{
+  _hasSequence = false;
+  StartWindow(nowMs);
+}
+
+void BufferSizer::StartWindow(uint64_t nowMs)
+{
+  _windowStartMs = nowMs;
+  _windowFramesNumber = 0;
+  _windowDropsNumber = 0;
+  _maxDequeuedNumber = 0;
+  _maxPinMs = 0;
+}
+
+void BufferSizer::OnDequeue(uint32_t sequence, uint32_t dequeuedNumber, uint64_t nowMs)
+{
+  const uint32_t gap = sequence - _lastSequence;
+  if (_hasSequence && gap > 1 && gap <= MaxSequenceGap) {
+    _windowDropsNumber += gap - 1;
+  }
+  
+  _hasSequence = true;
+  _lastSequence = sequence;
+  
+  _windowFramesNumber += 1;
+  
+  if (dequeuedNumber > _maxDequeuedNumber) {
+    _maxDequeuedNumber = dequeuedNumber;
+  }
+}
+
+void BufferSizer::OnRequeue(uint64_t pinMs)
+{
+  if (pinMs > _maxPinMs) {
+    _maxPinMs = pinMs;
+  }
+}
+
+uint32_t BufferSizer::GetWantedNumber(uint32_t buffersNumber, uint64_t nowMs)
+{
+  const uint64_t windowMs = nowMs - _windowStartMs;
+  if (!IsEnabled() || windowMs < WindowMs) {
+    return ClampNumber(buffersNumber);
+  }
+  
+  uint32_t wantedNumber = buffersNumber;
+  
+  // Frames captured while the longest pinned buffer was held.
+  uint32_t pinnedNumber = _maxDequeuedNumber;
+  if (_windowFramesNumber != 0) {
+    const uint64_t frameIntervalMs = windowMs / _windowFramesNumber;
+    const uint64_t pinnedFramesNumber = (frameIntervalMs != 0) ? (_maxPinMs + frameIntervalMs - 1) / frameIntervalMs : 0;
+    if (pinnedFramesNumber > pinnedNumber) {
+      pinnedNumber = static_cast<uint32_t>(pinnedFramesNumber);
+    }
+  }
+  
+  const bool isDriverShort = _maxDequeuedNumber + DriverBuffersNumber > buffersNumber;
+  
+  if (_windowDropsNumber != 0 && isDriverShort) {
+    // Drops of a driver which has enough buffers (e.g. a slow USB bus) are not helped by more buffers.
+    wantedNumber = buffersNumber + 1;
+    _cleanWindowsNumber = 0;
+  }
+  else if (0 == _windowDropsNumber && pinnedNumber + DriverBuffersNumber < buffersNumber) {
+    _cleanWindowsNumber += 1;
+    if (_cleanWindowsNumber >= ShrinkWindowsNumber) {
+      wantedNumber = buffersNumber - 1;
+      _cleanWindowsNumber = 0;
+    }
+  }
+  else {
+    _cleanWindowsNumber = 0;
+  }
+  
+  StartWindow(nowMs);
+  
+  return ClampNumber(wantedNumber);
+}
+
+uint32_t BufferSizer::ClampNumber(uint32_t buffersNumber) const
+{
+  if (buffersNumber < _minBuffersNumber) {
+    return _minBuffersNumber;
+  }
+  
+  if (buffersNumber > _maxBuffersNumber) {
+    return _maxBuffersNumber;
+  }
+  
+  return buffersNumber;
+}
@@ -0,0 +1,79 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef BUFFERSIZER_H
+#define BUFFERSIZER_H
+
+#include <cstdint>
+
+/*
+ * @brief BufferSizer selects the number of capture buffers from what is observed
+ *        in windows: the largest number of buffers held outside of the driver 
+ *        (occupancy), the longest time a buffer was held (pinning) and gaps of 
+ *        sequence numbers (frames dropped by the driver). Drops while the driver 
+ *        was short of buffers add a buffer, a series of clean windows with spare 
+ *        buffers removes one. It only keeps the state, the owner reallocates buffers.
+ * 
+ * */
+class BufferSizer
+{
+public:
+  
+  BufferSizer(uint32_t minBuffersNumber, uint32_t maxBuffersNumber);
+  
+  // @brief Starts a new window (e.g. after buffers are reallocated or streaming is restarted).
+  void Reset(uint64_t nowMs);
+  
+  // @brief Registers a dequeued frame. DequeuedNumber includes it.
+  void OnDequeue(uint32_t sequence, uint32_t dequeuedNumber, uint64_t nowMs);
+  
+  // @brief Registers a requeued frame which was held by the application for PinMs.
+  void OnRequeue(uint64_t pinMs);
+  
+  // @brief Returns the number of buffers which should be used. It is changed 
+  //        at most once per window and it is kept within the bounds.
+  uint32_t GetWantedNumber(uint32_t buffersNumber, uint64_t nowMs);
+  
+  uint32_t ClampNumber(uint32_t buffersNumber) const;
+  
+  bool IsEnabled() const { return _minBuffersNumber < _maxBuffersNumber; }
+  
+private:
+  
+  void StartWindow(uint64_t nowMs);
+  
+  uint32_t _minBuffersNumber;
+  uint32_t _maxBuffersNumber;
+  
+  bool _hasSequence;
+  uint32_t _lastSequence;
+  
+  // Observations of the current window.
+  uint64_t _windowStartMs;
+  uint32_t _windowFramesNumber;
+  uint32_t _windowDropsNumber;
+  uint32_t _maxDequeuedNumber;
+  uint64_t _maxPinMs;
+  
+  uint32_t _cleanWindowsNumber;
+};
+
+#endif // BUFFERSIZER_H
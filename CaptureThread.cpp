@@ -0,0 +1,262 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "CaptureThread.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "Clock.h"
+#include "Tracer.h"
+#include "Buffer.h"
+#include "EventLoop.h"
+#include "FrameSource.h"
+
+namespace {
+  // Recovery attempts are repeated with growing delays. A new device node triggers an attempt at once.
+  const uint64_t MinRetryDelayMs = 250;
+  const uint64_t MaxRetryDelayMs = 4000;
+  
+  // Max time to wait for a frame before checking state.
+  const int MaxWaitTimeMs = 1000;
+}
+
+CaptureThread::CaptureThread(FrameSource& frameSource, uint32_t buffersNumber)
+  : _frameSource(frameSource),
+    _notifyLoop(nullptr),
+    _capturedFrames(buffersNumber),
+    _releasedFrames(buffersNumber),
+    _outstandingFramesNumber(0U),
+    _recoveryStartMs(0U),
+    _retryTimeMs(0U),
+    _retryDelayMs(0U),
+    _wakeupFd(-1),
+    _shouldStop(false),
+    _isBroken(true)
+{
+}
+
+CaptureThread::~CaptureThread()
+{
+  Stop();
+}
+
+void* CaptureThread::operator new(std::size_t size) noexcept
+{
+  void* ptr = nullptr;
+  if (0 != ::posix_memalign(&ptr, alignof(CaptureThread), size)) {
+    return nullptr;
+  }
+  
+  return ptr;
+}
+
+void CaptureThread::operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+bool CaptureThread::Start(EventLoop* notifyLoop)
+{
+  _wakeupFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (-1 == _wakeupFd) {
+    Tracer::LogErrNo("eventfd().");
+    return false;
+  }
+  
+  _notifyLoop = notifyLoop;
+  _shouldStop = false;
+  _thread = std::thread(&CaptureThread::ThreadFunc, this);
+  
+  return true;
+}
+
+void CaptureThread::Stop()
+{
+  if (_thread.joinable()) {
+    _shouldStop = true;
+    
+    const uint64_t counter = 1;
+    if (-1 == ::write(_wakeupFd, &counter, sizeof(counter))) {
+      Tracer::LogErrNo("write(eventfd).");
+    }
+    
+    _thread.join();
+  }
+  
+  if (_wakeupFd != -1) {
+    ::close(_wakeupFd);
+    _wakeupFd = -1;
+  }
+}
+
+const VideoBuffer* CaptureThread::DequeuFrame()
+{
+  const VideoBuffer* videoBuffer = nullptr;
+  if (!_capturedFrames.Pop(videoBuffer)) {
+    return nullptr;
+  }
+  
+  return videoBuffer;
+}
+
+void CaptureThread::RequeueFrame(const VideoBuffer* buffer)
+{
+  // The capture thread does not publish more frames than the ring holds so it can not
+  // be full. The push is still repeated rather than losing a buffer of the source.
+  while (!_releasedFrames.Push(buffer)) {
+    std::this_thread::yield();
+  }
+  
+  const uint64_t counter = 1;
+  if (-1 == ::write(_wakeupFd, &counter, sizeof(counter)) && errno != EAGAIN) {
+    Tracer::LogErrNo("write(eventfd).");
+  }
+}
+
+void CaptureThread::ThreadFunc()
+{
+  while (!_shouldStop) {
+    RequeueReleasedFrames();
+    
+    if (!_frameSource.IsReady() || _frameSource.IsBroken()) {
+      _isBroken = true;
+      
+      // All published frames have to be returned before reinitialization.
+      if (_outstandingFramesNumber > 0) {
+        Wait(-1, MaxWaitTimeMs);
+        continue;
+      }
+      
+      RecoverSource();
+      
+      continue;
+    }
+    
+    Wait(_frameSource.GetFd(), MaxWaitTimeMs);
+    
+    // Publish all ready frames.
+    bool isPublished = false;
+    
+    const VideoBuffer* videoBuffer = _frameSource.DequeuFrame();
+    while (videoBuffer != nullptr) {
+      // Sources with more buffers than the rings hold keep the rest in the driver.
+      if (_outstandingFramesNumber < _releasedFrames.GetCapacity() && _capturedFrames.Push(videoBuffer)) {
+        _outstandingFramesNumber += 1;
+        isPublished = true;
+      }
+      else {
+        Tracer::Log("Captured frames ring is full.\n");
+        _frameSource.RequeueFrame(videoBuffer);
+      }
+      
+      videoBuffer = _frameSource.IsBroken() ? nullptr : _frameSource.DequeuFrame();
+    }
+    
+    if (isPublished && _notifyLoop != nullptr) {
+      _notifyLoop->Wakeup();
+    }
+  }
+  
+  RequeueReleasedFrames();
+  
+  _frameSource.Shutdown();
+}
+
+void CaptureThread::Wait(int sourceFd, int timeoutMs)
+{
+  pollfd pollFds[2] = {{0}};
+  pollFds[0].fd = _wakeupFd;
+  pollFds[0].events = POLLIN;
+  pollFds[1].fd = sourceFd;
+  pollFds[1].events = POLLIN;
+  
+  const nfds_t pollFdsNumber = (-1 == sourceFd) ? 1 : 2;
+  
+  int result = ::poll(pollFds, pollFdsNumber, timeoutMs);
+  if (-1 == result && errno != EINTR) {
+    Tracer::LogErrNo("poll().");
+    return;
+  }
+  
+  if (result > 0 && (pollFds[0].revents & POLLIN)) {
+    uint64_t counter;
+    if (-1 == ::read(_wakeupFd, &counter, sizeof(counter)) && errno != EAGAIN) {
+      Tracer::LogErrNo("read(eventfd).");
+    }
+  }
+}
+
+void CaptureThread::RecoverSource()
+{
+  const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+  const bool isFirstAttempt = (0 == _recoveryStartMs);
+  
+  if (isFirstAttempt) {
+    // The first attempt is made at once as a glitch does not always remove the device.
+    _recoveryStartMs = nowMs;
+    _retryTimeMs = nowMs;
+    _retryDelayMs = MinRetryDelayMs;
+    
+    const std::string devicePath = _frameSource.GetDevicePath();
+    if (!devicePath.empty()) {
+      _deviceWatcher.Init(devicePath);
+    }
+  }
+  
+  // Events are read on every check as the watched directory can reappear.
+  if (!_deviceWatcher.ReadEvents() && nowMs < _retryTimeMs) {
+    Wait(_deviceWatcher.GetFd(), static_cast<int>(_retryTimeMs - nowMs));
+    return;
+  }
+  
+  if (!_frameSource.ReInit()) {
+    if (isFirstAttempt) {
+      Tracer::Log("Failed to initialize frame source (is there a UVC camera?). The app will try to initialize later.\n");
+    }
+    
+    _retryTimeMs = Clock::GetMonotonicTimeMs() + _retryDelayMs;
+    _retryDelayMs = std::min(_retryDelayMs * 2, MaxRetryDelayMs);
+    return;
+  }
+  
+  Tracer::Log("Frame source is initialized in %u ms.\n", static_cast<uint32_t>(Clock::GetMonotonicTimeMs() - _recoveryStartMs));
+  
+  _recoveryStartMs = 0;
+  _deviceWatcher.Shutdown();
+  _isBroken = false;
+}
+
+void CaptureThread::RequeueReleasedFrames()
+{
+  const VideoBuffer* videoBuffer = nullptr;
+  while (_releasedFrames.Pop(videoBuffer)) {
+    _outstandingFramesNumber -= 1;
+    
+    if (_frameSource.IsReady() && !_frameSource.IsBroken()) {
+      _frameSource.RequeueFrame(videoBuffer);
+    }
+  }
+}
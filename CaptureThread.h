@@ -0,0 +1,111 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef CAPTURETHREAD_H
+#define CAPTURETHREAD_H
+
+#include <atomic>
+#include <thread>
+#include <cstddef>
+
+#include "SpscRing.h"
+#include "DeviceWatcher.h"
+
+class FrameSource;
+class EventLoop;
+struct VideoBuffer;
+
+/*
+ * @brief CaptureThread dequeues frames from a FrameSource in a dedicated thread
+ *        as soon as they are ready. Frames are published to the serving thread 
+ *        via a lock-free ring and released frames come back via another ring.
+ *        The capture thread also recovers a broken source (at once when its 
+ *        device node reappears).
+ * 
+ * */
+class CaptureThread
+{
+public:
+  
+  CaptureThread(FrameSource& frameSource, uint32_t buffersNumber);
+  ~CaptureThread();
+  
+  // CaptureThread is over-aligned (see SpscRing) and the global C++11 operator new 
+  // does not respect it. Returns nullptr if there is no memory.
+  static void* operator new(std::size_t size) noexcept;
+  static void operator delete(void* ptr) noexcept;
+  
+  // @brief Starts capturing. notifyLoop is woken up when a frame is published.
+  bool Start(EventLoop* notifyLoop);
+  
+  // @brief Stops capturing and shutdowns the source.
+  void Stop();
+  
+  // @brief Return true if the source is broken or not initialized. In this case
+  //        all dequeued frames should be requeued to let the thread recover the source.
+  bool IsBroken() const { return _isBroken; }
+  
+  // @brief Returns the next captured frame or nullptr. Called by the serving thread.
+  const VideoBuffer* DequeuFrame();
+  
+  // @brief Returns a frame to the capture thread. Called by the serving thread.
+  void RequeueFrame(const VideoBuffer* buffer);
+  
+  CaptureThread() = delete;
+  CaptureThread(const CaptureThread& other) = delete;
+  CaptureThread& operator=(const CaptureThread& other) = delete;
+  
+private:
+  
+  void ThreadFunc();
+  
+  // @brief Waits till the source fd (if any) or the wakeup fd is readable.
+  void Wait(int sourceFd, int timeoutMs);
+  
+  void RequeueReleasedFrames();
+  
+  // @brief Reinitializes the broken source when its device node changes or a retry delay expires.
+  void RecoverSource();
+  
+  FrameSource& _frameSource;
+  EventLoop* _notifyLoop;
+  
+  SpscRing<const VideoBuffer*> _capturedFrames;
+  SpscRing<const VideoBuffer*> _releasedFrames;
+  
+  // Number of frames which were published and not returned yet (used only by the capture thread).
+  // It never exceeds the capacity of the rings so returned frames always fit _releasedFrames.
+  uint32_t _outstandingFramesNumber;
+  
+  // Recovery state (used only by the capture thread): the time of the failure (zero while 
+  // the source works), the time of the next attempt and the current delay between attempts.
+  uint64_t _recoveryStartMs;
+  uint64_t _retryTimeMs;
+  uint64_t _retryDelayMs;
+  DeviceWatcher _deviceWatcher;
+  
+  int _wakeupFd;
+  std::thread _thread;
+  std::atomic<bool> _shouldStop;
+  std::atomic<bool> _isBroken;
+};
+
+#endif // CAPTURETHREAD_H
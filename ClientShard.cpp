@@ -0,0 +1,1647 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "ClientShard.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+
+#include <algorithm>
+#include <utility>
+#include <strings.h>
+
+#include "Clock.h"
+#include "SocketCompat.h"
+#include "Tracer.h"
+#include "WebSocket.h"
+
+namespace {
+
+const size_t ClientReadBufferSize = 2048U;
+
+static const char StreamHeader[] = 
+  "HTTP/1.0 200 OK\r\n" \
+  "Connection: close\r\n" \
+  "Server: uvc-streamer/0.01\r\n" \
+  "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
+  "Pragma: no-cache\r\n" \
+  "Expires: Thu, 1 Jan 1970 00:00:01 GMT\r\n"
+  "Content-Type: multipart/x-mixed-replace; boundary=BoundaryDoNotCross\r\n" \
+  "\r\n" \
+  "--BoundaryDoNotCross\r\n";
+
+// The frame header of FrameQueue (Content-Type, Content-Length, etc.) completes it.
+static const char SnapshotHeader[] = 
+  "HTTP/1.1 200 OK\r\n" \
+  "Server: uvc-streamer/0.01\r\n" \
+  "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
+  "Pragma: no-cache\r\n" \
+  "Expires: Thu, 1 Jan 1970 00:00:01 GMT\r\n";
+
+static const char KeepAliveHeader[] = "Connection: keep-alive\r\n";
+static const char CloseHeader[] = "Connection: close\r\n";
+
+// Frames are identified by V4L2 sequence numbers.
+static const char ETagTemplate[] = "ETag: \"%u\"\r\n";
+
+static const char NotModifiedTemplate[] = 
+  "HTTP/1.1 304 Not Modified\r\n" \
+  "%s" \
+  "Server: uvc-streamer/0.01\r\n" \
+  "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
+  "ETag: \"%u\"\r\n" \
+  "\r\n";
+
+static const char SimpleResponseTemplate[] = 
+  "HTTP/1.1 %s\r\n" \
+  "%s" \
+  "Server: uvc-streamer/0.01\r\n" \
+  "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
+  "Content-Type: %s\r\n" \
+  "Content-Length: %u\r\n" \
+  "\r\n";
+
+static const char WebSocketHandshakeTemplate[] = 
+  "HTTP/1.1 101 Switching Protocols\r\n" \
+  "Upgrade: websocket\r\n" \
+  "Connection: Upgrade\r\n" \
+  "Server: uvc-streamer/0.01\r\n" \
+  "Sec-WebSocket-Accept: %s\r\n" \
+  "\r\n";
+
+// A binary message starts with the frame timestamp (microseconds) and the V4L2 
+// sequence number (big-endian) followed by the JPEG image.
+static const uint32_t WebSocketFrameInfoSize = 12;
+
+// Client messages are short control messages ("ready").
+static const size_t MaxWebSocketPayloadSize = 125;
+
+// "ready" messages which are sent in advance are accumulated up to this limit.
+static const uint32_t MaxWebSocketCredits = 8;
+
+static const char CameraRoutePrefix[] = "/cam/";
+
+enum Route {
+  StreamRoute,
+  SnapshotRoute,
+  NextFrameRoute,
+  SdpRoute,
+  WebSocketRoute,
+  StatsRoute
+};
+
+struct RouteInfo {
+  const char* Path;
+  Route Id;
+};
+
+static const RouteInfo Routes[] = {
+  {"/", StreamRoute},
+  {"/stream", StreamRoute},
+  {"/snapshot", SnapshotRoute},
+  {"/next", NextFrameRoute},
+  {"/stream.sdp", SdpRoute},
+  {"/ws", WebSocketRoute},
+  {"/stats", StatsRoute}
+};
+
+// @brief Creates a response with a text body.
+std::string CreateSimpleResponse(const char* status, bool isKeepAlive, const std::string& body, 
+                                 const char* contentType = "text/plain") {
+  char header[sizeof(SimpleResponseTemplate) + 160];
+  int headerSize = std::snprintf(header, sizeof(header), SimpleResponseTemplate, status, 
+                                 isKeepAlive ? KeepAliveHeader : CloseHeader, contentType, 
+                                 static_cast<uint32_t>(body.size()));
+  if (headerSize <= 0 || static_cast<size_t>(headerSize) >= sizeof(header)) {
+    return std::string();
+  }
+  
+  return std::string(header, headerSize) + body;
+}
+
+// @brief Creates a response without a body for a client which already has the frame.
+std::string CreateNotModifiedResponse(bool isKeepAlive, uint32_t sequence) {
+  char header[sizeof(NotModifiedTemplate) + 64];
+  int headerSize = std::snprintf(header, sizeof(header), NotModifiedTemplate, 
+                                 isKeepAlive ? KeepAliveHeader : CloseHeader, sequence);
+  if (headerSize <= 0 || static_cast<size_t>(headerSize) >= sizeof(header)) {
+    return std::string();
+  }
+  
+  return std::string(header, headerSize);
+}
+
+// @brief Parses a sequence number given as "after" parameter or as an entity tag ("123").
+bool ParseSequence(const std::string& text, uint32_t& sequence) {
+  std::string value = text;
+  if (value.size() >= 2 && '"' == value[0] && '"' == value[value.size() - 1]) {
+    value = value.substr(1, value.size() - 2);
+  }
+  
+  if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  
+  char* rest = nullptr;
+  const unsigned long result = std::strtoul(value.c_str(), &rest, 10);
+  if (result > 0xFFFFFFFFUL) {
+    return false;
+  }
+  
+  sequence = static_cast<uint32_t>(result);
+  return true;
+}
+
+// @brief Gets the sequence number of the frame which the client has from "after"
+//        parameter or If-None-Match header.
+bool GetLastSequence(const HttpRequestParser& parser, uint32_t& sequence) {
+  const std::string* after = parser.FindQueryParameter("after");
+  if (after != nullptr) {
+    return ParseSequence(*after, sequence);
+  }
+  
+  const std::string* ifNoneMatch = parser.FindHeader("If-None-Match");
+  return ifNoneMatch != nullptr && ParseSequence(*ifNoneMatch, sequence);
+}
+
+uint64_t ToMicroseconds(const timeval& time) {
+  return static_cast<uint64_t>(time.tv_sec) * 1000000U + static_cast<uint64_t>(time.tv_usec);
+}
+
+timeval ToTimeval(uint64_t timeUs) {
+  timeval time;
+  time.tv_sec = static_cast<time_t>(timeUs / 1000000U);
+  time.tv_usec = static_cast<suseconds_t>(timeUs % 1000000U);
+  return time;
+}
+
+// @brief Cuts ioVectors to maxBytes. Returns the new number of vectors.
+int LimitIoVectors(iovec* ioVectors, int ioVectorsNumber, uint64_t maxBytes) {
+  uint64_t totalBytes = 0;
+  for (int idx = 0; idx < ioVectorsNumber; ++idx) {
+    if (totalBytes + ioVectors[idx].iov_len >= maxBytes) {
+      ioVectors[idx].iov_len = static_cast<size_t>(maxBytes - totalBytes);
+      return idx + 1;
+    }
+    
+    totalBytes += ioVectors[idx].iov_len;
+  }
+  
+  return ioVectorsNumber;
+}
+
+// HTTP header + frame header + MJPEG parts (header, Haffman table, data) + boundary.
+static const int MaxIoVectors = 8;
+
+// Waiting clients are always watched for input.
+static const uint32_t ReadEvents = EPOLLIN | EPOLLRDHUP | EPOLLET;
+
+// Being served clients are watched for output only while they have pending data.
+static const uint32_t IdleEvents = EPOLLET;
+static const uint32_t WriteEvents = EPOLLOUT | EPOLLET;
+
+// WebSocket clients send messages while they are served.
+static const uint32_t WebSocketEvents = EPOLLIN | EPOLLRDHUP;
+
+// Timeouts are checked with this period. Shard threads wake up for it.
+static const uint64_t TimeoutsCheckPeriodMs = 1000;
+
+// Latency mode streams are woken up (EPOLLOUT) when unsent data drops below it.
+static const int NotSentLowatBytes = 16 * 1024;
+
+// A rate limited client can send a burst of BucketTimeMs of its rate (but at least MinBucketBytes).
+static const uint64_t BucketTimeMs = 200;
+static const uint64_t MinBucketBytes = 16 * 1024;
+
+// A long polling client gets 304 (or 503 if it had no frame) if there is no new frame.
+static const uint64_t LongPollTimeoutMs = 10000;
+
+// A snapshot waits for the first frame of a camera which is being started.
+static const uint64_t SnapshotWaitTimeoutMs = 3000;
+}
+
+const uint32_t ClientShard::InvalidClientIdx;
+
+ClientShard::ClientShard(const std::vector<Camera>& cameras)
+  : _cameras(cameras),
+    _eventLoop(nullptr),
+    _config {false, 0U, 0U, 0U, 0U, false, 0U},
+    _shouldStop(false),
+    _newBufferCameras(0U),
+    _closeBusyClientsCameras(0U),
+    _watchersNumbers(cameras.size(), 0U),
+    _watchedCameras(0U),
+    _clientsNumber(0U),
+    _skippedFramesNumber(0U),
+    _downgradedClientsNumber(0U),
+    _disconnectedClientsNumber(0U),
+    _maxFramesBehind(0U),
+    _requestsNumber(0U),
+    _idleClosedClientsNumber(0U),
+    _timeoutsCheckMs(0U),
+    _readBuffer(ClientReadBufferSize)
+{
+}
+
+ClientShard::~ClientShard()
+{
+  Shutdown();
+}
+
+bool ClientShard::Init(EventLoop* eventLoop, const Config& config)
+{
+  _eventLoop = eventLoop;
+  _config = config;
+  
+  return true;
+}
+
+bool ClientShard::Start(const Config& config)
+{
+  if (!_ownEventLoop.Init()) {
+    return false;
+  }
+  
+  _eventLoop = &_ownEventLoop;
+  _config = config;
+  _shouldStop = false;
+  _thread = std::thread(&ClientShard::ThreadFunc, this);
+  
+  return true;
+}
+
+void ClientShard::Shutdown()
+{
+  if (_thread.joinable()) {
+    _shouldStop = true;
+    _eventLoop->Wakeup();
+    _thread.join();
+  }
+  
+  while (!_clients.empty()) {
+    CloseClient(_clients.back().Fd);
+  }
+  
+  {
+    std::lock_guard<std::mutex> lock(_newClientsMutex);
+    for (auto clientFd : _newClientFds) {
+      ::close(clientFd);
+    }
+    
+    _newClientFds.clear();
+  }
+  
+  _ownEventLoop.Shutdown();
+}
+
+void ClientShard::AddClient(int clientFd)
+{
+  _clientsNumber += 1;
+  
+  if (!_thread.joinable()) {
+    RegisterClient(clientFd);
+    return;
+  }
+  
+  {
+    std::lock_guard<std::mutex> lock(_newClientsMutex);
+    _newClientFds.push_back(clientFd);
+  }
+  
+  _eventLoop->Wakeup();
+}
+
+void ClientShard::NotifyNewBuffer(uint32_t cameraIdx)
+{
+  _newBufferCameras |= (1U << cameraIdx);
+  
+  if (_thread.joinable()) {
+    _eventLoop->Wakeup();
+  }
+}
+
+void ClientShard::CloseBusyClients(uint32_t cameraIdx)
+{
+  if (!_thread.joinable()) {
+    CloseBusyClientsNow(1U << cameraIdx);
+    return;
+  }
+  
+  _closeBusyClientsCameras |= (1U << cameraIdx);
+  _eventLoop->Wakeup();
+}
+
+ClientShard::Stats ClientShard::GetStats() const
+{
+  Stats stats = {0};
+  stats.SkippedFramesNumber = _skippedFramesNumber;
+  stats.DowngradedClientsNumber = _downgradedClientsNumber;
+  stats.DisconnectedClientsNumber = _disconnectedClientsNumber;
+  stats.MaxFramesBehind = _maxFramesBehind;
+  stats.RequestsNumber = _requestsNumber;
+  stats.IdleClosedClientsNumber = _idleClosedClientsNumber;
+  
+  return stats;
+}
+
+void ClientShard::ServeRequests()
+{
+  std::vector<int> newClientFds;
+  {
+    std::lock_guard<std::mutex> lock(_newClientsMutex);
+    newClientFds.swap(_newClientFds);
+  }
+  
+  for (auto clientFd : newClientFds) {
+    RegisterClient(clientFd);
+  }
+  
+  const uint32_t closeBusyClientsCameras = _closeBusyClientsCameras.exchange(0U);
+  if (closeBusyClientsCameras != 0) {
+    CloseBusyClientsNow(closeBusyClientsCameras);
+  }
+  
+  const uint32_t newBufferCameras = _newBufferCameras.exchange(0U);
+  if (newBufferCameras != 0) {
+    ServeNewBuffer(newBufferCameras);
+  }
+  
+  const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+  if (nowMs - _timeoutsCheckMs >= TimeoutsCheckPeriodMs) {
+    _timeoutsCheckMs = nowMs;
+    CheckTimeouts(nowMs);
+  }
+}
+
+void ClientShard::ThreadFunc()
+{
+  while (!_shouldStop) {
+    _eventLoop->Wait(static_cast<int>(TimeoutsCheckPeriodMs));
+    
+    ServeRequests();
+  }
+}
+
+void ClientShard::RegisterClient(int clientFd)
+{
+  if (!_eventLoop->Add(clientFd, ReadEvents, this)) {
+    _clientsNumber -= 1;
+    ::close(clientFd);
+    return;
+  }
+  
+  if (_clientIdxByFd.size() <= static_cast<size_t>(clientFd)) {
+    _clientIdxByFd.resize(clientFd + 1, InvalidClientIdx);
+  }
+  
+  _clientIdxByFd[clientFd] = static_cast<uint32_t>(_clients.size());
+  _clients.emplace_back();
+  
+  ClientInfo& clientInfo = _clients.back();
+  clientInfo.Fd = clientFd;
+  clientInfo.StateIdx = AcquireClientState();
+  
+  RequestInfo& requestInfo = GetState(clientInfo).Request;
+  requestInfo.Parser.Reset();
+  requestInfo.PendingData.clear();
+  requestInfo.StartMs = Clock::GetMonotonicTimeMs();
+  ResetResponse(clientInfo);
+  
+  ReadAndParseRequest(clientInfo);
+}
+
+uint32_t ClientShard::AcquireClientState()
+{
+  if (_freeClientStateIdxs.empty()) {
+    _clientStates.emplace_back();
+    return static_cast<uint32_t>(_clientStates.size() - 1);
+  }
+  
+  const uint32_t stateIdx = _freeClientStateIdxs.back();
+  _freeClientStateIdxs.pop_back();
+  
+  return stateIdx;
+}
+
+void ClientShard::ResetResponse(ClientInfo& clientInfo)
+{
+  ResponseInfo& responseInfo = GetState(clientInfo).Response;
+  
+  std::string header;
+  std::string pongPayload;
+  std::vector<ResponseInfo::ZeroCopyPin> zeroCopyPins;
+  header.swap(responseInfo.Header);
+  pongPayload.swap(responseInfo.PongPayload);
+  zeroCopyPins.swap(responseInfo.ZeroCopyPins);
+  
+  responseInfo = ResponseInfo();
+  
+  header.clear();
+  pongPayload.clear();
+  zeroCopyPins.clear();
+  responseInfo.Header.swap(header);
+  responseInfo.PongPayload.swap(pongPayload);
+  responseInfo.ZeroCopyPins.swap(zeroCopyPins);
+  
+  clientInfo.WaitsForWritable = false;
+  clientInfo.IsDowngraded = false;
+  clientInfo.CameraIdx = 0U;
+  clientInfo.SlotIdx = ResponseInfo::InvalidBufferIdx;
+  clientInfo.FrameNumber = 0U;
+  clientInfo.FrameStartMs = 0U;
+}
+
+ClientShard::ClientInfo* ClientShard::FindClient(int clientFd)
+{
+  if (clientFd < 0 || static_cast<size_t>(clientFd) >= _clientIdxByFd.size()) {
+    return nullptr;
+  }
+  
+  const uint32_t clientIdx = _clientIdxByFd[clientFd];
+  
+  return clientIdx != InvalidClientIdx ? &_clients[clientIdx] : nullptr;
+}
+
+void ClientShard::CloseBusyClientsNow(uint32_t cameraMask)
+{
+  // A closed client is replaced by the last one so the index is not advanced.
+  size_t clientIdx = 0;
+  while (clientIdx < _clients.size()) {
+    const ClientInfo& client = _clients[clientIdx];
+    const ResponseInfo& responseInfo = GetState(client).Response;
+    
+    // Frames sent with MSG_ZEROCOPY are never copied.
+    bool holdsVideoBuffer = !responseInfo.ZeroCopyPins.empty();
+    if (client.SlotIdx != ResponseInfo::InvalidBufferIdx) {
+      const FrameQueue::QueueItem* queueItem = responseInfo.Queue->GetBuffer(client.SlotIdx);
+      holdsVideoBuffer = holdsVideoBuffer || (queueItem != nullptr && nullptr == queueItem->CopiedFrame);
+    }
+    
+    if (client.IsServed && holdsVideoBuffer && (cameraMask & (1U << client.CameraIdx))) {
+      CloseClient(client.Fd);
+      
+      Tracer::Log("Closed slow client.\n");
+    }
+    else {
+      ++clientIdx;
+    }
+  }
+}
+
+void ClientShard::CheckTimeouts(uint64_t nowMs)
+{
+  // A closed client is replaced by the last one so the index is not advanced.
+  size_t clientIdx = 0;
+  while (clientIdx < _clients.size()) {
+    ClientInfo& client = _clients[clientIdx];
+    ClientState& state = GetState(client);
+    ResponseInfo& responseInfo = state.Response;
+    
+    if (!client.IsServed && _config.IdleTimeoutMs != 0 && nowMs - state.Request.StartMs >= _config.IdleTimeoutMs) {
+      _idleClosedClientsNumber += 1;
+      CloseClient(client.Fd);
+      continue;
+    }
+    
+    if (client.IsServed && responseInfo.IsWaitingForFrame && nowMs >= responseInfo.WaitEndMs) {
+      responseInfo.IsWaitingForFrame = false;
+      responseInfo.Header = responseInfo.HasLastSequence ? 
+        CreateNotModifiedResponse(responseInfo.IsKeepAlive, responseInfo.LastSequence) :
+        CreateSimpleResponse("503 Service Unavailable", responseInfo.IsKeepAlive, "There is no frame.\n");
+      
+      if (responseInfo.Header.empty() || !ServeClient(client)) {
+        CloseClient(client.Fd);
+        continue;
+      }
+    }
+    else if (client.IsServed && responseInfo.IsPaced && !client.WaitsForWritable && !ServeClient(client)) {
+      CloseClient(client.Fd);
+      continue;
+    }
+    
+    ++clientIdx;
+  }
+}
+
+void ClientShard::ServeNewBuffer(uint32_t cameraMask)
+{
+  // Clients which wait for writable socket will be served by the event loop.
+  // Other ones are idle and the new buffer should be sent to them right now.
+  
+  // Lag of clients is checked on every frame so slow clients do not need timers.
+  // Only ClientInfo is read here; states are touched by clients which get the frame.
+  const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+  uint64_t maxFramesBehind = 0;
+  
+  size_t clientIdx = 0;
+  while (clientIdx < _clients.size()) {
+    ClientInfo& client = _clients[clientIdx];
+    
+    if (client.IsServed && client.SlotIdx != ResponseInfo::InvalidBufferIdx) {
+      const uint64_t newestFrameNumber = _cameras[client.CameraIdx].Queue->GetNewestFrameNumber();
+      const uint64_t sendingTimeMs = nowMs - client.FrameStartMs;
+      
+      if (_config.DisconnectLagMs != 0 && sendingTimeMs >= _config.DisconnectLagMs) {
+        Tracer::Log("Closed slow client: a frame is being sent for %u ms.\n", static_cast<uint32_t>(sendingTimeMs));
+        
+        _disconnectedClientsNumber += 1;
+        
+        // The closed client is replaced by the last one.
+        CloseClient(client.Fd);
+        continue;
+      }
+      
+      if (_config.DowngradeLagMs != 0 && sendingTimeMs >= _config.DowngradeLagMs && !client.IsDowngraded) {
+        client.IsDowngraded = true;
+        _downgradedClientsNumber += 1;
+      }
+      
+      maxFramesBehind = std::max(maxFramesBehind, newestFrameNumber - client.FrameNumber);
+    }
+    
+    // Clients of other cameras have nothing new.
+    const bool hasNewBuffer = 0 != (cameraMask & (1U << client.CameraIdx));
+    
+    if (client.IsServed && hasNewBuffer && !client.WaitsForWritable && !ServeClient(client)) {
+      // The closed client is replaced by the last one.
+      CloseClient(client.Fd);
+    }
+    else {
+      ++clientIdx;
+    }
+  }
+  
+  _maxFramesBehind = maxFramesBehind;
+}
+
+void ClientShard::OnEvent(int fd, uint32_t events)
+{
+  ClientInfo* client = FindClient(fd);
+  if (nullptr == client) {
+    return;
+  }
+  
+  if (client->IsServed) {
+    ResponseInfo& responseInfo = GetState(*client).Response;
+    
+    // MSG_ZEROCOPY completions are reported via error queue.
+    if ((events & EPOLLERR) && (responseInfo.IsZeroCopy || !responseInfo.ZeroCopyPins.empty())) {
+      ReadZeroCopyNotifications(fd, responseInfo);
+    }
+    
+    if (responseInfo.IsWebSocket && (events & (EPOLLIN | EPOLLRDHUP)) && !ReadWebSocketMessages(*client)) {
+      CloseClient(fd);
+      return;
+    }
+    
+    // Errors are detected by write() so EPOLLERR and EPOLLHUP are handled as EPOLLOUT.
+    if (!ServeClient(*client)) {
+      CloseClient(fd);
+    }
+  }
+  else {
+    ReadAndParseRequest(*client);
+  }
+}
+
+void ClientShard::ReadAndParseRequest(ClientInfo& clientInfo)
+{
+  const int clientFd = clientInfo.Fd;
+  RequestInfo& requestInfo = GetState(clientInfo).Request;
+  
+  bool isParsed = false;
+  bool isBroken = false;
+  
+  // The socket is edge triggered so read all available data.
+  while (!isParsed && !isBroken) {
+    ssize_t readResult = ::read(clientFd, _readBuffer.data(), _readBuffer.size());
+    if (readResult > 0) {
+      requestInfo.PendingData.append(reinterpret_cast<const char*>(_readBuffer.data()), static_cast<size_t>(readResult));
+      
+      isParsed = ParsePendingData(requestInfo);
+    }
+    else if (-1 == readResult && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    else if (-1 == readResult && errno == EINTR) {
+      continue;
+    }
+    else {
+      // Something wrong with a client (or it closed connection).
+      isBroken = true;
+    }
+  }
+  
+  if (isBroken) {
+    CloseClient(clientFd);
+  }
+  else if (isParsed) {
+    clientInfo.IsServed = true;
+    
+    if (!StartResponse(clientInfo) || 
+        !_eventLoop->Modify(clientFd, GetServedEvents(GetState(clientInfo).Response, false)) || 
+        !ServeClient(clientInfo)) {
+      CloseClient(clientFd);
+    }
+  }
+}
+
+bool ClientShard::ParsePendingData(RequestInfo& requestInfo)
+{
+  HttpRequestParser& parser = requestInfo.Parser;
+  
+  // The rest of data belongs to the next requests.
+  const size_t consumed = parser.Parse(requestInfo.PendingData.data(), requestInfo.PendingData.size());
+  requestInfo.PendingData.erase(0, consumed);
+  
+  return (parser.GetState() == HttpRequestParser::Completed || 
+          parser.GetState() == HttpRequestParser::Failed);
+}
+
+bool ClientShard::StartResponse(ClientInfo& clientInfo)
+{
+  ClientState& state = GetState(clientInfo);
+  const HttpRequestParser& parser = state.Request.Parser;
+  ResponseInfo& responseInfo = state.Response;
+  
+  responseInfo.IsStream = false;
+  responseInfo.HeaderBytesSent = 0;
+  responseInfo.RateLimitBytes = _config.RateLimitBytes;
+  
+  _requestsNumber += 1;
+  
+  // The rest of a broken request can not be skipped so the connection is closed.
+  if (parser.GetState() != HttpRequestParser::Completed) {
+    responseInfo.IsKeepAlive = false;
+    responseInfo.Header = CreateSimpleResponse("400 Bad Request", false, "Bad request.\n");
+    return true;
+  }
+  
+  responseInfo.IsKeepAlive = parser.IsKeepAlive();
+  const bool isKeepAlive = responseInfo.IsKeepAlive;
+  
+  if (parser.GetMethod() != "GET") {
+    responseInfo.Header = CreateSimpleResponse("405 Method Not Allowed", isKeepAlive, "Only GET is supported.\n");
+    return true;
+  }
+  
+  // "/cam/<name>/<resource>" is a resource of the named camera.
+  std::string path = parser.GetPath();
+  clientInfo.CameraIdx = 0;
+  
+  if (0 == path.compare(0, sizeof(CameraRoutePrefix) - 1, CameraRoutePrefix)) {
+    const size_t nameEnd = path.find('/', sizeof(CameraRoutePrefix) - 1);
+    const std::string name = path.substr(sizeof(CameraRoutePrefix) - 1, nameEnd - (sizeof(CameraRoutePrefix) - 1));
+    
+    uint32_t cameraIdx = 0;
+    while (cameraIdx < _cameras.size() && _cameras[cameraIdx].Name != name) {
+      ++cameraIdx;
+    }
+    
+    if (name.empty() || cameraIdx == _cameras.size()) {
+      responseInfo.Header = CreateSimpleResponse("404 Not Found", isKeepAlive, "Unknown camera.\n");
+      return true;
+    }
+    
+    clientInfo.CameraIdx = cameraIdx;
+    path = (nameEnd != std::string::npos) ? path.substr(nameEnd) : std::string("/");
+  }
+  
+  responseInfo.Queue = _cameras[clientInfo.CameraIdx].Queue;
+  
+  const RouteInfo* route = nullptr;
+  for (const RouteInfo& routeInfo : Routes) {
+    if (path == routeInfo.Path) {
+      route = &routeInfo;
+      break;
+    }
+  }
+  
+  if (nullptr == route) {
+    responseInfo.Header = CreateSimpleResponse("404 Not Found", isKeepAlive, "Not found.\n");
+    return true;
+  }
+  
+  switch (route->Id) {
+    case StreamRoute:
+      if (!SetupStreamLimits(parser, responseInfo)) {
+        responseInfo.Header = CreateSimpleResponse("400 Bad Request", isKeepAlive, "Invalid fps, every or rate value.\n");
+        break;
+      }
+      
+      responseInfo.IsStream = true;
+      responseInfo.IsKeepAlive = false;
+      responseInfo.Header.assign(StreamHeader, sizeof(StreamHeader) - 1);
+      
+      // Only long living streams benefit from MSG_ZEROCOPY. Other responses are 
+      // closed right after sending and closing would drop pinned data.
+      if (_config.IsZeroCopy) {
+        int zeroCopyValue = 1;
+        responseInfo.IsZeroCopy = 
+          (0 == ::setsockopt(clientInfo.Fd, SOL_SOCKET, SO_ZEROCOPY, &zeroCopyValue, sizeof(zeroCopyValue)));
+      }
+      
+      if (_config.IsLatencyMode) {
+        responseInfo.IsLatencyMode = 
+          (0 == ::setsockopt(clientInfo.Fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &NotSentLowatBytes, sizeof(NotSentLowatBytes)));
+      }
+      
+      break;
+    
+    case SnapshotRoute:
+      {
+        // The newest frame is newer than any timestamp.
+        const timeval oldestTimestamp = {0, 0};
+        FrameQueue::QueueItem* queueItem = responseInfo.Queue->SelectBufferForSending(oldestTimestamp);
+        if (nullptr == queueItem) {
+          // Capturing can be stopped while there are no clients. The response
+          // is started by SendData() when a frame is queued or gets 503 on timeout.
+          responseInfo.IsWaitingForFrame = true;
+          responseInfo.WaitEndMs = Clock::GetMonotonicTimeMs() + SnapshotWaitTimeoutMs;
+          break;
+        }
+        
+        const std::string* ifNoneMatch = parser.FindHeader("If-None-Match");
+        uint32_t lastSequence = 0;
+        if (ifNoneMatch != nullptr && ParseSequence(*ifNoneMatch, lastSequence) && 
+            lastSequence == queueItem->Sequence) {
+          responseInfo.Queue->ReleaseBuffer(queueItem);
+          responseInfo.Header = CreateNotModifiedResponse(isKeepAlive, lastSequence);
+          break;
+        }
+        
+        StartFrameResponse(clientInfo, queueItem);
+      }
+      
+      break;
+    
+    case NextFrameRoute:
+      {
+        responseInfo.HasLastSequence = GetLastSequence(parser, responseInfo.LastSequence);
+        
+        const timeval oldestTimestamp = {0, 0};
+        FrameQueue::QueueItem* queueItem = responseInfo.Queue->SelectBufferForSending(oldestTimestamp);
+        
+        // Any other sequence number means that the client has an older frame
+        // (or streaming was restarted) so the newest frame is sent at once.
+        if (queueItem != nullptr && responseInfo.HasLastSequence && 
+            queueItem->Sequence == responseInfo.LastSequence) {
+          responseInfo.Timestamp = queueItem->Timestamp;
+          responseInfo.Queue->ReleaseBuffer(queueItem);
+          queueItem = nullptr;
+        }
+        
+        if (queueItem != nullptr) {
+          StartFrameResponse(clientInfo, queueItem);
+        }
+        else {
+          // The response is started by SendData() when a newer frame is queued.
+          responseInfo.IsWaitingForFrame = true;
+          responseInfo.WaitEndMs = Clock::GetMonotonicTimeMs() + LongPollTimeoutMs;
+        }
+      }
+      
+      break;
+    
+    case SdpRoute:
+      {
+        // RTP is sent only for the first camera.
+        const std::string sdp = (_config.GetSdpText && 0 == clientInfo.CameraIdx) ? 
+          _config.GetSdpText() : std::string();
+        responseInfo.Header = sdp.empty() ? 
+          CreateSimpleResponse("404 Not Found", isKeepAlive, "RTP is disabled.\n") :
+          CreateSimpleResponse("200 OK", isKeepAlive, sdp, "application/sdp");
+      }
+      
+      break;
+    
+    case WebSocketRoute:
+      if (!SetupStreamLimits(parser, responseInfo)) {
+        responseInfo.Header = CreateSimpleResponse("400 Bad Request", isKeepAlive, "Invalid fps, every or rate value.\n");
+        break;
+      }
+      
+      StartWebSocketResponse(parser, responseInfo);
+      
+      // MSG_ZEROCOPY is not used as message headers are rewritten for every frame 
+      // while the kernel could still reference them.
+      if (responseInfo.IsWebSocket && _config.IsLatencyMode) {
+        responseInfo.IsLatencyMode = 
+          (0 == ::setsockopt(clientInfo.Fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &NotSentLowatBytes, sizeof(NotSentLowatBytes)));
+      }
+      
+      break;
+    
+    case StatsRoute:
+      responseInfo.Header = CreateSimpleResponse("200 OK", isKeepAlive, _config.GetStatsText ? _config.GetStatsText() : std::string());
+      break;
+  }
+  
+  // Clients which wait for frames keep capturing on demand running.
+  const bool isWatching = responseInfo.IsStream || responseInfo.IsWaitingForFrame || 
+                          clientInfo.SlotIdx != ResponseInfo::InvalidBufferIdx;
+  SetWatching(clientInfo, isWatching);
+  
+  return responseInfo.IsWaitingForFrame || !responseInfo.Header.empty();
+}
+
+bool ClientShard::SetupStreamLimits(const HttpRequestParser& parser, ResponseInfo& responseInfo)
+{
+  // Frame rates below 1 fps (e.g. "fps=0.2") are allowed.
+  const std::string* fps = parser.FindQueryParameter("fps");
+  if (fps != nullptr) {
+    char* rest = nullptr;
+    const double fpsValue = std::strtod(fps->c_str(), &rest);
+    if (fps->empty() || *rest != 0 || !(fpsValue > 0.001)) {
+      return false;
+    }
+    
+    responseInfo.FrameIntervalUs = static_cast<uint64_t>(1000000.0 / fpsValue);
+  }
+  
+  const std::string* every = parser.FindQueryParameter("every");
+  if (every != nullptr) {
+    char* rest = nullptr;
+    const unsigned long everyValue = std::strtoul(every->c_str(), &rest, 10);
+    if (every->empty() || *rest != 0 || 0 == everyValue || everyValue > 0xFFFFFFFFUL) {
+      return false;
+    }
+    
+    responseInfo.EveryFrames = static_cast<uint32_t>(everyValue);
+  }
+  
+  // A client can only lower the server limit.
+  const std::string* rate = parser.FindQueryParameter("rate");
+  if (rate != nullptr) {
+    char* rest = nullptr;
+    const unsigned long rateValue = std::strtoul(rate->c_str(), &rest, 10);
+    if (rate->empty() || *rest != 0 || 0 == rateValue || rateValue > 0xFFFFFFFFUL / 1024) {
+      return false;
+    }
+    
+    const uint32_t rateBytes = static_cast<uint32_t>(rateValue * 1024);
+    if (0 == responseInfo.RateLimitBytes || rateBytes < responseInfo.RateLimitBytes) {
+      responseInfo.RateLimitBytes = rateBytes;
+    }
+  }
+  
+  return true;
+}
+
+void ClientShard::RefillTokens(ResponseInfo& responseInfo, uint64_t nowMs)
+{
+  const uint64_t bucketSize = std::max(responseInfo.RateLimitBytes * BucketTimeMs / 1000, MinBucketBytes);
+  
+  if (0 == responseInfo.TokensUpdateMs) {
+    responseInfo.Tokens = bucketSize;
+    responseInfo.TokensUpdateMs = nowMs;
+    return;
+  }
+  
+  // The time is not advanced till at least one token is added so frequent calls do not lose tokens.
+  const uint64_t newTokens = responseInfo.RateLimitBytes * (nowMs - responseInfo.TokensUpdateMs) / 1000;
+  if (newTokens > 0) {
+    responseInfo.Tokens = std::min(responseInfo.Tokens + newTokens, bucketSize);
+    responseInfo.TokensUpdateMs = nowMs;
+  }
+}
+
+void ClientShard::StartWebSocketResponse(const HttpRequestParser& parser, ResponseInfo& responseInfo)
+{
+  const std::string* upgrade = parser.FindHeader("Upgrade");
+  const std::string* version = parser.FindHeader("Sec-WebSocket-Version");
+  const std::string* key = parser.FindHeader("Sec-WebSocket-Key");
+  
+  if (nullptr == upgrade || 0 != ::strcasecmp(upgrade->c_str(), "websocket") || 
+      nullptr == version || *version != "13" || nullptr == key || key->empty()) {
+    responseInfo.Header = CreateSimpleResponse("400 Bad Request", responseInfo.IsKeepAlive, "WebSocket handshake is expected.\n");
+    return;
+  }
+  
+  const std::string* flow = parser.FindQueryParameter("flow");
+  if (flow != nullptr && *flow != "0" && *flow != "1") {
+    responseInfo.Header = CreateSimpleResponse("400 Bad Request", responseInfo.IsKeepAlive, "Invalid flow value.\n");
+    return;
+  }
+  
+  char header[sizeof(WebSocketHandshakeTemplate) + 64];
+  int headerSize = std::snprintf(header, sizeof(header), WebSocketHandshakeTemplate, 
+                                 WebSocket::CreateAcceptKey(*key).c_str());
+  if (headerSize <= 0 || static_cast<size_t>(headerSize) >= sizeof(header)) {
+    return;
+  }
+  
+  responseInfo.IsStream = true;
+  responseInfo.IsKeepAlive = false;
+  responseInfo.IsWebSocket = true;
+  responseInfo.Header.assign(header, headerSize);
+  
+  // The first frame is sent without a request so the client gets a picture at once.
+  responseInfo.IsFlowControlled = (flow != nullptr && *flow == "1");
+  responseInfo.Credits = 1;
+}
+
+void ClientShard::StartWebSocketMessage(ResponseInfo& responseInfo, FrameQueue::QueueItem* queueItem)
+{
+  // The multipart header and the boundary (the first and the last pieces) are not sent.
+  uint64_t payloadSize = WebSocketFrameInfoSize;
+  for (size_t dataIdx = 1; dataIdx + 1 < queueItem->Data.size(); ++dataIdx) {
+    payloadSize += queueItem->Data[dataIdx].Size;
+  }
+  
+  uint8_t header[WebSocket::MaxFrameHeaderSize + WebSocketFrameInfoSize];
+  uint32_t headerSize = WebSocket::CreateFrameHeader(WebSocket::BinaryFrame, payloadSize, header);
+  
+  const uint64_t timestampUs = ToMicroseconds(queueItem->Timestamp);
+  for (uint32_t idx = 0; idx < 8; ++idx) {
+    header[headerSize++] = static_cast<uint8_t>(timestampUs >> (56 - idx * 8));
+  }
+  
+  for (uint32_t idx = 0; idx < 4; ++idx) {
+    header[headerSize++] = static_cast<uint8_t>(queueItem->Sequence >> (24 - idx * 8));
+  }
+  
+  responseInfo.Header.assign(reinterpret_cast<const char*>(header), headerSize);
+  responseInfo.HeaderBytesSent = 0;
+  responseInfo.DataBufferIdx = 1;
+  
+  if (responseInfo.IsFlowControlled) {
+    responseInfo.Credits -= 1;
+  }
+}
+
+bool ClientShard::StartWebSocketControlMessage(ResponseInfo& responseInfo)
+{
+  uint8_t header[WebSocket::MaxFrameHeaderSize + MaxWebSocketPayloadSize];
+  uint32_t headerSize = 0;
+  
+  if (responseInfo.HasPendingClose) {
+    // The status code of the client is echoed (RFC 6455, 5.5.1). Nothing is sent after Close.
+    const uint32_t payloadSize = (responseInfo.CloseStatus != 0) ? 2 : 0;
+    headerSize = WebSocket::CreateFrameHeader(WebSocket::CloseFrame, payloadSize, header);
+    if (payloadSize != 0) {
+      header[headerSize++] = static_cast<uint8_t>(responseInfo.CloseStatus >> 8);
+      header[headerSize++] = static_cast<uint8_t>(responseInfo.CloseStatus);
+    }
+    
+    responseInfo.HasPendingClose = false;
+    responseInfo.HasPendingPong = false;
+    responseInfo.IsClosing = true;
+  }
+  else if (responseInfo.HasPendingPong) {
+    headerSize = WebSocket::CreateFrameHeader(WebSocket::PongFrame, responseInfo.PongPayload.size(), header);
+    std::memcpy(header + headerSize, responseInfo.PongPayload.data(), responseInfo.PongPayload.size());
+    headerSize += static_cast<uint32_t>(responseInfo.PongPayload.size());
+    
+    responseInfo.HasPendingPong = false;
+  }
+  else {
+    return false;
+  }
+  
+  responseInfo.Header.assign(reinterpret_cast<const char*>(header), headerSize);
+  responseInfo.HeaderBytesSent = 0;
+  
+  return true;
+}
+
+bool ClientShard::ReadWebSocketMessages(ClientInfo& clientInfo)
+{
+  const int clientFd = clientInfo.Fd;
+  ClientState& state = GetState(clientInfo);
+  std::string& pendingData = state.Request.PendingData;
+  ResponseInfo& responseInfo = state.Response;
+  
+  // The socket is edge triggered so read all available data.
+  while (true) {
+    ssize_t readResult = ::read(clientFd, _readBuffer.data(), _readBuffer.size());
+    if (readResult > 0) {
+      pendingData.append(reinterpret_cast<const char*>(_readBuffer.data()), static_cast<size_t>(readResult));
+    }
+    else if (-1 == readResult && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    else if (-1 == readResult && errno == EINTR) {
+      continue;
+    }
+    else {
+      // Something wrong with a client (or it closed connection). A client which 
+      // sent Close and shut its side down still gets the echoed Close.
+      return responseInfo.HasPendingClose;
+    }
+    
+    // Messages after Close are ignored.
+    while (!responseInfo.HasPendingClose && !responseInfo.IsClosing) {
+      WebSocket::ClientFrame frame;
+      bool isValid = true;
+      const size_t consumed = WebSocket::ParseClientFrame(pendingData.data(), pendingData.size(), 
+                                                          MaxWebSocketPayloadSize, frame, isValid);
+      if (!isValid) {
+        return false;
+      }
+      
+      if (0 == consumed) {
+        break;
+      }
+      
+      pendingData.erase(0, consumed);
+      
+      switch (frame.FrameOpcode) {
+        case WebSocket::TextFrame:
+        case WebSocket::BinaryFrame:
+          if (responseInfo.IsFlowControlled && frame.Payload == "ready") {
+            responseInfo.Credits = std::min(responseInfo.Credits + 1, MaxWebSocketCredits);
+          }
+          
+          break;
+        
+        case WebSocket::PingFrame:
+          responseInfo.HasPendingPong = true;
+          responseInfo.PongPayload = frame.Payload;
+          break;
+        
+        case WebSocket::CloseFrame:
+          responseInfo.HasPendingClose = true;
+          responseInfo.CloseStatus = (frame.Payload.size() >= 2) ? 
+            static_cast<uint16_t>((static_cast<uint8_t>(frame.Payload[0]) << 8) | static_cast<uint8_t>(frame.Payload[1])) : 0;
+          break;
+        
+        default:
+          break;
+      }
+    }
+  }
+  
+  return true;
+}
+
+void ClientShard::StartFrameResponse(ClientInfo& clientInfo, FrameQueue::QueueItem* queueItem)
+{
+  ResponseInfo& responseInfo = GetState(clientInfo).Response;
+  
+  char eTag[sizeof(ETagTemplate) + 16];
+  int eTagSize = std::snprintf(eTag, sizeof(eTag), ETagTemplate, queueItem->Sequence);
+  
+  responseInfo.Header.assign(SnapshotHeader, sizeof(SnapshotHeader) - 1);
+  responseInfo.Header.append(responseInfo.IsKeepAlive ? KeepAliveHeader : CloseHeader);
+  if (eTagSize > 0 && static_cast<size_t>(eTagSize) < sizeof(eTag)) {
+    responseInfo.Header.append(eTag, eTagSize);
+  }
+  
+  responseInfo.HeaderBytesSent = 0;
+  responseInfo.DataBufferBytesSent = 0;
+  responseInfo.DataBufferIdx = 0;
+  responseInfo.Timestamp = queueItem->Timestamp;
+  clientInfo.SlotIdx = queueItem->SlotIdx;
+  clientInfo.FrameNumber = queueItem->FrameNumber;
+  clientInfo.FrameStartMs = Clock::GetMonotonicTimeMs();
+}
+
+bool ClientShard::ServeClient(ClientInfo& clientInfo)
+{
+  // Pipelined requests which are already received are served one by one.
+  while (true) {
+    if (!SendData(clientInfo)) {
+      return false;
+    }
+    
+    if (!IsResponseSent(clientInfo)) {
+      return true;
+    }
+    
+    ClientState& state = GetState(clientInfo);
+    if (!state.Response.IsKeepAlive) {
+      return false;
+    }
+    
+    // Single responses never use MSG_ZEROCOPY and the frame is released so
+    // the response can be simply reset. The token bucket is kept for the connection.
+    const uint64_t tokens = state.Response.Tokens;
+    const uint64_t tokensUpdateMs = state.Response.TokensUpdateMs;
+    
+    SetWatching(clientInfo, false);
+    
+    clientInfo.IsServed = false;
+    ResetResponse(clientInfo);
+    state.Response.Tokens = tokens;
+    state.Response.TokensUpdateMs = tokensUpdateMs;
+    state.Request.Parser.Reset();
+    state.Request.StartMs = Clock::GetMonotonicTimeMs();
+    
+    if (!ParsePendingData(state.Request)) {
+      // Re-armed EPOLLIN is reported at once if the next request is already in the socket.
+      return _eventLoop->Modify(clientInfo.Fd, ReadEvents);
+    }
+    
+    clientInfo.IsServed = true;
+    
+    if (!StartResponse(clientInfo)) {
+      return false;
+    }
+  }
+}
+
+bool ClientShard::IsResponseSent(const ClientInfo& clientInfo)
+{
+  const ResponseInfo& responseInfo = GetState(clientInfo).Response;
+  
+  return !responseInfo.IsStream && 
+         !responseInfo.IsWaitingForFrame && 
+         ResponseInfo::InvalidBufferIdx == clientInfo.SlotIdx && 
+         responseInfo.HeaderBytesSent == responseInfo.Header.size();
+}
+
+bool ClientShard::SendData(ClientInfo& clientInfo)
+{
+  const int clientFd = clientInfo.Fd;
+  ResponseInfo& responseInfo = GetState(clientInfo).Response;
+  
+  while (true) {
+    FrameQueue::QueueItem* queueItem = nullptr;
+    
+    if (IsResponseSent(clientInfo)) {
+      // The caller closes the connection or switches it to the next request.
+      return true;
+    }
+    
+    if (responseInfo.IsWaitingForFrame) {
+      queueItem = responseInfo.Queue->SelectBufferForSending(responseInfo.Timestamp);
+      if (nullptr == queueItem) {
+        return true;
+      }
+      
+      responseInfo.IsWaitingForFrame = false;
+      StartFrameResponse(clientInfo, queueItem);
+    }
+    
+    // The header is created when a response is started (or a WebSocket message is selected).
+    uint32_t headerSize = static_cast<uint32_t>(responseInfo.Header.size());
+    
+    // A single frame (if any) is selected by StartResponse().
+    if (responseInfo.IsStream && ResponseInfo::InvalidBufferIdx == clientInfo.SlotIdx) {
+      const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+      
+      // WebSocket control messages are sent between frames (a message can not be interrupted).
+      if (responseInfo.IsWebSocket && responseInfo.HeaderBytesSent == headerSize) {
+        if (responseInfo.IsClosing) {
+          // The echoed Close is sent so the connection is closed.
+          return false;
+        }
+        
+        if (StartWebSocketControlMessage(responseInfo)) {
+          headerSize = static_cast<uint32_t>(responseInfo.Header.size());
+        }
+      }
+      
+      if (responseInfo.IsLatencyMode && responseInfo.HeaderBytesSent == headerSize && !IsSocketDrained(clientFd)) {
+        // EPOLLOUT is reported when unsent data drops below TCP_NOTSENT_LOWAT.
+        // The newest frame is selected then instead of queueing a stale one.
+        if (responseInfo.Queue->GetNewestFrameNumber() != clientInfo.FrameNumber) {
+          _skippedFramesNumber += 1;
+        }
+        
+        SetWaitsForWritable(clientInfo, true);
+        return true;
+      }
+      
+      // A flow controlled WebSocket client waits for a "ready" message.
+      if (responseInfo.IsWebSocket && responseInfo.HeaderBytesSent == headerSize && 0 == responseInfo.Credits) {
+        SetWaitsForWritable(clientInfo, false);
+        return true;
+      }
+      
+      if (responseInfo.HeaderBytesSent == headerSize && ShouldSkipFrame(clientInfo, nowMs)) {
+        // The client will get the next frame.
+        if (responseInfo.Queue->GetNewestFrameNumber() != clientInfo.FrameNumber) {
+          _skippedFramesNumber += 1;
+        }
+        
+        SetWaitsForWritable(clientInfo, false);
+        return true;
+      }
+      
+      // Decimated clients wait for a due frame without selecting (and locking) the queue.
+      const bool isFrameDue = (responseInfo.EveryFrames <= 1 || 0 == clientInfo.FrameNumber ||
+        responseInfo.Queue->GetNewestFrameNumber() - clientInfo.FrameNumber >= responseInfo.EveryFrames);
+      
+      timeval selectAfter = responseInfo.Timestamp;
+      if (responseInfo.FrameIntervalUs != 0 && responseInfo.NextFrameTimeUs > ToMicroseconds(selectAfter)) {
+        selectAfter = ToTimeval(responseInfo.NextFrameTimeUs - 1);
+      }
+      
+      // A WebSocket message header replaces the handshake so the handshake is sent first.
+      const bool canSelect = isFrameDue && (!responseInfo.IsWebSocket || responseInfo.HeaderBytesSent == headerSize);
+      
+      queueItem = canSelect ? responseInfo.Queue->SelectBufferForSending(selectAfter) : nullptr;
+      if (queueItem != nullptr) {
+        responseInfo.DataBufferBytesSent = 0;
+        responseInfo.DataBufferIdx = 0;
+        responseInfo.Timestamp = queueItem->Timestamp;
+        clientInfo.SlotIdx = queueItem->SlotIdx;
+        clientInfo.FrameNumber = queueItem->FrameNumber;
+        clientInfo.FrameStartMs = nowMs;
+        
+        if (responseInfo.FrameIntervalUs != 0) {
+          // Due times follow a fixed cadence so the rate does not drift down 
+          // because of frame spacing. A client which is behind is resynchronized.
+          const uint64_t frameTimeUs = ToMicroseconds(queueItem->Timestamp);
+          responseInfo.NextFrameTimeUs += responseInfo.FrameIntervalUs;
+          if (responseInfo.NextFrameTimeUs + responseInfo.FrameIntervalUs <= frameTimeUs) {
+            responseInfo.NextFrameTimeUs = frameTimeUs + responseInfo.FrameIntervalUs;
+          }
+        }
+        
+        if (responseInfo.IsWebSocket) {
+          StartWebSocketMessage(responseInfo, queueItem);
+          headerSize = static_cast<uint32_t>(responseInfo.Header.size());
+        }
+      }
+      else if (responseInfo.HeaderBytesSent == headerSize) {
+        // Stop sending data to the current client as there is no data for sending.
+        SetWaitsForWritable(clientInfo, false);
+        return true;
+      }
+    }
+    
+    if (clientInfo.SlotIdx != ResponseInfo::InvalidBufferIdx && nullptr == queueItem) {
+      queueItem = responseInfo.Queue->GetBuffer(clientInfo.SlotIdx);
+      if (nullptr == queueItem) {
+        // Stop sending data to the current client as unexpected problem is detected.
+        Tracer::Log("Buffer for client is not found.\n");
+        return false;
+      }
+    }
+    
+    // A rate limited client sends only as many bytes as it has tokens.
+    if (responseInfo.RateLimitBytes != 0) {
+      RefillTokens(responseInfo, Clock::GetMonotonicTimeMs());
+      
+      responseInfo.IsPaced = (0 == responseInfo.Tokens);
+      if (responseInfo.IsPaced) {
+        SetWaitsForWritable(clientInfo, false);
+        return true;
+      }
+    }
+    
+    // Collect the rest of HTTP header and the rest of the frame and send them by one call.
+    
+    iovec ioVectors[MaxIoVectors];
+    int ioVectorsNumber = 0;
+    
+    if (responseInfo.HeaderBytesSent < headerSize) {
+      ioVectors[ioVectorsNumber].iov_base = const_cast<char*>(responseInfo.Header.data() + responseInfo.HeaderBytesSent);
+      ioVectors[ioVectorsNumber].iov_len = headerSize - responseInfo.HeaderBytesSent;
+      ++ioVectorsNumber;
+    }
+    
+    // A single frame response and a WebSocket message do not need the boundary.
+    const bool hasBoundary = responseInfo.IsStream && !responseInfo.IsWebSocket;
+    const size_t dataEndIdx = queueItem != nullptr ? 
+      (hasBoundary ? queueItem->Data.size() : queueItem->Data.size() - 1) : 0;
+    
+    if (queueItem != nullptr) {
+      // The frame can be copied out of the video buffer by FrameQueue.
+      // It does not return the video buffer while MappedReaders is not zero.
+      queueItem->MappedReaders += 1;
+      const uint8_t* copiedFrame = queueItem->CopiedFrame;
+      
+      uint32_t copiedFrameOffset = 0;
+      for (size_t dataIdx = 0; dataIdx < responseInfo.DataBufferIdx; ++dataIdx) {
+        copiedFrameOffset += queueItem->Data[dataIdx].Size;
+      }
+      
+      uint32_t bytesSent = responseInfo.DataBufferBytesSent;
+      
+      for (size_t dataIdx = responseInfo.DataBufferIdx; 
+           dataIdx < dataEndIdx && ioVectorsNumber < MaxIoVectors; ++dataIdx) {
+        const Buffer& buffer = queueItem->Data[dataIdx];
+        const uint8_t* bufferData = copiedFrame != nullptr ? copiedFrame + copiedFrameOffset : buffer.Data;
+        
+        ioVectors[ioVectorsNumber].iov_base = const_cast<uint8_t*>(bufferData + bytesSent);
+        ioVectors[ioVectorsNumber].iov_len = buffer.Size - bytesSent;
+        ++ioVectorsNumber;
+        
+        copiedFrameOffset += buffer.Size;
+        bytesSent = 0;
+      }
+    }
+    
+    if (responseInfo.RateLimitBytes != 0) {
+      ioVectorsNumber = LimitIoVectors(ioVectors, ioVectorsNumber, responseInfo.Tokens);
+    }
+    
+    ssize_t writeResult = SendIoVectors(clientInfo, ioVectors, ioVectorsNumber);
+    
+    if (queueItem != nullptr) {
+      queueItem->MappedReaders -= 1;
+    }
+    
+    if (writeResult > 0) {
+      uint32_t bytesLeft = static_cast<uint32_t>(writeResult);
+      
+      if (responseInfo.RateLimitBytes != 0) {
+        responseInfo.Tokens -= std::min(responseInfo.Tokens, static_cast<uint64_t>(writeResult));
+      }
+      
+      if (responseInfo.HeaderBytesSent < headerSize) {
+        uint32_t headerBytes = std::min(bytesLeft, headerSize - responseInfo.HeaderBytesSent);
+        responseInfo.HeaderBytesSent += headerBytes;
+        bytesLeft -= headerBytes;
+      }
+      
+      while (queueItem != nullptr && bytesLeft > 0) {
+        const Buffer& buffer = queueItem->Data[responseInfo.DataBufferIdx];
+        uint32_t bufferBytes = std::min(bytesLeft, buffer.Size - responseInfo.DataBufferBytesSent);
+        responseInfo.DataBufferBytesSent += bufferBytes;
+        bytesLeft -= bufferBytes;
+        
+        if (responseInfo.DataBufferBytesSent == buffer.Size) {
+          if (responseInfo.DataBufferIdx + 1 >= dataEndIdx) {
+            // The item was sent so we need to find a new item
+            clientInfo.SlotIdx = ResponseInfo::InvalidBufferIdx;
+            responseInfo.DataBufferIdx = ResponseInfo::InvalidBufferIdx;
+            
+            // A downgraded client is restored when it sends frames fast enough.
+            if (clientInfo.IsDowngraded && 
+                Clock::GetMonotonicTimeMs() - clientInfo.FrameStartMs < _config.DowngradeLagMs / 2) {
+              clientInfo.IsDowngraded = false;
+            }
+            
+            // Release the item.
+            ReleaseSentBuffer(responseInfo, queueItem);
+            queueItem = nullptr;
+          }
+          else {
+            // Switch to next buffer
+            responseInfo.DataBufferIdx += 1;
+            responseInfo.DataBufferBytesSent = 0;             
+          }
+        }
+      }
+    }
+    else if (-1 == writeResult && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Stop sending data to the current client as it is busy.
+      SetWaitsForWritable(clientInfo, true);
+      return true;
+    }
+    else if (-1 == writeResult && errno == EINTR) {
+      continue;
+    }
+    else {
+      // Stop sending data to the current client as something went wrong.
+      Tracer::LogErrNo("writev().");
+      return false;
+    }
+  }
+}
+
+bool ClientShard::ShouldSkipFrame(const ClientInfo& clientInfo, uint64_t nowMs)
+{
+  if (clientInfo.IsDowngraded && nowMs - clientInfo.FrameStartMs < _config.DowngradeLagMs) {
+    return true;
+  }
+  
+  if (_config.SkipLagBytes != 0) {
+    // Previous frames are still in the socket buffer so a new one would only add latency.
+    int unsentBytes = 0;
+    if (0 == ::ioctl(clientInfo.Fd, SIOCOUTQ, &unsentBytes) && 
+        static_cast<uint32_t>(unsentBytes) >= _config.SkipLagBytes) {
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+bool ClientShard::IsSocketDrained(int clientFd)
+{
+  int notSentBytes = 0;
+  if (-1 == ::ioctl(clientFd, SIOCOUTQNSD, &notSentBytes)) {
+    return true;
+  }
+  
+  return notSentBytes < NotSentLowatBytes;
+}
+
+ssize_t ClientShard::SendIoVectors(ClientInfo& clientInfo, iovec* ioVectors, int ioVectorsNumber)
+{
+  const int clientFd = clientInfo.Fd;
+  ResponseInfo& responseInfo = GetState(clientInfo).Response;
+  
+  if (!responseInfo.IsZeroCopy) {
+    return ::writev(clientFd, ioVectors, ioVectorsNumber);
+  }
+  
+  msghdr message = {0};
+  message.msg_iov = ioVectors;
+  message.msg_iovlen = ioVectorsNumber;
+  
+  ssize_t sendResult = ::sendmsg(clientFd, &message, MSG_ZEROCOPY);
+  if (sendResult > 0) {
+    // Every successful MSG_ZEROCOPY call gets the next notification id.
+    responseInfo.ZeroCopySendsNumber += 1;
+    responseInfo.IsFrameZeroCopied = (clientInfo.SlotIdx != ResponseInfo::InvalidBufferIdx);
+  }
+  else if (-1 == sendResult && ENOBUFS == errno) {
+    // Socket option memory limit is reached. Copy data this time.
+    sendResult = ::sendmsg(clientFd, &message, 0);
+  }
+  
+  return sendResult;
+}
+
+void ClientShard::ReadZeroCopyNotifications(int clientFd, ResponseInfo& responseInfo)
+{
+  while (true) {
+    uint8_t control[128];
+    msghdr message = {0};
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    if (-1 == ::recvmsg(clientFd, &message, MSG_ERRQUEUE)) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        Tracer::LogErrNo("recvmsg(MSG_ERRQUEUE).");
+      }
+      
+      if (errno != EINTR) {
+        break;
+      }
+      
+      continue;
+    }
+    
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+      const bool isIpError = (SOL_IP == cmsg->cmsg_level && IP_RECVERR == cmsg->cmsg_type) ||
+                             (SOL_IPV6 == cmsg->cmsg_level && IPV6_RECVERR == cmsg->cmsg_type);
+      if (!isIpError) {
+        continue;
+      }
+      
+      const sock_extended_err* error = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cmsg));
+      if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      
+      // Notifications come in order: [ee_info, ee_data] is a range of completed send calls.
+      const uint32_t lastCompletedId = error->ee_data;
+      
+      auto pinIt = responseInfo.ZeroCopyPins.begin();
+      while (pinIt != responseInfo.ZeroCopyPins.end() &&
+             static_cast<int32_t>(lastCompletedId - pinIt->LastSendId) >= 0) {
+        FrameQueue::QueueItem* queueItem = responseInfo.Queue->GetBuffer(pinIt->SlotIdx);
+        if (queueItem != nullptr) {
+          responseInfo.Queue->ReleaseBuffer(queueItem);
+        }
+        
+        ++pinIt;
+      }
+      
+      responseInfo.ZeroCopyPins.erase(responseInfo.ZeroCopyPins.begin(), pinIt);
+      
+      // The kernel had to copy data (e.g. loopback device) so MSG_ZEROCOPY is only an overhead.
+      if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        responseInfo.IsZeroCopy = false;
+      }
+    }
+  }
+}
+
+void ClientShard::ReleaseSentBuffer(ResponseInfo& responseInfo, FrameQueue::QueueItem* queueItem)
+{
+  if (responseInfo.IsFrameZeroCopied) {
+    // The kernel still references the frame. It is released on notification.
+    ResponseInfo::ZeroCopyPin pin = {responseInfo.ZeroCopySendsNumber - 1, queueItem->SlotIdx};
+    responseInfo.ZeroCopyPins.push_back(pin);
+    responseInfo.IsFrameZeroCopied = false;
+  }
+  else {
+    responseInfo.Queue->ReleaseBuffer(queueItem);
+  }
+}
+
+uint32_t ClientShard::GetServedEvents(const ResponseInfo& responseInfo, bool waitsForWritable)
+{
+  return (waitsForWritable ? WriteEvents : IdleEvents) | (responseInfo.IsWebSocket ? WebSocketEvents : 0U);
+}
+
+void ClientShard::SetWaitsForWritable(ClientInfo& clientInfo, bool waitsForWritable)
+{
+  if (clientInfo.WaitsForWritable != waitsForWritable) {
+    if (_eventLoop->Modify(clientInfo.Fd, GetServedEvents(GetState(clientInfo).Response, waitsForWritable))) {
+      clientInfo.WaitsForWritable = waitsForWritable;
+    }
+  }
+}
+
+void ClientShard::SetWatching(ClientInfo& clientInfo, bool isWatching)
+{
+  ResponseInfo& responseInfo = GetState(clientInfo).Response;
+  
+  if (responseInfo.IsWatching == isWatching) {
+    return;
+  }
+  
+  responseInfo.IsWatching = isWatching;
+  
+  const uint32_t cameraBit = 1U << clientInfo.CameraIdx;
+  uint32_t& watchersNumber = _watchersNumbers[clientInfo.CameraIdx];
+  
+  if (isWatching) {
+    watchersNumber += 1;
+    if (1 == watchersNumber) {
+      _watchedCameras |= cameraBit;
+      
+      if (_config.NotifyCameraWatched) {
+        _config.NotifyCameraWatched();
+      }
+    }
+  }
+  else {
+    watchersNumber -= 1;
+    if (0 == watchersNumber) {
+      _watchedCameras &= ~cameraBit;
+    }
+  }
+}
+
+void ClientShard::CloseClient(int clientFd)
+{
+  ClientInfo* client = FindClient(clientFd);
+  if (client != nullptr && client->IsServed) {
+    SetWatching(*client, false);
+    
+    const ResponseInfo& responseInfo = GetState(*client).Response;
+    
+    if (client->SlotIdx != ResponseInfo::InvalidBufferIdx) {
+      FrameQueue::QueueItem* queueItem = responseInfo.Queue->GetBuffer(client->SlotIdx);
+      if (queueItem != nullptr) {
+        responseInfo.Queue->ReleaseBuffer(queueItem);
+      }
+    }
+    
+    if (responseInfo.IsFrameZeroCopied || !responseInfo.ZeroCopyPins.empty()) {
+      // Completions will not be delivered after close(). Reset the connection 
+      // so the kernel drops unsent data which references the frames.
+      linger lingerValue = {1, 0};
+      ::setsockopt(clientFd, SOL_SOCKET, SO_LINGER, &lingerValue, sizeof(lingerValue));
+      
+      for (const ResponseInfo::ZeroCopyPin& pin : responseInfo.ZeroCopyPins) {
+        FrameQueue::QueueItem* queueItem = responseInfo.Queue->GetBuffer(pin.SlotIdx);
+        if (queueItem != nullptr) {
+          responseInfo.Queue->ReleaseBuffer(queueItem);
+        }
+      }
+    }
+  }
+  
+  if (client != nullptr) {
+    _freeClientStateIdxs.push_back(client->StateIdx);
+    
+    const uint32_t clientIdx = _clientIdxByFd[clientFd];
+    const uint32_t lastIdx = static_cast<uint32_t>(_clients.size() - 1);
+    if (clientIdx != lastIdx) {
+      _clients[clientIdx] = _clients[lastIdx];
+      _clientIdxByFd[_clients[clientIdx].Fd] = clientIdx;
+    }
+    
+    _clients.pop_back();
+    _clientIdxByFd[clientFd] = InvalidClientIdx;
+    _clientsNumber -= 1;
+  }
+  
+  _eventLoop->Remove(clientFd);
+  
+  if (-1 == ::close(clientFd)) {
+    Tracer::LogErrNo("close().");
+  }
+}
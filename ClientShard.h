@@ -0,0 +1,391 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef CLIENTSHARD_H
+#define CLIENTSHARD_H
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <functional>
+#include <sys/types.h>
+
+#include "EventLoop.h"
+#include "FrameQueue.h"
+#include "HttpRequest.h"
+
+struct iovec;
+
+/*
+ * @brief ClientShard serves a subset of HTTP clients: reads their requests 
+ *        and sends them MJPEG frames from a shared FrameQueue.
+ *        Supported resources: "/" and "/stream" (MJPEG stream, "?fps=N" or 
+ *        "?every=K" limit its frame rate, "?rate=KBPS" limits its bandwidth), "/snapshot" 
+ *        (the newest frame), "/next" (long polling of the frame after a given 
+ *        sequence number), "/stream.sdp" (RTP session description), "/ws" (WebSocket
+ *        stream of binary messages, "?flow=1" sends a frame per "ready" message 
+ *        of the client), "/stats" (counters in text format).
+ *        Connections of single response resources are kept alive and 
+ *        pipelined requests are served in order.
+ *        Every camera has its own FrameQueue. "/cam/<name>/<resource>" selects 
+ *        a camera, resources without the prefix belong to the first camera.
+ *        A shard works either in the caller's event loop or in its own thread.
+ * 
+ * */
+class ClientShard : private EventLoop::Handler
+{
+public:
+  
+  struct Config {
+    bool IsZeroCopy;
+    
+    // Watermarks of slow clients. Zero disables a watermark.
+    // A client does not get new frames while its socket has more unsent bytes than SkipLagBytes.
+    uint32_t SkipLagBytes;
+    // A client which sends a frame longer than DowngradeLagMs gets one frame per DowngradeLagMs.
+    uint32_t DowngradeLagMs;
+    // A client which sends a frame longer than DisconnectLagMs is closed.
+    uint32_t DisconnectLagMs;
+    
+    // Sending rate of every client (token bucket). Zero disables the limit.
+    uint32_t RateLimitBytes;
+    
+    // Stream sockets get TCP_NOTSENT_LOWAT and the next frame is selected only
+    // when the previous one has left the socket buffer.
+    bool IsLatencyMode;
+    
+    // A client which does not send a complete request during IdleTimeoutMs
+    // (after connecting or after the previous response) is closed. Zero disables the timeout.
+    uint32_t IdleTimeoutMs;
+    
+    // Returns a body of "/stats" response. It is called by shard threads.
+    std::function<std::string()> GetStatsText;
+    
+    // Returns a body of "/stream.sdp" response or an empty string if RTP is disabled.
+    std::function<std::string()> GetSdpText;
+    
+    // Called when a camera gets its first client which waits for frames (see GetWatchedCameras()).
+    // It is called by shard threads.
+    std::function<void()> NotifyCameraWatched;
+  };
+  
+  struct Camera {
+    // Name in "/cam/<name>/" routes.
+    std::string Name;
+    FrameQueue* Queue;
+  };
+  
+  // Cameras with new buffers are notified with a bit mask.
+  static const uint32_t MaxCamerasNumber = 32U;
+  
+  struct Stats {
+    uint64_t SkippedFramesNumber;
+    uint64_t DowngradedClientsNumber;
+    uint64_t DisconnectedClientsNumber;
+    uint64_t MaxFramesBehind;
+    uint64_t RequestsNumber;
+    uint64_t IdleClosedClientsNumber;
+  };
+  
+  explicit ClientShard(const std::vector<Camera>& cameras);
+  ~ClientShard();
+  
+  // @brief Serves clients from a given event loop. ServeRequests() should be called
+  //        by the owner of the loop.
+  bool Init(EventLoop* eventLoop, const Config& config);
+  
+  // @brief Starts a dedicated thread with its own event loop.
+  bool Start(const Config& config);
+  
+  // @brief Stops the thread (if any) and closes all clients.
+  void Shutdown();
+  
+  // @brief Takes ownership of an accepted client socket. Thread safe.
+  void AddClient(int clientFd);
+  
+  // @brief Notifies that a new buffer was queued to FrameQueue of a camera. Thread safe.
+  void NotifyNewBuffer(uint32_t cameraIdx);
+  
+  // @brief Closes clients which hold video buffers (frames which are not copied) of a camera. Thread safe.
+  void CloseBusyClients(uint32_t cameraIdx);
+  
+  // @brief Handles notifications (new clients, new buffer, etc.). 
+  //        It is called by the shard thread or by the owner of the event loop.
+  void ServeRequests();
+  
+  std::size_t GetClientsNumber() const { return _clientsNumber; }
+  
+  // @brief Returns a bit mask of cameras which have clients waiting for frames
+  //        (streams, snapshots, long polling). Thread safe.
+  uint32_t GetWatchedCameras() const { return _watchedCameras; }
+  
+  // @brief Returns counters of slow clients. Thread safe.
+  Stats GetStats() const;
+  
+  ClientShard() = delete;
+  ClientShard(const ClientShard& other) = delete;
+  ClientShard& operator=(const ClientShard& other) = delete;
+  
+private:
+  
+  struct RequestInfo 
+  {
+    HttpRequestParser Parser;
+    
+    // Received data which is not parsed yet (pipelined requests).
+    std::string PendingData;
+    
+    // Time when the client started waiting for the request.
+    uint64_t StartMs = 0U;
+  };
+
+  struct ResponseInfo
+  {
+    // Frames of the requested camera.
+    FrameQueue* Queue = nullptr;
+    
+    // The client is counted as a watcher of the camera.
+    bool IsWatching = false;
+    
+    // A stream gets frames till the client is closed. Other responses 
+    // consist of Header and (optionally) a single frame.
+    bool IsStream = true;
+    
+    // The connection is not closed after a single response.
+    bool IsKeepAlive = false;
+    
+    // A long polling response waits for a frame newer than Timestamp till WaitEndMs.
+    // The client has a frame with LastSequence if HasLastSequence is true.
+    bool IsWaitingForFrame = false;
+    bool HasLastSequence = false;
+    uint32_t LastSequence = 0U;
+    uint64_t WaitEndMs = 0U;
+    
+    std::string Header;
+    uint32_t HeaderBytesSent = 0U;
+    
+    static const uint32_t InvalidBufferIdx = 0xFFFFFFFF;
+    
+    uint32_t DataBufferIdx = InvalidBufferIdx;
+    uint32_t DataBufferBytesSent = 0U;
+    timeval Timestamp = {0};
+    
+    // Decimation of a stream requested by the client: every EveryFrames-th queued 
+    // frame or frames with timestamps spaced by FrameIntervalUs. Zero disables it.
+    uint32_t EveryFrames = 0U;
+    uint64_t FrameIntervalUs = 0U;
+    uint64_t NextFrameTimeUs = 0U;
+    
+    // Token bucket of a rate limited client. A paced client has no tokens and
+    // is resumed when frames are queued or timeouts are checked.
+    uint32_t RateLimitBytes = 0U;
+    uint64_t Tokens = 0U;
+    uint64_t TokensUpdateMs = 0U;
+    bool IsPaced = false;
+    
+    bool IsLatencyMode = false;
+    
+    // A WebSocket stream sends every frame as a binary message. Header holds 
+    // the handshake response and then the header of the current message.
+    // A flow controlled client gets a frame per received "ready" message (Credits).
+    bool IsWebSocket = false;
+    bool IsFlowControlled = false;
+    uint32_t Credits = 0U;
+    
+    // Control messages (a Pong or the echoed Close) are sent between frames as soon
+    // as the socket is writable, they do not wait for credits or new frames.
+    // The client is closed when the echoed Close message is sent (IsClosing).
+    bool HasPendingPong = false;
+    std::string PongPayload;
+    bool HasPendingClose = false;
+    uint16_t CloseStatus = 0U;
+    bool IsClosing = false;
+    
+    // A frame sent with MSG_ZEROCOPY stays in use till the kernel reports
+    // completion of the last send call which referenced the frame.
+    struct ZeroCopyPin {
+      uint32_t LastSendId;
+      uint32_t SlotIdx;
+    };
+    
+    bool IsZeroCopy = false;
+    uint32_t ZeroCopySendsNumber = 0U;
+    bool IsFrameZeroCopied = false;
+    std::vector<ZeroCopyPin> ZeroCopyPins;
+  }; 
+  
+  // Per-connection state which is not needed to fan a frame out. States are 
+  // pooled and reused so a new connection does not allocate its buffers again.
+  struct ClientState
+  {
+    RequestInfo Request;
+    ResponseInfo Response;
+  };
+  
+  // State which ServeNewBuffer() checks for every client on every frame. It is 
+  // a POD so closing a client (swapping it with the last one) moves only these bytes.
+  struct ClientInfo
+  {
+    int Fd = -1;
+    
+    // Index of the ClientState in _clientStates.
+    uint32_t StateIdx = 0U;
+    
+    // False while the request is being read.
+    bool IsServed = false;
+    
+    // True if EPOLLOUT is armed because the socket returned EAGAIN.
+    bool WaitsForWritable = false;
+    
+    bool IsDowngraded = false;
+    
+    uint32_t CameraIdx = 0U;
+    
+    // Slot of the frame being sent, its FrameQueue number (or the number of 
+    // the last sent one) and the time when its sending was started.
+    uint32_t SlotIdx = ResponseInfo::InvalidBufferIdx;
+    uint64_t FrameNumber = 0U;
+    uint64_t FrameStartMs = 0U;
+  };
+  
+  static const uint32_t InvalidClientIdx = 0xFFFFFFFF;
+  
+  void OnEvent(int fd, uint32_t events) override;
+  
+  void ThreadFunc();
+  
+  void RegisterClient(int clientFd);
+  void ServeNewBuffer(uint32_t cameraMask);
+  void CloseBusyClientsNow(uint32_t cameraMask);
+  void CheckTimeouts(uint64_t nowMs);
+  
+  ClientInfo* FindClient(int clientFd);
+  
+  ClientState& GetState(const ClientInfo& clientInfo) { return _clientStates[clientInfo.StateIdx]; }
+  
+  // @brief Takes a state from the pool (or adds a new one) and returns its index.
+  uint32_t AcquireClientState();
+  
+  // @brief Prepares the response state for the next request. Buffers keep their capacity.
+  void ResetResponse(ClientInfo& clientInfo);
+  
+  void ReadAndParseRequest(ClientInfo& clientInfo);
+  
+  // @brief Parses received data. Returns true if the request is parsed (or failed).
+  bool ParsePendingData(RequestInfo& requestInfo);
+  
+  // @brief Prepares a response for the parsed request. Returns false if the client should be closed.
+  bool StartResponse(ClientInfo& clientInfo);
+  
+  // @brief Prepares a single frame response. The frame must be selected for sending.
+  void StartFrameResponse(ClientInfo& clientInfo, FrameQueue::QueueItem* queueItem);
+  
+  // @brief Validates the WebSocket handshake and prepares its response.
+  void StartWebSocketResponse(const HttpRequestParser& parser, ResponseInfo& responseInfo);
+  
+  // @brief Makes Header a header of the binary message with the selected frame.
+  static void StartWebSocketMessage(ResponseInfo& responseInfo, FrameQueue::QueueItem* queueItem);
+  
+  // @brief Makes Header a pending Close or Pong message. Returns false if there is none.
+  static bool StartWebSocketControlMessage(ResponseInfo& responseInfo);
+  
+  // @brief Reads and handles messages of a WebSocket client. Returns false if the client should be closed.
+  bool ReadWebSocketMessages(ClientInfo& clientInfo);
+  
+  // @brief Sends the response and switches a kept alive connection to the next 
+  //        request. Returns false if the client should be closed.
+  bool ServeClient(ClientInfo& clientInfo);
+  
+  // @brief Sends as much data as possible. Returns false if the client is broken.
+  bool SendData(ClientInfo& clientInfo);
+  
+  bool IsResponseSent(const ClientInfo& clientInfo);
+  
+  // @brief Returns true if the client should not get a new frame now.
+  bool ShouldSkipFrame(const ClientInfo& clientInfo, uint64_t nowMs);
+  
+  // @brief Returns true if the previous frame has left the socket buffer (latency mode).
+  bool IsSocketDrained(int clientFd);
+  
+  // @brief Applies ?fps=N, ?every=K and ?rate=KBPS of a stream request. Returns false if they are invalid.
+  static bool SetupStreamLimits(const HttpRequestParser& parser, ResponseInfo& responseInfo);
+  
+  static void RefillTokens(ResponseInfo& responseInfo, uint64_t nowMs);
+  
+  // @brief Sends ioVectors with MSG_ZEROCOPY if it is enabled for the client otherwise with writev().
+  ssize_t SendIoVectors(ClientInfo& clientInfo, iovec* ioVectors, int ioVectorsNumber);
+  
+  // @brief Reads MSG_ZEROCOPY notifications and releases completed frames.
+  void ReadZeroCopyNotifications(int clientFd, ResponseInfo& responseInfo);
+  
+  void ReleaseSentBuffer(ResponseInfo& responseInfo, FrameQueue::QueueItem* queueItem);
+  
+  // @brief Returns epoll events of a client which is being served.
+  static uint32_t GetServedEvents(const ResponseInfo& responseInfo, bool waitsForWritable);
+  
+  void SetWaitsForWritable(ClientInfo& clientInfo, bool waitsForWritable);
+  
+  // @brief Updates watchers of the response camera.
+  void SetWatching(ClientInfo& clientInfo, bool isWatching);
+  
+  void CloseClient(int clientFd);
+  
+  std::vector<Camera> _cameras;
+  EventLoop* _eventLoop;
+  Config _config;
+  
+  // Own event loop and thread are used only in multi-threaded mode.
+  EventLoop _ownEventLoop;
+  std::thread _thread;
+  std::atomic<bool> _shouldStop;
+  
+  // Notifications from other threads.
+  std::mutex _newClientsMutex;
+  std::vector<int> _newClientFds;
+  std::atomic<uint32_t> _newBufferCameras;
+  std::atomic<uint32_t> _closeBusyClientsCameras;
+  
+  // Watchers of every camera (used only by the shard thread) and the published mask of watched cameras.
+  std::vector<uint32_t> _watchersNumbers;
+  std::atomic<uint32_t> _watchedCameras;
+  
+  std::atomic<std::size_t> _clientsNumber;
+  std::atomic<uint64_t> _skippedFramesNumber;
+  std::atomic<uint64_t> _downgradedClientsNumber;
+  std::atomic<uint64_t> _disconnectedClientsNumber;
+  std::atomic<uint64_t> _maxFramesBehind;
+  std::atomic<uint64_t> _requestsNumber;
+  std::atomic<uint64_t> _idleClosedClientsNumber;
+  uint64_t _timeoutsCheckMs;
+  std::vector<uint8_t> _readBuffer;
+  
+  // Clients are stored densely and removed by swapping with the last one.
+  std::vector<ClientInfo> _clients;
+  std::vector<uint32_t> _clientIdxByFd;
+  
+  // States of closed clients are kept in the pool for new ones.
+  std::vector<ClientState> _clientStates;
+  std::vector<uint32_t> _freeClientStateIdxs;
+};
+
+#endif // CLIENTSHARD_H
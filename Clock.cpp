@@ -0,0 +1,40 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "Clock.h"
+
+#include <time.h>
+
+namespace Clock {
+  uint64_t GetMonotonicTimeMs() {
+    timespec now = {0};
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return static_cast<uint64_t>(now.tv_sec) * 1000U + now.tv_nsec / 1000000;
+  }
+  
+  uint64_t GetMonotonicTimeUs() {
+    timespec now = {0};
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return static_cast<uint64_t>(now.tv_sec) * 1000000U + now.tv_nsec / 1000;
+  }
+}
@@ -0,0 +1,35 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <cstdint>
+
+namespace Clock {
+  // @brief Returns milliseconds of CLOCK_MONOTONIC.
+  uint64_t GetMonotonicTimeMs();
+  
+  // @brief Returns microseconds of CLOCK_MONOTONIC (the clock of V4L2 timestamps).
+  uint64_t GetMonotonicTimeUs();
+}
+
+#endif // CLOCK_H
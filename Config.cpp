@@ -22,6 +22,8 @@
 #include "Config.h"
 #include <getopt.h>
 #include <cstdlib>
+#include <algorithm>
+#include <utility>
 #include "Tracer.h"
 
 namespace {
@@ -39,6 +41,20 @@ namespace {
     
     return static_cast<uint32_t>(result);
   }
+  
+  // @brief Same as GetUInt32OptValue() but accepts 0 (it disables some features).
+  uint32_t GetUInt32OrZeroOptValue(char* arg) {
+    static const int ConversionBase = 10;
+    char* rest;
+    
+    long result = strtol(arg, &rest, ConversionBase);
+    
+    if (rest == arg || 0 != *rest || result < 0 || result >= static_cast<long>(InvalidUInt32OptValue)) {
+      return InvalidUInt32OptValue;
+    }
+    
+    return static_cast<uint32_t>(result);
+  }
 }
 
 UvcStreamerCfg GetConfig(int argc, char **argv) {
@@ -49,9 +65,31 @@ UvcStreamerCfg GetConfig(int argc, char **argv) {
   config.GrabberCfg.FrameHeight = 480U;
   config.GrabberCfg.FrameRate = 15U;
   config.GrabberCfg.BuffersNumber = 4U;
+  config.GrabberCfg.MinBuffersNumber = 0U;
+  config.GrabberCfg.MaxBuffersNumber = 0U;
+  config.GrabberCfg.AutoMode = false;
+  config.GrabberCfg.MaxBandwidthKBps = 0U;
   config.GrabberCfg.SetupCamera = nullptr;
   
   config.ServerCfg.ServicePort = "8081";
+  config.ServerCfg.MaxClientsNumber = 256U;
+  config.ServerCfg.ZeroCopy = false;
+  config.ServerCfg.ThreadsNumber = 1U;
+  config.ServerCfg.CopyPoolSize = 2U;
+  config.ServerCfg.CopyDelayMs = 100U;
+  
+  // Lag watermarks are off by default so every client is served as fast as it can receive.
+  config.ServerCfg.SkipLagBytes = 0U;
+  config.ServerCfg.DowngradeLagMs = 0U;
+  config.ServerCfg.DisconnectLagMs = 0U;
+  config.ServerCfg.IdleTimeoutMs = 5000U;
+  config.ServerCfg.RateLimitKBps = 0U;
+  config.ServerCfg.LatencyMode = false;
+  config.ServerCfg.RtpTtl = 1U;
+  
+  config.UseCaptureThread = false;
+  config.OnDemandIdleMs = 0U;
+  config.StallTimeoutMs = 0U;
   
   static option options[] = {
     {"d", required_argument, 0, 0}, // Camera device name
@@ -66,10 +104,63 @@ UvcStreamerCfg GetConfig(int argc, char **argv) {
     {"fps", required_argument, 0, 0}, // Frame rate
     {"p", required_argument, 0, 0}, // TCP port
     {"port", required_argument, 0, 0}, // TCP port
+    {"c", required_argument, 0, 0}, // Max clients number
+    {"clients", required_argument, 0, 0}, // Max clients number
+    {"z", no_argument, 0, 0}, // Zero copy sending
+    {"zerocopy", no_argument, 0, 0}, // Zero copy sending
+    {"t", required_argument, 0, 0}, // Sending threads number
+    {"threads", required_argument, 0, 0}, // Sending threads number
+    {"ct", no_argument, 0, 0}, // Dedicated capture thread
+    {"capture-thread", no_argument, 0, 0}, // Dedicated capture thread
+    {"cp", required_argument, 0, 0}, // Copy pool size
+    {"copy-pool", required_argument, 0, 0}, // Copy pool size
+    {"cd", required_argument, 0, 0}, // Copy delay
+    {"copy-delay", required_argument, 0, 0}, // Copy delay
+    {"sl", required_argument, 0, 0}, // Skip lag watermark
+    {"skip-lag", required_argument, 0, 0}, // Skip lag watermark
+    {"dl", required_argument, 0, 0}, // Downgrade lag watermark
+    {"downgrade-lag", required_argument, 0, 0}, // Downgrade lag watermark
+    {"xl", required_argument, 0, 0}, // Disconnect lag watermark
+    {"disconnect-lag", required_argument, 0, 0}, // Disconnect lag watermark
+    {"it", required_argument, 0, 0}, // Idle connection timeout
+    {"idle-timeout", required_argument, 0, 0}, // Idle connection timeout
+    {"rl", required_argument, 0, 0}, // Rate limit of a client
+    {"rate-limit", required_argument, 0, 0}, // Rate limit of a client
+    {"lm", no_argument, 0, 0}, // Latency mode
+    {"latency-mode", no_argument, 0, 0}, // Latency mode
+    {"r", required_argument, 0, 0}, // RTP destination
+    {"rtp", required_argument, 0, 0}, // RTP destination
+    {"rt", required_argument, 0, 0}, // RTP multicast TTL
+    {"rtp-ttl", required_argument, 0, 0}, // RTP multicast TTL
+    {"u", required_argument, 0, 0}, // Upstream stream URL
+    {"upstream", required_argument, 0, 0}, // Upstream stream URL
+    {"rp", required_argument, 0, 0}, // Replayed file or directory
+    {"replay", required_argument, 0, 0}, // Replayed file or directory
+    {"rf", no_argument, 0, 0}, // Replay as fast as possible
+    {"replay-fast", no_argument, 0, 0}, // Replay as fast as possible
+    {"cam", required_argument, 0, 0}, // Named camera device
+    {"camera", required_argument, 0, 0}, // Named camera device
+    {"od", required_argument, 0, 0}, // Capture on demand idle period
+    {"on-demand", required_argument, 0, 0}, // Capture on demand idle period
+    {"st", required_argument, 0, 0}, // Stall timeout of the watchdog
+    {"stall-timeout", required_argument, 0, 0}, // Stall timeout of the watchdog
+    {"am", no_argument, 0, 0}, // Select the largest capture mode
+    {"auto-mode", no_argument, 0, 0}, // Select the largest capture mode
+    {"bw", required_argument, 0, 0}, // Bandwidth limit of capture modes
+    {"bandwidth", required_argument, 0, 0}, // Bandwidth limit of capture modes
+    {"bmin", required_argument, 0, 0}, // Min capture buffers number
+    {"buffers-min", required_argument, 0, 0}, // Min capture buffers number
+    {"bmax", required_argument, 0, 0}, // Max capture buffers number
+    {"buffers-max", required_argument, 0, 0}, // Max capture buffers number
     {0, 0, 0, 0}
   };
   
   bool foundError = false;
+  bool isReplayFast = false;
+  bool isStallTimeoutSet = false;
+  
+  // Capture settings of all cameras are set by common options so devices are applied after parsing.
+  std::vector<std::pair<std::string, std::string>> cameraDevices;
   
   while (!foundError) {
     int optionIdx;
@@ -170,6 +261,315 @@ UvcStreamerCfg GetConfig(int argc, char **argv) {
             
             break;
 
+          // c, clients
+          case 12:
+          case 13:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.ServerCfg.MaxClientsNumber = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for clients number.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // z, zerocopy
+          case 14:
+          case 15:
+            config.ServerCfg.ZeroCopy = true;
+            break;
+
+          // t, threads
+          case 16:
+          case 17:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.ServerCfg.ThreadsNumber = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for threads number.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // ct, capture-thread
+          case 18:
+          case 19:
+            config.UseCaptureThread = true;
+            break;
+
+          // cp, copy-pool
+          case 20:
+          case 21:
+            {
+              const uint32_t optVal = GetUInt32OrZeroOptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.ServerCfg.CopyPoolSize = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for copy pool size.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // cd, copy-delay
+          case 22:
+          case 23:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.ServerCfg.CopyDelayMs = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for copy delay.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // sl, skip-lag
+          case 24:
+          case 25:
+            {
+              const uint32_t optVal = GetUInt32OrZeroOptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.ServerCfg.SkipLagBytes = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for skip lag.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // dl, downgrade-lag
+          case 26:
+          case 27:
+            {
+              const uint32_t optVal = GetUInt32OrZeroOptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.ServerCfg.DowngradeLagMs = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for downgrade lag.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // xl, disconnect-lag
+          case 28:
+          case 29:
+            {
+              const uint32_t optVal = GetUInt32OrZeroOptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.ServerCfg.DisconnectLagMs = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for disconnect lag.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // it, idle-timeout
+          case 30:
+          case 31:
+            {
+              const uint32_t optVal = GetUInt32OrZeroOptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.ServerCfg.IdleTimeoutMs = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for idle timeout.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // rl, rate-limit
+          case 32:
+          case 33:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue && optVal <= 0xFFFFFFFFU / 1024U) {
+                config.ServerCfg.RateLimitKBps = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for rate limit.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // lm, latency-mode
+          case 34:
+          case 35:
+            config.ServerCfg.LatencyMode = true;
+            break;
+
+          // r, rtp
+          case 36:
+          case 37:
+            config.ServerCfg.RtpDestination = optarg;
+            break;
+
+          // rt, rtp-ttl
+          case 38:
+          case 39:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue && optVal <= 255U) {
+                config.ServerCfg.RtpTtl = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for RTP TTL.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // u, upstream
+          case 40:
+          case 41:
+            config.RelayCfg.Url = optarg;
+            break;
+
+          // rp, replay
+          case 42:
+          case 43:
+            config.ReplayCfg.Path = optarg;
+            break;
+
+          // rf, replay-fast
+          case 44:
+          case 45:
+            isReplayFast = true;
+            break;
+
+          // cam, camera
+          case 46:
+          case 47:
+            {
+              const std::string cameraArg = optarg;
+              const size_t separatorPos = cameraArg.find('=');
+              
+              // Names are parts of URL paths.
+              if (0 == separatorPos || std::string::npos == separatorPos || separatorPos + 1 == cameraArg.size() ||
+                  cameraArg.find('/') < separatorPos) {
+                Tracer::Log("Invalid value '%s' for camera (NAME=DEVICE expected).\n", optarg);
+                foundError = true;
+                break;
+              }
+              
+              cameraDevices.push_back(std::make_pair(cameraArg.substr(0, separatorPos), cameraArg.substr(separatorPos + 1)));
+            }
+            
+            break;
+
+          // od, on-demand
+          case 48:
+          case 49:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.OnDemandIdleMs = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for on demand idle period.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // st, stall-timeout
+          case 50:
+          case 51:
+            {
+              const uint32_t optVal = GetUInt32OrZeroOptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.StallTimeoutMs = optVal;
+                isStallTimeoutSet = true;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for stall timeout.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // am, auto-mode
+          case 52:
+          case 53:
+            config.GrabberCfg.AutoMode = true;
+            break;
+
+          // bw, bandwidth
+          case 54:
+          case 55:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.GrabberCfg.MaxBandwidthKBps = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for bandwidth.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // bmin, buffers-min
+          case 56:
+          case 57:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.GrabberCfg.MinBuffersNumber = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for min buffers number.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
+          // bmax, buffers-max
+          case 58:
+          case 59:
+            {
+              const uint32_t optVal = GetUInt32OptValue(optarg);
+              if (optVal != InvalidUInt32OptValue) {
+                config.GrabberCfg.MaxBuffersNumber = optVal;
+              }
+              else {
+                Tracer::Log("Invalid value '%s' for max buffers number.\n", optarg);
+                foundError = true;
+              }
+            }
+            
+            break;
+
           default:
             foundError = true;
       }
@@ -180,12 +580,77 @@ UvcStreamerCfg GetConfig(int argc, char **argv) {
     }
   }
   
+  // Without bounds the number of capture buffers is fixed.
+  UvcGrabber::Config& grabberCfg = config.GrabberCfg;
+  if (0 == grabberCfg.MinBuffersNumber) {
+    grabberCfg.MinBuffersNumber = std::min(grabberCfg.BuffersNumber, grabberCfg.MaxBuffersNumber != 0 ? grabberCfg.MaxBuffersNumber : grabberCfg.BuffersNumber);
+  }
+  
+  if (0 == grabberCfg.MaxBuffersNumber) {
+    grabberCfg.MaxBuffersNumber = std::max(grabberCfg.BuffersNumber, grabberCfg.MinBuffersNumber);
+  }
+  
+  if (grabberCfg.MinBuffersNumber > grabberCfg.MaxBuffersNumber || 
+      grabberCfg.MaxBuffersNumber > FrameQueue::MaxVideoBuffersNumber) {
+    Tracer::Log("Invalid bounds of buffers number %u-%u.\n", grabberCfg.MinBuffersNumber, grabberCfg.MaxBuffersNumber);
+    foundError = true;
+  }
+  
+  grabberCfg.BuffersNumber = std::min(std::max(grabberCfg.BuffersNumber, grabberCfg.MinBuffersNumber), grabberCfg.MaxBuffersNumber);
+  
+  // Buffers are reallocated by the serving thread.
+  if (grabberCfg.MinBuffersNumber != grabberCfg.MaxBuffersNumber && config.UseCaptureThread) {
+    Tracer::Log("Buffers number can not be adjusted with capture thread.\n");
+    foundError = true;
+  }
+  
+  // Received frames are kept in the same number of buffers as captured ones.
+  config.RelayCfg.BuffersNumber = config.GrabberCfg.BuffersNumber;
+  
+  // Frames are replayed with the capture frame rate.
+  config.ReplayCfg.FrameRate = isReplayFast ? 0U : config.GrabberCfg.FrameRate;
+  config.ReplayCfg.BuffersNumber = config.GrabberCfg.BuffersNumber;
+  
+  if (!isStallTimeoutSet) {
+    static const uint32_t MinStallTimeoutMs = 2000U;
+    static const uint32_t StallFramesNumber = 10U;
+    config.StallTimeoutMs = std::max(MinStallTimeoutMs, StallFramesNumber * 1000U / config.GrabberCfg.FrameRate);
+  }
+  
+  // Sources are paused by the serving thread.
+  if (config.OnDemandIdleMs != 0 && config.UseCaptureThread) {
+    Tracer::Log("On demand capturing can not be used with capture thread.\n");
+    foundError = true;
+  }
+  
+  if (!cameraDevices.empty() && (!config.RelayCfg.Url.empty() || !config.ReplayCfg.Path.empty())) {
+    Tracer::Log("Cameras can not be used with upstream or replay.\n");
+    foundError = true;
+  }
+  
+  for (const auto& cameraDevice : cameraDevices) {
+    for (const std::string& cameraName : config.ServerCfg.CameraNames) {
+      if (cameraName == cameraDevice.first) {
+        Tracer::Log("Camera name '%s' is used twice.\n", cameraName.c_str());
+        foundError = true;
+      }
+    }
+    
+    CameraCfg cameraCfg;
+    cameraCfg.Name = cameraDevice.first;
+    cameraCfg.GrabberCfg = config.GrabberCfg;
+    cameraCfg.GrabberCfg.CameraDeviceName = cameraDevice.second;
+    
+    config.CamerasCfg.push_back(cameraCfg);
+    config.ServerCfg.CameraNames.push_back(cameraDevice.first);
+  }
+  
   config.IsValid = !foundError;
 
   return config;
 }
 
 void PrintUsage() {
-  printf("Usage: uvc2http -d /dev/video0 -b 4 -w 640 -h 480 -f 30 -p 8080\n");
+  printf("Usage: uvc2http -d /dev/video0 -b 4 -w 640 -h 480 -f 30 -p 8080 -c 256 -t 1 -cp 2 -cd 100 [-sl 262144] [-dl 1000] [-xl 10000] -it 5000 [-rl 512] [-lm] [-r 239.255.0.1:5004 -rt 1] [-u http://camera:8081/stream | -rp frames.mjpeg [-rf] | -cam left=/dev/video0 -cam right=/dev/video1] [-od 30000] [-st 2000] [-am] [-bw 2048] [-bmin 2 -bmax 8] [-z] [-ct]\n");
 }
 
@@ -24,17 +24,45 @@
 
 #include <unistd.h>
 #include <string>
+#include <vector>
 
 #include "UvcGrabber.h"
+#include "HttpServer.h"
+#include "RelaySource.h"
+#include "ReplaySource.h"
 
 
-struct HttpServerCfg {
-  std::string ServicePort;
+struct CameraCfg {
+  // Name in "/cam/<name>/" routes.
+  std::string Name;
+  UvcGrabber::Config GrabberCfg;
 };
 
 struct UvcStreamerCfg {
   UvcGrabber::Config GrabberCfg;
-  HttpServerCfg ServerCfg;
+  HttpServer::Config ServerCfg;
+  
+  // Cameras served by one process. The first one is also served by routes 
+  // without "/cam/<name>/" prefix. A single camera is set up by GrabberCfg.
+  std::vector<CameraCfg> CamerasCfg;
+  
+  // Frames are received from an upstream uvc2http server instead of a camera if Url is set.
+  RelaySource::Config RelayCfg;
+  
+  // Recorded frames are replayed instead of capturing if Path is set.
+  ReplaySource::Config ReplayCfg;
+  
+  // Capture frames in a dedicated thread.
+  bool UseCaptureThread;
+  
+  // Capturing of a camera is paused (VIDIOC_STREAMOFF) after OnDemandIdleMs without
+  // clients which wait for its frames and resumed by the next one. Zero disables it.
+  uint32_t OnDemandIdleMs;
+  
+  // A source without frames during StallTimeoutMs is restarted (see StreamWatchdog). 
+  // By default it is 10 frame intervals but at least 2 seconds. Zero disables the watchdog.
+  uint32_t StallTimeoutMs;
+  
   bool IsValid;
 };
 
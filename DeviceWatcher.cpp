@@ -0,0 +1,130 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "DeviceWatcher.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/inotify.h>
+
+#include "Tracer.h"
+
+namespace {
+  // A node is created, renamed to its place (links of udev) or gets its permissions.
+  const uint32_t NodeEvents = IN_CREATE | IN_MOVED_TO | IN_ATTRIB;
+}
+
+DeviceWatcher::DeviceWatcher()
+  : _inotifyFd(-1),
+    _watchDescriptor(-1)
+{
+}
+
+DeviceWatcher::~DeviceWatcher()
+{
+  Shutdown();
+}
+
+bool DeviceWatcher::Init(const std::string& devicePath)
+{
+  Shutdown();
+  
+  const size_t separatorPos = devicePath.rfind('/');
+  _directory = (std::string::npos == separatorPos) ? std::string(".") : 
+                                                      devicePath.substr(0, separatorPos > 0 ? separatorPos : 1);
+  _nodeName = (std::string::npos == separatorPos) ? devicePath : devicePath.substr(separatorPos + 1);
+  
+  _inotifyFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (-1 == _inotifyFd) {
+    Tracer::LogErrNo("inotify_init1().");
+    return false;
+  }
+  
+  // The directory can be missing till the first device is connected.
+  AddWatch();
+  
+  return true;
+}
+
+void DeviceWatcher::Shutdown()
+{
+  if (_inotifyFd != -1) {
+    ::close(_inotifyFd);
+    _inotifyFd = -1;
+  }
+  
+  _watchDescriptor = -1;
+}
+
+bool DeviceWatcher::ReadEvents()
+{
+  if (-1 == _inotifyFd) {
+    return false;
+  }
+  
+  if (-1 == _watchDescriptor) {
+    return AddWatch();
+  }
+  
+  bool hasChanged = false;
+  
+  alignas(inotify_event) char events[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+  while (true) {
+    const ssize_t bytesRead = ::read(_inotifyFd, events, sizeof(events));
+    if (bytesRead <= 0) {
+      if (-1 == bytesRead && errno != EAGAIN && errno != EINTR) {
+        Tracer::LogErrNo("read(inotify).");
+      }
+      
+      break;
+    }
+    
+    ssize_t offset = 0;
+    while (offset < bytesRead) {
+      const inotify_event* event = reinterpret_cast<const inotify_event*>(events + offset);
+      offset += sizeof(inotify_event) + event->len;
+      
+      if (event->mask & IN_IGNORED) {
+        // The directory was removed.
+        _watchDescriptor = -1;
+        continue;
+      }
+      
+      if ((event->mask & NodeEvents) && event->len > 0 && _nodeName == event->name) {
+        hasChanged = true;
+      }
+    }
+  }
+  
+  if (-1 == _watchDescriptor && AddWatch()) {
+    hasChanged = true;
+  }
+  
+  return hasChanged;
+}
+
+bool DeviceWatcher::AddWatch()
+{
+  _watchDescriptor = ::inotify_add_watch(_inotifyFd, _directory.c_str(), NodeEvents);
+  
+  return _watchDescriptor != -1;
+}
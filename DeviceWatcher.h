@@ -0,0 +1,67 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef DEVICEWATCHER_H
+#define DEVICEWATCHER_H
+
+#include <string>
+
+/*
+ * @brief DeviceWatcher reports that a device node (e.g. "/dev/video0" or
+ *        a "/dev/v4l/by-id/..." link) was created or its attributes were 
+ *        changed (udev sets permissions after creating a node). It watches 
+ *        the directory of the node with inotify so a reconnected camera can
+ *        be reopened at once instead of polling for it.
+ * 
+ * */
+class DeviceWatcher
+{
+public:
+  
+  DeviceWatcher();
+  ~DeviceWatcher();
+  
+  // @brief Starts watching the directory of devicePath. Returns false if inotify is not available.
+  bool Init(const std::string& devicePath);
+  
+  void Shutdown();
+  
+  // @brief Returns inotify fd (it becomes readable on changes in the directory) or -1.
+  int GetFd() const { return _inotifyFd; }
+  
+  // @brief Reads pending events. Returns true if the node was created or changed.
+  //        A removed directory (e.g. "/dev/v4l/by-id") is watched again when it reappears.
+  bool ReadEvents();
+  
+  DeviceWatcher(const DeviceWatcher& other) = delete;
+  DeviceWatcher& operator=(const DeviceWatcher& other) = delete;
+  
+private:
+  
+  bool AddWatch();
+  
+  std::string _directory;
+  std::string _nodeName;
+  int _inotifyFd;
+  int _watchDescriptor;
+};
+
+#endif // DEVICEWATCHER_H
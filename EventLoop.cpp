@@ -0,0 +1,186 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "EventLoop.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "Tracer.h"
+
+namespace {
+  const int MaxEventsPerWait = 64;
+}
+
+EventLoop::EventLoop()
+  : _epollFd(-1),
+    _wakeupFd(-1),
+    _handlers(0)
+{
+}
+
+EventLoop::~EventLoop()
+{
+  Shutdown();
+}
+
+bool EventLoop::Init()
+{
+  if (_epollFd != -1) {
+    return true;
+  }
+  
+  _epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+  if (-1 == _epollFd) {
+    Tracer::LogErrNo("epoll_create1().");
+    return false;
+  }
+  
+  _wakeupFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (-1 == _wakeupFd) {
+    Tracer::LogErrNo("eventfd().");
+    Shutdown();
+    return false;
+  }
+  
+  epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.fd = _wakeupFd;
+  
+  if (-1 == ::epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeupFd, &event)) {
+    Tracer::LogErrNo("epoll_ctl(EPOLL_CTL_ADD).");
+    Shutdown();
+    return false;
+  }
+  
+  return true;
+}
+
+void EventLoop::Shutdown()
+{
+  if (_wakeupFd != -1) {
+    if (-1 == ::close(_wakeupFd)) {
+      Tracer::LogErrNo("close().");
+    }
+    
+    _wakeupFd = -1;
+  }
+  
+  if (_epollFd != -1) {
+    if (-1 == ::close(_epollFd)) {
+      Tracer::LogErrNo("close().");
+    }
+    
+    _epollFd = -1;
+  }
+  
+  _handlers.clear();
+}
+
+bool EventLoop::Add(int fd, uint32_t events, Handler* handler)
+{
+  epoll_event event = {0};
+  event.events = events;
+  event.data.fd = fd;
+  
+  if (-1 == ::epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &event)) {
+    Tracer::LogErrNo("epoll_ctl(EPOLL_CTL_ADD).");
+    return false;
+  }
+  
+  if (static_cast<size_t>(fd) >= _handlers.size()) {
+    _handlers.resize(fd + 1, nullptr);
+  }
+  
+  _handlers[fd] = handler;
+  
+  return true;
+}
+
+bool EventLoop::Modify(int fd, uint32_t events)
+{
+  epoll_event event = {0};
+  event.events = events;
+  event.data.fd = fd;
+  
+  if (-1 == ::epoll_ctl(_epollFd, EPOLL_CTL_MOD, fd, &event)) {
+    Tracer::LogErrNo("epoll_ctl(EPOLL_CTL_MOD).");
+    return false;
+  }
+  
+  return true;
+}
+
+void EventLoop::Remove(int fd)
+{
+  if (static_cast<size_t>(fd) < _handlers.size()) {
+    _handlers[fd] = nullptr;
+  }
+  
+  // The descriptor is going to be closed so errors are not interesting.
+  epoll_event event = {0};
+  ::epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, &event);
+}
+
+int EventLoop::Wait(int timeoutMs)
+{
+  epoll_event events[MaxEventsPerWait];
+  
+  int eventsNumber = ::epoll_wait(_epollFd, events, MaxEventsPerWait, timeoutMs);
+  if (-1 == eventsNumber) {
+    if (errno != EINTR) {
+      Tracer::LogErrNo("epoll_wait().");
+      return -1;
+    }
+    
+    return 0;
+  }
+  
+  for (int i = 0; i < eventsNumber; ++i) {
+    const int fd = events[i].data.fd;
+    
+    if (fd == _wakeupFd) {
+      uint64_t counter;
+      if (-1 == ::read(_wakeupFd, &counter, sizeof(counter)) && errno != EAGAIN) {
+        Tracer::LogErrNo("read(eventfd).");
+      }
+      
+      continue;
+    }
+    
+    // A handler may unregister descriptors which are still in the events list.
+    if (static_cast<size_t>(fd) < _handlers.size() && _handlers[fd] != nullptr) {
+      _handlers[fd]->OnEvent(fd, events[i].events);
+    }
+  }
+  
+  return eventsNumber;
+}
+
+void EventLoop::Wakeup()
+{
+  const uint64_t counter = 1;
+  if (-1 == ::write(_wakeupFd, &counter, sizeof(counter)) && errno != EAGAIN) {
+    Tracer::LogErrNo("write(eventfd).");
+  }
+}
@@ -0,0 +1,85 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * @brief EventLoop is a thin wrapper around epoll.
+ *        Every registered file descriptor has a handler which is called
+ *        from Wait() when the descriptor becomes ready.
+ * 
+ * */
+class EventLoop
+{
+public:
+  
+  class Handler
+  {
+  public:
+    // @brief Called for every ready file descriptor. events is a mask of EPOLL* flags.
+    virtual void OnEvent(int fd, uint32_t events) = 0;
+    
+  protected:
+    ~Handler() {}
+  };
+  
+  EventLoop();
+  ~EventLoop();
+  
+  // @brief Creates epoll instance. Returns true if initialization was successfull.
+  bool Init();
+  
+  // @brief Closes epoll instance. Registered file descriptors are not closed.
+  void Shutdown();
+  
+  // @brief Registers a file descriptor. events is a mask of EPOLL* flags.
+  bool Add(int fd, uint32_t events, Handler* handler);
+  
+  // @brief Changes events mask of an already registered file descriptor.
+  bool Modify(int fd, uint32_t events);
+  
+  // @brief Unregisters a file descriptor. It should be called before closing the descriptor.
+  void Remove(int fd);
+  
+  // @brief Waits for events up to timeoutMs milliseconds (-1 means infinite) and
+  //        dispatches them to handlers. Returns number of dispatched events or -1 on error.
+  int Wait(int timeoutMs);
+  
+  // @brief Interrupts Wait(). It is safe to call it from any thread.
+  void Wakeup();
+  
+  EventLoop(const EventLoop& other) = delete;
+  EventLoop& operator=(const EventLoop& other) = delete;
+  
+private:
+  
+  int _epollFd;
+  int _wakeupFd;
+  
+  // Handlers indexed by file descriptor.
+  std::vector<Handler*> _handlers;
+};
+
+#endif // EVENTLOOP_H
@@ -0,0 +1,425 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "FrameQueue.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "Clock.h"
+#include "MjpegUtils.h"
+#include "EventLoop.h"
+#include "Tracer.h"
+
+namespace {
+  static const uint8_t HttpBoundaryValue[] = "\r\n--BoundaryDoNotCross\r\n";
+  
+  static const char FrameHeaderTemplate[] = 
+    "Content-Type: image/jpeg\r\n" \
+    "Content-Length: %d\r\n" \
+    "X-Timestamp: %ld.%06ld\r\n" \
+    "X-Sequence: %u\r\n" \
+    "\r\n";
+  
+  static const size_t MaxFrameHeaderSize = sizeof(FrameHeaderTemplate) + 100;
+  
+  // HTTP header, MJPEG frame pieces and boundary.
+  static const size_t MaxFramePiecesNumber = 8;
+}
+
+FrameQueue::FrameQueue()
+  : _oldestIdx(InvalidIdx),
+    _newestIdx(InvalidIdx),
+    _isDraining(false),
+    _releaseNotifyLoop(nullptr),
+    _newestFrameNumber(0),
+    _copyDelayMs(0),
+    _copyStats {0, 0, 0, 0}
+{
+}
+
+void FrameQueue::Init(uint32_t copyPoolSize, uint32_t copyDelayMs)
+{
+  // Every video buffer and every copied frame may need a slot.
+  const uint32_t slotsNumber = MaxVideoBuffersNumber + copyPoolSize;
+  
+  // All memory (except copy buffers which are sized by the first copied frame) 
+  // is allocated here so queueing of frames does not allocate.
+  std::vector<QueueItem>(slotsNumber).swap(_slots);
+  _freeSlots.clear();
+  _freeSlots.reserve(slotsNumber);
+  
+  for (uint32_t idx = 0; idx < slotsNumber; ++idx) {
+    QueueItem& item = _slots[idx];
+    item.SlotIdx = idx;
+    item.Header.resize(MaxFrameHeaderSize, 0);
+    item.Data.reserve(MaxFramePiecesNumber);
+    item.SourceData = nullptr;
+    item.Timestamp = timeval {0, 0};
+    item.Sequence = 0;
+    item.FrameNumber = 0;
+    item.UsageCounter = 0;
+    item.SentCounter = 0;
+    item.CopiedFrame = nullptr;
+    item.MappedReaders = 0;
+    item.IsQueued = false;
+    item.PrevIdx = InvalidIdx;
+    item.NextIdx = InvalidIdx;
+    item.QueueTimeMs = 0;
+    item.CopyBufferIdx = InvalidIdx;
+    item.IsSourceReturned = false;
+    item.IsCopyFailed = false;
+    
+    // Lower slots are taken first.
+    _freeSlots.push_back(slotsNumber - 1 - idx);
+  }
+  
+  _copyDelayMs = copyDelayMs;
+  _copyBuffers.resize(copyPoolSize);
+  _freeCopyBuffers.clear();
+  for (uint32_t idx = 0; idx < copyPoolSize; ++idx) {
+    _freeCopyBuffers.push_back(copyPoolSize - 1 - idx);
+  }
+  
+  _copyStats.PoolSize = copyPoolSize;
+}
+
+bool FrameQueue::QueueBuffer(const VideoBuffer* videoBuffer)
+{
+  uint32_t slotIdx = InvalidIdx;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    
+    if (_freeSlots.empty()) {
+      Tracer::Log("Failed to queue video buffer %u: there is no free slot.\n", videoBuffer->Idx);
+      return false;
+    }
+    
+    slotIdx = _freeSlots.back();
+    _freeSlots.pop_back();
+  }
+  
+  // The slot is not visible for senders till it is linked so it can be filled without locking.
+  QueueItem& newFrame = _slots[slotIdx];
+  
+  newFrame.Data.clear();
+  newFrame.Data.push_back(Buffer {newFrame.Header.data(), 0});
+  
+  bool isCreated = AppendMjpegFrameBufferSet(videoBuffer, newFrame.Data);
+  
+  uint32_t frameSize = 0;
+  for (size_t dataIdx = 1; dataIdx < newFrame.Data.size(); ++dataIdx) {
+    frameSize += newFrame.Data[dataIdx].Size;
+  }
+  
+  int result = 0;
+  if (isCreated) {
+    result = std::snprintf(reinterpret_cast<char*>(newFrame.Header.data()),
+                        newFrame.Header.size() - 1, FrameHeaderTemplate, 
+                        frameSize, videoBuffer->V4l2Buffer.timestamp.tv_sec,
+                        videoBuffer->V4l2Buffer.timestamp.tv_usec,
+                        videoBuffer->V4l2Buffer.sequence);
+    if (result <= 0) {
+      Tracer::Log("Failed to create HTTP header for MJPEG frame: snprintf.\n");
+      isCreated = false;
+    }
+    else if (static_cast<uint32_t>(result) > newFrame.Header.size()) {
+      Tracer::Log("Failed to create HTTP header for MJPEG frame. buffer is \n");
+      isCreated = false;
+    }
+  }
+  
+  std::lock_guard<std::mutex> lock(_mutex);
+  
+  if (!isCreated) {
+    _freeSlots.push_back(slotIdx);
+    return false;
+  }
+
+  newFrame.Data[0].Size = static_cast<uint32_t>(result);
+  newFrame.Data.push_back(Buffer {HttpBoundaryValue, sizeof(HttpBoundaryValue) - 1});
+  newFrame.SourceData = videoBuffer;
+  newFrame.Timestamp = videoBuffer->V4l2Buffer.timestamp;
+  newFrame.Sequence = videoBuffer->V4l2Buffer.sequence;
+  newFrame.FrameNumber = _newestFrameNumber + 1;
+  newFrame.UsageCounter = 0;
+  newFrame.SentCounter = 0;
+  newFrame.CopiedFrame = nullptr;
+  newFrame.MappedReaders = 0;
+  newFrame.QueueTimeMs = _copyBuffers.empty() ? 0 : Clock::GetMonotonicTimeMs();
+  newFrame.IsSourceReturned = false;
+  newFrame.IsCopyFailed = false;
+
+  LinkNewest(slotIdx);
+  _newestFrameNumber = newFrame.FrameNumber;
+  
+  return true;
+}
+
+const VideoBuffer* FrameQueue::DequeueBuffer()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  
+  const uint64_t nowMs = _copyBuffers.empty() ? 0 : Clock::GetMonotonicTimeMs();
+  
+  // The newest buffer is never dequeued.
+  uint32_t idx = _oldestIdx;
+  while (idx != _newestIdx) {
+    QueueItem& item = _slots[idx];
+    const uint32_t nextIdx = item.NextIdx;
+    
+    if (0 == item.UsageCounter) {
+      const bool isSourceReturned = item.IsSourceReturned;
+      const VideoBuffer* dequeuedBuffer = item.SourceData;
+      
+      Unlink(idx);
+      FreeSlot(idx);
+      
+      if (!isSourceReturned) {
+        return dequeuedBuffer;
+      }
+    }
+    else if (!item.IsSourceReturned && !_isDraining) {
+      // Slow clients do not hold the video buffer if the frame is copied.
+      if (nullptr == item.CopiedFrame && !item.IsCopyFailed && !_copyBuffers.empty() &&
+          nowMs - item.QueueTimeMs >= _copyDelayMs && ReserveCopyBuffer(item)) {
+        // Senders select frames while the frame is copied.
+        lock.unlock();
+        CopyFrame(item);
+        lock.lock();
+      }
+      
+      // Senders increment MappedReaders before they read CopiedFrame so
+      // a sender which has not seen the copy is counted here.
+      if (item.CopiedFrame != nullptr && 0 == item.MappedReaders) {
+        item.IsSourceReturned = true;
+        return item.SourceData;
+      }
+    }
+    
+    idx = nextIdx;
+  }
+  
+  return nullptr;
+}
+
+bool FrameQueue::ReturnAllBuffers(std::vector<const VideoBuffer*>& buffers)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  
+  _isDraining = true;
+  
+  bool isEverythingReturned = true;
+  
+  uint32_t idx = _oldestIdx;
+  while (idx != InvalidIdx) {
+    QueueItem& item = _slots[idx];
+    const uint32_t nextIdx = item.NextIdx;
+    
+    if (0 == item.UsageCounter) {
+      if (!item.IsSourceReturned) {
+        buffers.push_back(item.SourceData);
+      }
+      
+      Unlink(idx);
+      FreeSlot(idx);
+    }
+    else if (!item.IsSourceReturned) {
+      // Clients can finish sending of a copied frame. The delay is not applied here.
+      if (nullptr == item.CopiedFrame && !_copyBuffers.empty() && ReserveCopyBuffer(item)) {
+        lock.unlock();
+        CopyFrame(item);
+        lock.lock();
+      }
+      
+      if (item.CopiedFrame != nullptr && 0 == item.MappedReaders) {
+        item.IsSourceReturned = true;
+        buffers.push_back(item.SourceData);
+      }
+      else {
+        isEverythingReturned = false;
+      }
+    }
+    
+    idx = nextIdx;
+  }
+  
+  _isDraining = !isEverythingReturned;
+  
+  return isEverythingReturned;
+}
+
+void FrameQueue::CancelReturnAllBuffers()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  
+  _isDraining = false;
+}
+
+FrameQueue::QueueItem* FrameQueue::SelectBufferForSending(const timeval& lastBufferTimestamp)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  
+  if (_isDraining) {
+    return nullptr;
+  }
+  
+  for (uint32_t idx = _newestIdx; idx != InvalidIdx; idx = _slots[idx].PrevIdx) {
+    QueueItem& item = _slots[idx];
+    const timeval& itemTimestamp = item.Timestamp;
+    if (itemTimestamp.tv_sec > lastBufferTimestamp.tv_sec ||
+      (itemTimestamp.tv_sec == lastBufferTimestamp.tv_sec && itemTimestamp.tv_usec > lastBufferTimestamp.tv_usec)) {
+      item.UsageCounter += 1;
+      item.SentCounter += 1;
+      
+      return &item;
+    }
+  }
+  
+  return nullptr;
+}
+
+FrameQueue::QueueItem* FrameQueue::GetBuffer(uint32_t slotIdx)
+{
+  // Slots are never reallocated and a selected slot can not be dequeued.
+  if (slotIdx >= _slots.size()) {
+    return nullptr;
+  }
+  
+  return &_slots[slotIdx];
+}
+
+void FrameQueue::ReleaseBuffer(QueueItem* queueItem)
+{
+  if (1 == queueItem->UsageCounter.fetch_sub(1) && _releaseNotifyLoop != nullptr) {
+    _releaseNotifyLoop->Wakeup();
+  }
+}
+
+FrameQueue::CopyStats FrameQueue::GetCopyStats()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  
+  return _copyStats;
+}
+
+void FrameQueue::LinkNewest(uint32_t idx)
+{
+  QueueItem& item = _slots[idx];
+  item.IsQueued = true;
+  item.PrevIdx = _newestIdx;
+  item.NextIdx = InvalidIdx;
+  
+  if (_newestIdx != InvalidIdx) {
+    _slots[_newestIdx].NextIdx = idx;
+  }
+  else {
+    _oldestIdx = idx;
+  }
+  
+  _newestIdx = idx;
+}
+
+void FrameQueue::Unlink(uint32_t idx)
+{
+  QueueItem& item = _slots[idx];
+  
+  if (item.PrevIdx != InvalidIdx) {
+    _slots[item.PrevIdx].NextIdx = item.NextIdx;
+  }
+  else {
+    _oldestIdx = item.NextIdx;
+  }
+  
+  if (item.NextIdx != InvalidIdx) {
+    _slots[item.NextIdx].PrevIdx = item.PrevIdx;
+  }
+  else {
+    _newestIdx = item.PrevIdx;
+  }
+  
+  item.IsQueued = false;
+  item.PrevIdx = InvalidIdx;
+  item.NextIdx = InvalidIdx;
+}
+
+void FrameQueue::FreeSlot(uint32_t idx)
+{
+  QueueItem& item = _slots[idx];
+  
+  if (item.CopyBufferIdx != InvalidIdx) {
+    _freeCopyBuffers.push_back(item.CopyBufferIdx);
+    _copyStats.PoolBuffersUsed -= 1;
+    
+    item.CopyBufferIdx = InvalidIdx;
+    item.CopiedFrame = nullptr;
+  }
+  
+  _freeSlots.push_back(idx);
+}
+
+bool FrameQueue::ReserveCopyBuffer(QueueItem& item)
+{
+  if (_freeCopyBuffers.empty()) {
+    if (0 == _copyStats.PoolExhaustionsNumber) {
+      Tracer::Log("Copy pool is exhausted. Slow clients hold video buffers.\n");
+    }
+    
+    // Every frame is counted once even if copying is repeated.
+    if (!item.IsCopyFailed) {
+      item.IsCopyFailed = true;
+      _copyStats.PoolExhaustionsNumber += 1;
+    }
+    
+    return false;
+  }
+  
+  item.CopyBufferIdx = _freeCopyBuffers.back();
+  _freeCopyBuffers.pop_back();
+  
+  _copyStats.PoolBuffersUsed += 1;
+  _copyStats.CopiedFramesNumber += 1;
+  
+  return true;
+}
+
+void FrameQueue::CopyFrame(QueueItem& item)
+{
+  uint32_t frameSize = 0;
+  for (const Buffer& buffer : item.Data) {
+    frameSize += buffer.Size;
+  }
+  
+  // A buffer grows only if a bigger frame is copied.
+  std::vector<uint8_t>& copyBuffer = _copyBuffers[item.CopyBufferIdx];
+  if (copyBuffer.size() < frameSize) {
+    copyBuffer.resize(frameSize);
+  }
+  
+  uint8_t* copyPtr = copyBuffer.data();
+  for (const Buffer& buffer : item.Data) {
+    std::memcpy(copyPtr, buffer.Data, buffer.Size);
+    copyPtr += buffer.Size;
+  }
+  
+  // Senders use the copy as soon as they see it.
+  item.CopiedFrame = copyBuffer.data();
+}
@@ -0,0 +1,183 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef FRAMEQUEUE_H
+#define FRAMEQUEUE_H
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <sys/time.h>
+
+#include "Buffer.h"
+
+class EventLoop;
+
+/*
+ * @brief FrameQueue keeps captured frames prepared for HTTP transmission.
+ *        Frames can be selected and released by several sender threads
+ *        while frames are queued and dequeued by the capturing thread.
+ *        Every queued frame takes a preallocated slot and queued slots 
+ *        are linked in order of arrival.
+ *        A frame which is used by clients for too long can be copied to
+ *        a buffer from a copy pool so its video buffer is returned to the camera.
+ * 
+ * */
+class FrameQueue
+{
+public:
+  
+  struct QueueItem {
+    uint32_t SlotIdx;
+    std::vector<uint8_t> Header;
+    std::vector<Buffer> Data;
+    const VideoBuffer* SourceData;
+    timeval Timestamp;
+    uint32_t Sequence;      // V4L2 sequence number (it is reset when streaming is restarted).
+    uint64_t FrameNumber;
+    std::atomic<uint32_t> UsageCounter;
+    std::atomic<uint32_t> SentCounter;
+    
+    // Senders read frame data from CopiedFrame (if it is set) otherwise from Data.
+    // MappedReaders counts senders which may access mmapped data right now.
+    std::atomic<const uint8_t*> CopiedFrame;
+    std::atomic<uint32_t> MappedReaders;
+    
+    // The rest is protected by FrameQueue::_mutex.
+    bool IsQueued;
+    uint32_t PrevIdx;
+    uint32_t NextIdx;
+    uint64_t QueueTimeMs;
+    uint32_t CopyBufferIdx;
+    bool IsSourceReturned;
+    bool IsCopyFailed;
+  };
+  
+  struct CopyStats {
+    uint32_t PoolSize;
+    uint32_t PoolBuffersUsed;
+    uint64_t CopiedFramesNumber;
+    uint64_t PoolExhaustionsNumber;
+  };
+  
+  // V4L2 does not allow more buffers (VIDEO_MAX_FRAME).
+  static const uint32_t MaxVideoBuffersNumber = 32U;
+  
+  FrameQueue();
+  
+  /*
+   * @brief Allocates slots. Frames which are used longer than copyDelayMs are copied 
+   *        to one of copyPoolSize buffers. Zero copyPoolSize disables copying.
+   *        It must be called before the queue is used.
+   */
+  void Init(uint32_t copyPoolSize, uint32_t copyDelayMs);
+  
+  /*
+   * @brief Sets an event loop which is woken up when a buffer is released.
+   *        It is needed if buffers are released by other threads.
+   */
+  void SetReleaseNotification(EventLoop* eventLoop) { _releaseNotifyLoop = eventLoop; }
+  
+  /*
+   * @brief Adds a buffer to a queue "to be sent". 
+   *        Returns true if buffer was successfully queued.
+   */
+  bool QueueBuffer(const VideoBuffer* videoBuffer);
+  
+  /*
+   * @brief Dequeues a buffer.
+   *        Finds a buffer which has already been sent to all clients (or copied) and
+   *        returns it otherwise returns nullptr. 
+   */
+  const VideoBuffer* DequeueBuffer();
+  
+  /*
+   * @brief Stops selecting buffers for sending and appends to buffers all
+   *        video buffers which can be returned right now. Frames which are 
+   *        still being sent are copied if there are free copy buffers.
+   *        Returns true (and allows selecting again) if all video buffers are returned. 
+   *        It does not block so it should be repeated till it returns true.
+   */
+  bool ReturnAllBuffers(std::vector<const VideoBuffer*>& buffers);
+  
+  // @brief Allows selecting buffers again after ReturnAllBuffers() which did not return everything.
+  void CancelReturnAllBuffers();
+  
+  /*
+   * @brief Selects the newest buffer which is newer than lastBufferTimestamp and
+   *        increments its UsageCounter. Returns nullptr if there is no such buffer.
+   */
+  QueueItem* SelectBufferForSending(const timeval& lastBufferTimestamp);
+  
+  /*
+   * @brief Returns an item for a given slot index. It does not lock.
+   *        The item must be selected by the caller (UsageCounter > 0).
+   */
+  QueueItem* GetBuffer(uint32_t slotIdx);
+  
+  /*
+   * @brief Decrements UsageCounter. The item must not be used after the call.
+   */
+  void ReleaseBuffer(QueueItem* queueItem);
+  
+  CopyStats GetCopyStats();
+  
+  // @brief Returns FrameNumber of the last queued frame. Thread safe.
+  uint64_t GetNewestFrameNumber() const { return _newestFrameNumber; }
+  
+  FrameQueue(const FrameQueue& other) = delete;
+  FrameQueue& operator=(const FrameQueue& other) = delete;
+  
+private:
+  
+  static const uint32_t InvalidIdx = 0xFFFFFFFF;
+  
+  void LinkNewest(uint32_t idx);
+  void Unlink(uint32_t idx);
+  
+  // @brief Returns the slot and its copy buffer to free lists.
+  void FreeSlot(uint32_t idx);
+  
+  // @brief Takes a free copy buffer for the slot. Returns false if there is no free buffer. 
+  //        It must be called under _mutex.
+  bool ReserveCopyBuffer(QueueItem& item);
+  
+  // @brief Copies frame data of the slot to its copy buffer and publishes the copy.
+  //        It is called without _mutex so senders are not blocked during copying. The slot 
+  //        can not be freed meanwhile as only the thread which queues and dequeues frames copies them.
+  void CopyFrame(QueueItem& item);
+  
+  std::mutex _mutex;
+  std::vector<QueueItem> _slots;
+  std::vector<uint32_t> _freeSlots;
+  uint32_t _oldestIdx;
+  uint32_t _newestIdx;
+  bool _isDraining;
+  EventLoop* _releaseNotifyLoop;
+  std::atomic<uint64_t> _newestFrameNumber;
+  
+  uint32_t _copyDelayMs;
+  std::vector<std::vector<uint8_t>> _copyBuffers;
+  std::vector<uint32_t> _freeCopyBuffers;
+  CopyStats _copyStats;
+};
+
+#endif // FRAMEQUEUE_H
@@ -0,0 +1,92 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <cstdint>
+#include <string>
+
+struct VideoBuffer;
+
+/*
+ * @brief FrameSource produces MJPEG frames in VideoBuffers (a camera, an upstream
+ *        stream, a recording). Its fd becomes readable when frames are ready. 
+ *        Dequeued frames are returned by RequeueFrame() when they are sent.
+ *        A broken or not ready source is recovered by ReInit() after all 
+ *        its frames are returned. A source can be paused while nobody needs frames.
+ * 
+ * */
+class FrameSource
+{
+public:
+  virtual ~FrameSource() {}
+  
+  // @brief Initializes the source. Returns true if it is ready.
+  virtual bool Init() = 0;
+  
+  virtual bool ReInit() = 0;
+  
+  virtual void Shutdown() = 0;
+  
+  // @brief Return true if a fatal error happened during dequeuing/requeuing of frames.
+  virtual bool IsBroken() const = 0;
+  
+  // @brief Return true if the source was successfully initialized.
+  virtual bool IsReady() const = 0;
+  
+  // @brief Returns a file descriptor which becomes readable when a frame is ready or -1.
+  virtual int GetFd() const = 0;
+  
+  // @brief Returns a ready frame or nullptr. Does not block.
+  virtual const VideoBuffer* DequeuFrame() = 0;
+  
+  virtual void RequeueFrame(const VideoBuffer* buffer) = 0;
+  
+  // @brief Stops producing frames keeping the source initialized so Resume() is fast.
+  //        All dequeued frames should be requeued before. Returns false if it is not supported.
+  virtual bool Pause() { return false; }
+  
+  // @brief Restarts producing frames after Pause(). The source is broken if it fails.
+  virtual bool Resume() { return false; }
+  
+  virtual bool IsPaused() const { return false; }
+  
+  // @brief Returns a device node which appears when the source can be reinitialized
+  //        (e.g. a reconnected camera) or an empty string.
+  virtual std::string GetDevicePath() const { return std::string(); }
+  
+  virtual uint32_t GetBuffersNumber() const { return 0; }
+  
+  // @brief Returns the number of dequeued frames which are not requeued yet.
+  virtual uint32_t GetDequeuedFramesNumber() const { return 0; }
+  
+  // @brief Returns the number of buffers which the source should use or 0 if it does not resize buffers.
+  virtual uint32_t GetWantedBuffersNumber() { return 0; }
+  
+  // @brief Reallocates buffers of a working source. All dequeued frames should be requeued 
+  //        before. Returns true if streaming goes on: with the new number of buffers or with
+  //        the previous one if the new one can not be allocated (see GetBuffersNumber()).
+  //        The source is broken if it returns false.
+  virtual bool ResizeBuffers(uint32_t buffersNumber) { return false; }
+};
+
+#endif // FRAMESOURCE_H
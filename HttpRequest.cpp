@@ -0,0 +1,230 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "HttpRequest.h"
+
+#include <cstring>
+#include <strings.h>
+
+namespace {
+  // Requests are small (GET only) so bigger ones are rejected.
+  static const std::size_t MaxRequestSize = 8192U;
+  static const std::size_t MaxHeadersNumber = 64U;
+  
+  void TrimSpaces(std::string& value) {
+    const std::size_t first = value.find_first_not_of(" \t");
+    if (std::string::npos == first) {
+      value.clear();
+      return;
+    }
+    
+    const std::size_t last = value.find_last_not_of(" \t");
+    value = value.substr(first, last - first + 1);
+  }
+  
+  // @brief Returns true if a comma separated list contains the token (case insensitive).
+  bool ContainsToken(const std::string& list, const char* token) {
+    const std::size_t tokenSize = std::strlen(token);
+    
+    std::size_t tokenStart = 0;
+    while (tokenStart < list.size()) {
+      std::size_t tokenEnd = list.find(',', tokenStart);
+      if (std::string::npos == tokenEnd) {
+        tokenEnd = list.size();
+      }
+      
+      std::string item = list.substr(tokenStart, tokenEnd - tokenStart);
+      TrimSpaces(item);
+      if (item.size() == tokenSize && 0 == ::strncasecmp(item.c_str(), token, tokenSize)) {
+        return true;
+      }
+      
+      tokenStart = tokenEnd + 1;
+    }
+    
+    return false;
+  }
+}
+
+HttpRequestParser::HttpRequestParser()
+  : _state(ParsingRequestLine),
+    _requestSize(0),
+    _isHttp11(false)
+{
+}
+
+void HttpRequestParser::Reset()
+{
+  _state = ParsingRequestLine;
+  _requestSize = 0;
+  _line.clear();
+  _method.clear();
+  _path.clear();
+  _query.clear();
+  _isHttp11 = false;
+  _headers.clear();
+  _queryParameters.clear();
+}
+
+std::size_t HttpRequestParser::Parse(const char* data, std::size_t size)
+{
+  std::size_t consumed = 0;
+  
+  while (consumed < size && (ParsingRequestLine == _state || ParsingHeaders == _state)) {
+    const char* lineEnd = static_cast<const char*>(std::memchr(data + consumed, '\n', size - consumed));
+    const std::size_t pieceSize = (lineEnd != nullptr ? lineEnd - (data + consumed) + 1 : size - consumed);
+    
+    _requestSize += pieceSize;
+    if (_requestSize > MaxRequestSize) {
+      _state = Failed;
+      break;
+    }
+    
+    _line.append(data + consumed, lineEnd != nullptr ? pieceSize - 1 : pieceSize);
+    consumed += pieceSize;
+    
+    if (nullptr == lineEnd) {
+      break;
+    }
+    
+    // Lines are terminated by CRLF but a bare LF is accepted too.
+    if (!_line.empty() && '\r' == _line[_line.size() - 1]) {
+      _line.resize(_line.size() - 1);
+    }
+    
+    if (ParsingRequestLine == _state) {
+      // Empty lines before a request line are ignored (RFC 7230, 3.5).
+      if (!_line.empty()) {
+        _state = ParseRequestLine() ? ParsingHeaders : Failed;
+      }
+    }
+    else if (_line.empty()) {
+      _state = Completed;
+    }
+    else if (!ParseHeaderLine()) {
+      _state = Failed;
+    }
+    
+    _line.clear();
+  }
+  
+  return consumed;
+}
+
+const std::string* HttpRequestParser::FindHeader(const char* name) const
+{
+  for (const auto& header : _headers) {
+    if (0 == ::strcasecmp(header.first.c_str(), name)) {
+      return &header.second;
+    }
+  }
+  
+  return nullptr;
+}
+
+const std::string* HttpRequestParser::FindQueryParameter(const char* name) const
+{
+  for (const auto& parameter : _queryParameters) {
+    if (parameter.first == name) {
+      return &parameter.second;
+    }
+  }
+  
+  return nullptr;
+}
+
+bool HttpRequestParser::IsKeepAlive() const
+{
+  const std::string* connection = FindHeader("Connection");
+  
+  if (_isHttp11) {
+    return nullptr == connection || !ContainsToken(*connection, "close");
+  }
+  
+  return connection != nullptr && ContainsToken(*connection, "keep-alive");
+}
+
+bool HttpRequestParser::ParseRequestLine()
+{
+  // Method SP Request-URI SP HTTP-Version
+  const std::size_t methodEnd = _line.find(' ');
+  if (std::string::npos == methodEnd || 0 == methodEnd) {
+    return false;
+  }
+  
+  const std::size_t uriEnd = _line.find(' ', methodEnd + 1);
+  if (std::string::npos == uriEnd || uriEnd == methodEnd + 1) {
+    return false;
+  }
+  
+  const std::string version = _line.substr(uriEnd + 1);
+  if (0 != version.compare(0, 5, "HTTP/") || version.size() < 8) {
+    return false;
+  }
+  
+  _isHttp11 = (version > "HTTP/1.0");
+  
+  _method = _line.substr(0, methodEnd);
+  
+  const std::string uri = _line.substr(methodEnd + 1, uriEnd - methodEnd - 1);
+  const std::size_t queryStart = uri.find('?');
+  _path = uri.substr(0, queryStart);
+  _query = (queryStart != std::string::npos ? uri.substr(queryStart + 1) : std::string());
+  
+  std::size_t parameterStart = 0;
+  while (parameterStart < _query.size()) {
+    std::size_t parameterEnd = _query.find('&', parameterStart);
+    if (std::string::npos == parameterEnd) {
+      parameterEnd = _query.size();
+    }
+    
+    const std::string parameter = _query.substr(parameterStart, parameterEnd - parameterStart);
+    if (!parameter.empty()) {
+      const std::size_t nameEnd = parameter.find('=');
+      _queryParameters.push_back(std::make_pair(parameter.substr(0, nameEnd), 
+        std::string::npos == nameEnd ? std::string() : parameter.substr(nameEnd + 1)));
+    }
+    
+    parameterStart = parameterEnd + 1;
+  }
+  
+  return '/' == _path[0];
+}
+
+bool HttpRequestParser::ParseHeaderLine()
+{
+  // Obsolete line folding is not supported.
+  if (' ' == _line[0] || '\t' == _line[0] || _headers.size() >= MaxHeadersNumber) {
+    return false;
+  }
+  
+  const std::size_t nameEnd = _line.find(':');
+  if (std::string::npos == nameEnd || 0 == nameEnd) {
+    return false;
+  }
+  
+  std::string value = _line.substr(nameEnd + 1);
+  TrimSpaces(value);
+  
+  _headers.push_back(std::make_pair(_line.substr(0, nameEnd), value));
+  
+  return true;
+}
@@ -0,0 +1,93 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef HTTPREQUEST_H
+#define HTTPREQUEST_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+/*
+ * @brief HttpRequestParser parses an HTTP request (request line and headers)
+ *        incrementally: data can be passed by arbitrary pieces as it is read 
+ *        from a socket. A request body is not supported.
+ * 
+ * */
+class HttpRequestParser
+{
+public:
+  
+  enum State {
+    ParsingRequestLine,
+    ParsingHeaders,
+    Completed,
+    Failed
+  };
+  
+  HttpRequestParser();
+  
+  // @brief Prepares the parser for the next request.
+  void Reset();
+  
+  // @brief Parses data till the end of the request. Returns number of consumed bytes
+  //        so the rest of data belongs to the next request.
+  std::size_t Parse(const char* data, std::size_t size);
+  
+  State GetState() const { return _state; }
+  
+  const std::string& GetMethod() const { return _method; }
+  const std::string& GetPath() const { return _path; }
+  const std::string& GetQuery() const { return _query; }
+  
+  // @brief Returns true for HTTP/1.1 and newer.
+  bool IsHttp11() const { return _isHttp11; }
+  
+  // @brief Returns a value of a header (names are case insensitive) or nullptr.
+  const std::string* FindHeader(const char* name) const;
+  
+  // @brief Returns a value of a query parameter ("name=value" pairs separated by '&') or nullptr.
+  //        Values are not percent-decoded.
+  const std::string* FindQueryParameter(const char* name) const;
+  
+  // @brief Returns true if the client asks to keep the connection open after
+  //        the response (default for HTTP/1.1, "Connection: keep-alive" for HTTP/1.0).
+  bool IsKeepAlive() const;
+  
+private:
+  
+  bool ParseRequestLine();
+  bool ParseHeaderLine();
+  
+  State _state;
+  std::size_t _requestSize;
+  std::string _line;
+  
+  std::string _method;
+  std::string _path;
+  std::string _query;
+  bool _isHttp11;
+  std::vector<std::pair<std::string, std::string>> _headers;
+  std::vector<std::pair<std::string, std::string>> _queryParameters;
+};
+
+#endif // HTTPREQUEST_H
@@ -23,46 +23,36 @@
 
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 
-#include "MjpegUtils.h"
+#include "Clock.h"
+#include "SocketCompat.h"
 #include "Tracer.h"
 
 namespace {
 
 const static size_t MaxServersNum = 8U;
-const static size_t MaxClientsNum = 20U;
 
-const size_t ClientReadBufferSize = 2048U;
-std::vector<uint8_t> ClientReadBuffer(ClientReadBufferSize);
-
-static const uint8_t HttpBoundaryValue[] = "\r\n--BoundaryDoNotCross\r\n";
-
-static const char HttpHeader[] = 
-  "HTTP/1.0 200 OK\r\n" \
-  "Connection: close\r\n" \
-  "Server: uvc-streamer/0.01\r\n" \
-  "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
-  "Pragma: no-cache\r\n" \
-  "Expires: Thu, 1 Jan 1970 00:00:01 GMT\r\n"
-  "Content-Type: multipart/x-mixed-replace; boundary=BoundaryDoNotCross\r\n" \
-  "\r\n" \
-  "--BoundaryDoNotCross\r\n";
-
-static const uint32_t HeaderSize = sizeof(HttpHeader) - 1;
+// Listening sockets are watched for new connections.
+static const uint32_t ListenEvents = EPOLLIN | EPOLLET;
 
 bool SetupListeningSocket(int socketFd, const addrinfo* addrInfo, int maxPendingConnections);
 int CreateListeningSocket(const addrinfo* addrInfo);
+bool IsZeroCopySupported();
 }
 
-HttpServer::HttpServer()
-  : _listeningFds(0)
+HttpServer::HttpServer(EventLoop& eventLoop)
+  : _eventLoop(eventLoop),
+    _isZeroCopySupported(false),
+    _acceptedClientsNumber(0),
+    _listeningFds(0)
 {
   _listeningFds.reserve(MaxServersNum);
 }
@@ -72,8 +62,93 @@ HttpServer::~HttpServer()
   Shutdown();
 }
 
-bool HttpServer::Init(const char* servicePort)
+bool HttpServer::Init(const Config& config)
 {
+  _config = config;
+  
+  if (_config.ZeroCopy) {
+    _isZeroCopySupported = IsZeroCopySupported();
+    if (!_isZeroCopySupported) {
+      Tracer::Log("MSG_ZEROCOPY is not supported. Regular send is used.\n");
+    }
+  }
+  
+  const size_t camerasNumber = std::max<size_t>(_config.CameraNames.size(), 1);
+  if (camerasNumber > ClientShard::MaxCamerasNumber) {
+    Tracer::Log("Too many cameras (max %u).\n", ClientShard::MaxCamerasNumber);
+    return false;
+  }
+  
+  // A single shard works in the caller's thread. Otherwise every shard has own thread.
+  const uint32_t shardsNumber = _config.ThreadsNumber > 1 ? _config.ThreadsNumber : 1;
+  
+  // The kernel references frames sent with MSG_ZEROCOPY so their video buffers can not be returned earlier.
+  const uint32_t copyPoolSize = _isZeroCopySupported ? 0 : _config.CopyPoolSize;
+  
+  std::vector<ClientShard::Camera> cameras;
+  for (size_t cameraIdx = 0; cameraIdx < camerasNumber; ++cameraIdx) {
+    std::unique_ptr<FrameQueue> frameQueue(new FrameQueue());
+    frameQueue->Init(copyPoolSize, _config.CopyDelayMs);
+    
+    if (shardsNumber > 1) {
+      // Buffers are released by shard threads so the caller should be woken up to requeue them.
+      frameQueue->SetReleaseNotification(&_eventLoop);
+    }
+    
+    ClientShard::Camera camera;
+    camera.Name = cameraIdx < _config.CameraNames.size() ? _config.CameraNames[cameraIdx] : std::string();
+    camera.Queue = frameQueue.get();
+    cameras.push_back(camera);
+    
+    _frameQueues.push_back(std::move(frameQueue));
+  }
+  
+  _drainStartMs.assign(camerasNumber, 0);
+  
+  ClientShard::Config shardConfig = {0};
+  shardConfig.IsZeroCopy = _isZeroCopySupported;
+  shardConfig.SkipLagBytes = _config.SkipLagBytes;
+  shardConfig.DowngradeLagMs = _config.DowngradeLagMs;
+  shardConfig.DisconnectLagMs = _config.DisconnectLagMs;
+  shardConfig.IdleTimeoutMs = _config.IdleTimeoutMs;
+  shardConfig.RateLimitBytes = _config.RateLimitKBps * 1024U;
+  shardConfig.IsLatencyMode = _config.LatencyMode;
+  shardConfig.GetStatsText = [this]() { return GetStatsText(); };
+  
+  // A single shard works in the caller's loop which checks watched cameras after serving requests.
+  if (shardsNumber > 1) {
+    shardConfig.NotifyCameraWatched = [this]() { _eventLoop.Wakeup(); };
+  }
+  
+  if (!_config.RtpDestination.empty()) {
+    RtpSender::Config rtpConfig;
+    rtpConfig.Destination = _config.RtpDestination;
+    rtpConfig.MulticastTtl = _config.RtpTtl;
+    
+    _rtpSender.reset(new RtpSender());
+    if (!_rtpSender->Init(rtpConfig)) {
+      Tracer::Log("Failed to initialize RTP sender.\n");
+      return false;
+    }
+    
+    // SDP does not change after Init() so shard threads can read it.
+    const RtpSender* rtpSender = _rtpSender.get();
+    shardConfig.GetSdpText = [rtpSender]() { return rtpSender->GetSdp(); };
+  }
+  
+  for (uint32_t shardIdx = 0; shardIdx < shardsNumber; ++shardIdx) {
+    std::unique_ptr<ClientShard> shard(new ClientShard(cameras));
+    
+    bool isStarted = (1 == shardsNumber) ? shard->Init(&_eventLoop, shardConfig) 
+                                         : shard->Start(shardConfig);
+    if (!isStarted) {
+      Tracer::Log("Failed to start client shard.\n");
+      return false;
+    }
+    
+    _shards.push_back(std::move(shard));
+  }
+  
   addrinfo addrHints = {0};
   addrHints.ai_family = PF_INET; // Only IPv4
   addrHints.ai_flags = AI_PASSIVE;
@@ -82,7 +157,7 @@ bool HttpServer::Init(const char* servicePort)
   int result = 0;
   
   addrinfo* addrInfoHead;
-  if ((result = ::getaddrinfo(nullptr, servicePort, &addrHints, &addrInfoHead)) != 0) {
+  if ((result = ::getaddrinfo(nullptr, _config.ServicePort.c_str(), &addrHints, &addrInfoHead)) != 0) {
     Tracer::LogErrNo(::gai_strerror(result));
     return false;
   }
@@ -91,7 +166,12 @@ bool HttpServer::Init(const char* servicePort)
   while (currAddrInfo != nullptr) {
     int currAddrFd = CreateListeningSocket(currAddrInfo);
     if (currAddrFd != -1) {
-      _listeningFds.push_back(currAddrFd);
+      if (_eventLoop.Add(currAddrFd, ListenEvents, this)) {
+        _listeningFds.push_back(currAddrFd);
+      }
+      else {
+        ::close(currAddrFd);
+      }
     }
     else {
       Tracer::Log("Failed to create a listening socket.\n");
@@ -105,511 +185,216 @@ bool HttpServer::Init(const char* servicePort)
   return !_listeningFds.empty();
 }
 
-void HttpServer::ServeRequests(long maxServeTimeMicroSec)
+bool HttpServer::QueueBuffer(const VideoBuffer* videoBuffer, uint32_t cameraIdx)
 {
-  // Send data to connected clients
-
-  if (!_beingServedClients.empty()) {
-    SendData(maxServeTimeMicroSec);
-  }    
-
-  // If there is only one client then we have to send all grabbed data to it.
-  while (_beingServedClients.size() == 1 && 
-    _beingServedClients.cbegin()->second.VideoBufferIdx != ResponseInfo::InvalidBufferIdx) {
-    
-    SendData(maxServeTimeMicroSec);
-  }
-  
-  
-  // Check for new connections.
-  
-  // Count and accept only for every 100th call.
-  static uint32_t listenCount = 0;
-  listenCount %= 1000;
-  listenCount += 1;
-  if ((listenCount % 100) == 0) {
-    return;
+  if (cameraIdx >= _frameQueues.size()) {
+    return false;
   }
   
-  fd_set selectfds;
-  FD_ZERO(&selectfds);
-  
-  int maxFd = 0;
-  
-  for (size_t i = 0; i < _listeningFds.size(); ++i) {
-    if (_listeningFds[i] != -1) {
-      FD_SET(_listeningFds[i], &selectfds);
-      
-      if (_listeningFds[i] > maxFd) {
-        maxFd = _listeningFds[i];
-      }
+  const bool isQueued = _frameQueues[cameraIdx]->QueueBuffer(videoBuffer);
+  if (isQueued) {
+    for (auto& shard : _shards) {
+      shard->NotifyNewBuffer(cameraIdx);
     }
   }
-
-  timeval selectTimeSpec = { 0 };
-  int result = ::select(maxFd + 1, &selectfds, nullptr, nullptr, &selectTimeSpec);
-  if (result < 0 && errno != EINTR) {
-    Tracer::LogErrNo("select().");
-    return;
-  }
   
-  for (size_t i = 0; i < _listeningFds.size(); ++i) {
-    if (_listeningFds[i] != -1 && FD_ISSET(_listeningFds[i], &selectfds)) {
-      
-      sockaddr_storage sockAddr = {0};
-      socklen_t sockAddrSize = sizeof(sockAddr);
-      
-      int clientFd = ::accept(_listeningFds[i], reinterpret_cast<sockaddr*>(&sockAddr), &sockAddrSize);
-      if (-1 != clientFd) {
-        if (GetClientsNumber() < MaxClientsNum) {
-          result = ::fcntl(clientFd, F_SETFL, O_NONBLOCK);
-          if (-1 == result) {
-            Tracer::LogErrNo("fcntl() F_SETFL, O_NONBLOCK.");
-            ::close(clientFd);
-          }
-          else {
-            _waitingClients[clientFd] = RequestInfo();
-          }
-        }
-        else {
-          Tracer::Log("Client dropped because of MaxClientsNum.\n");
-          ::close(clientFd);
-        }
-      }
-      else {
-        Tracer::LogErrNo("accept().");
-      }
-    }
+  // Shards are notified first so TCP clients do not wait for RTP packets. The newest
+  // buffer is not dequeued (and a failed one is not requeued) till the call returns.
+  if (_rtpSender && 0 == cameraIdx) {
+    _rtpSender->SendFrame(videoBuffer);
   }
   
-  ReadAndParseRequests();
+  return isQueued;
 }
 
-bool HttpServer::HasDataToSend() const
+const VideoBuffer* HttpServer::DequeueBuffer(uint32_t cameraIdx)
 {
-  for (auto clientIt : _beingServedClients) {
-    
-    const ResponseInfo& responseInfo = clientIt.second;
-    
-    if (responseInfo.HeaderBytesSent < HeaderSize ||
-      responseInfo.DataBufferIdx != ResponseInfo::InvalidBufferIdx) {
-      return true;
-    }
-  }  
-  
-  return false;
+  return cameraIdx < _frameQueues.size() ? _frameQueues[cameraIdx]->DequeueBuffer() : nullptr;
 }
 
-void HttpServer::ReadAndParseRequests()
+bool HttpServer::TryDequeueAllBuffers(std::vector<const VideoBuffer*>& buffers, uint32_t cameraIdx)
 {
-  fd_set selectFds;
-  FD_ZERO(&selectFds);
-  
-  int maxFd = 0;
-  
-  for (auto clientFdIt : _waitingClients) {
-    int clientFd = clientFdIt.first;
-    
-    FD_SET(clientFd, &selectFds);
-    
-    if (clientFd > maxFd) {
-      maxFd = clientFd;
-    }
-  }
-  
-  if (0 == maxFd) {
-    return;
-  }
-  
-  timeval selectTimeSpec = {0};
-  int result = ::select(maxFd + 1, &selectFds, nullptr, nullptr, &selectTimeSpec);
-  if (result < 0 && errno != EINTR && errno != EBADF) {
-    Tracer::LogErrNo("select().");
-    
-    // Something wrong happened with waiting clients. Drop all of them.
-    
-    for (auto clientFdIt : _waitingClients) {
-      result = ::close(clientFdIt.first);
-      if (result < 0) {
-        Tracer::LogErrNo("close().");
-      }
-    }
-    
-    _waitingClients.clear();
-    return;
-  }
-  
-  std::list<int> brokenClientFds;
-  std::list<int> parsedClientFds;
-  
-  for (auto clientFdIt : _waitingClients) {
-    int clientFd = clientFdIt.first;
-    RequestInfo& requestInfo = clientFdIt.second;
-    
-    if (FD_ISSET(clientFd, &selectFds)) {
-      ssize_t readResult = ::read(clientFd, ClientReadBuffer.data(), ClientReadBuffer.size());
-      if (readResult > 0) {
-        requestInfo.RequestData.insert(requestInfo.RequestData.end(), ClientReadBuffer.data(), ClientReadBuffer.data() + readResult);
-        
-        for (auto ch : ClientReadBuffer) {
-          if (ch == '\n') {
-            parsedClientFds.push_back(clientFd);
-            break;
-          }
-        }
-      }
-      else if (EAGAIN == readResult || EWOULDBLOCK == readResult) {
-      }
-      else {
-        // Something wrong with a client. Close it.
-        _waitingClients.erase(clientFd);
-        brokenClientFds.push_back(clientFd);
-      }
-    }
-  }
-  
-  for (auto brokenClientFd : brokenClientFds) {
-    if (::close(brokenClientFd) != 0) {
-      Tracer::LogErrNo("close().");
-    }
+  if (cameraIdx >= _frameQueues.size()) {
+    return true;
   }
   
-  for (auto parsedClientFd : parsedClientFds) {
-    _waitingClients.erase(parsedClientFd);
-    _beingServedClients[parsedClientFd] = ResponseInfo();
-  }
+  return _frameQueues[cameraIdx]->ReturnAllBuffers(buffers);
 }
 
-void HttpServer::SendData(long timeoutMicroSec)
+void HttpServer::CancelDequeueAllBuffers(uint32_t cameraIdx)
 {
-  fd_set selectFds;
-  FD_ZERO(&selectFds);
-  
-  int maxFd = 0;
-  
-  for (auto clientFdIt : _beingServedClients) {
-    int clientFd = clientFdIt.first;
-    
-    FD_SET(clientFd, &selectFds);
-    
-    if (clientFd > maxFd) {
-      maxFd = clientFd;
-    }
+  if (cameraIdx < _frameQueues.size()) {
+    _frameQueues[cameraIdx]->CancelReturnAllBuffers();
   }
+}
+
+bool HttpServer::DequeueAllBuffers(std::vector<const VideoBuffer*>& buffers, uint32_t cameraIdx)
+{
+  static const uint64_t MaxDrainTimeMs = 500;
   
-  if (0 == maxFd) {
-    return;
+  if (cameraIdx >= _frameQueues.size()) {
+    return true;
   }
   
-  timeval selectTimeSpec = {0, timeoutMicroSec};
+  FrameQueue& frameQueue = *_frameQueues[cameraIdx];
+  uint64_t& drainStartMs = _drainStartMs[cameraIdx];
   
-  int result = ::select(maxFd + 1, nullptr, &selectFds, nullptr, &selectTimeSpec);
-  if (result < 0 && errno != EINTR) {
-    Tracer::LogErrNo("select().");
-    return;
+  bool isEverythingDequeued = frameQueue.ReturnAllBuffers(buffers);
+  if (isEverythingDequeued) {
+    drainStartMs = 0;
+    return true;
   }
   
-  if (0 == result) {
-    return;
+  const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+  if (0 == drainStartMs) {
+    drainStartMs = nowMs;
   }
-  
-  std::list<int> brokenClientFds;
-  
-  for (std::pair<const int, ResponseInfo>& beingServedClientsIt : _beingServedClients) {
-    int clientFd = beingServedClientsIt.first;
-    
-    if (FD_ISSET(clientFd, &selectFds)) {
-      ResponseInfo& responseInfo = beingServedClientsIt.second;
-      
-      bool shouldBreak = false;
-      
-      while (!shouldBreak) {
-        if (responseInfo.HeaderBytesSent < HeaderSize) {
-          int writeResult = ::write(clientFd, HttpHeader + responseInfo.HeaderBytesSent, HeaderSize - responseInfo.HeaderBytesSent);
-          if (writeResult > 0) {
-            responseInfo.HeaderBytesSent += writeResult;
-          }
-          else if (-1 == writeResult && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            // Stop sending data to the current client as it is busy.
-            shouldBreak = true;
-          }
-          else {
-            // Stop sending data to the current client as something went wrong.
-            shouldBreak = true;
-            Tracer::LogErrNo("write().");
-            brokenClientFds.push_back(clientFd);
-          }
-        }      
-        else if (ResponseInfo::InvalidBufferIdx == responseInfo.VideoBufferIdx) {
-          HttpServer::QueueItem* queueItem = SelectBufferForSending(responseInfo.Timestamp);
-          if (queueItem != nullptr) {
-            queueItem->UsageCounter += 1;
-            queueItem->SentCounter += 1;
-            
-            responseInfo.DataBufferBytesSent = 0;
-            responseInfo.DataBufferIdx = 0;
-            responseInfo.Timestamp = queueItem->SourceData->V4l2Buffer.timestamp;
-            responseInfo.VideoBufferIdx = queueItem->SourceData->Idx;
-          }
-          else {
-            // Stop sending data to the current client as there is no data for sending.
-            shouldBreak = true;
-          }
-        }
-        else {
-          HttpServer::QueueItem* queueItem = GetBuffer(responseInfo.VideoBufferIdx);
-          
-          if (nullptr == queueItem) {
-            // Stop sending data to the current client as unexpected problem is detected.
-            shouldBreak = true;
-          }
-          else {
-            const Buffer& buffer = queueItem->Data[responseInfo.DataBufferIdx];
-            int writeResult = ::write(clientFd, buffer.Data + responseInfo.DataBufferBytesSent,
-                                      buffer.Size - responseInfo.DataBufferBytesSent);
-            if (writeResult > 0) {
-              responseInfo.DataBufferBytesSent += writeResult;
-              if (responseInfo.DataBufferBytesSent == buffer.Size) {
-                if (responseInfo.DataBufferIdx + 1 >= queueItem->Data.size()) {
-                  // The item was sent so we need to find a new item
-                  responseInfo.VideoBufferIdx = ResponseInfo::InvalidBufferIdx;
-                  
-                  // Release the item.
-                  queueItem->UsageCounter -= 1;
-                }
-                else {
-                  // Switch to next buffer
-                  responseInfo.DataBufferIdx += 1;
-                  responseInfo.DataBufferBytesSent = 0;             
-                }
-              }
-            }
-            else if (-1 == writeResult && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-              shouldBreak = true;
-            }
-            else {
-              // Stop sending data to the current client as something went wrong.
-              shouldBreak = true;
-              Tracer::LogErrNo("write().");
-              brokenClientFds.push_back(clientFd);
-
-              queueItem->UsageCounter -= 1;
-            }        
-          }
-        }
-      }
+  else if (nowMs - drainStartMs >= MaxDrainTimeMs) {
+    // Shard threads close clients asynchronously and the caller is woken up
+    // when buffers are released.
+    for (auto& shard : _shards) {
+      shard->CloseBusyClients(cameraIdx);
     }
-  }
-  
-  for (auto clientFd : brokenClientFds) {
-    _beingServedClients.erase(clientFd);
     
-    if (-1 == ::close(clientFd)) {
-      Tracer::LogErrNo("close().");
-    }
-  }  
-}
-
-HttpServer::QueueItem* HttpServer::SelectBufferForSending(const timeval& lastBufferTimestamp)
-{
-  for (auto it = _incomeQueue.rbegin(); it != _incomeQueue.rend(); it++) {
-    const timeval& itemTimestamp = it->SourceData->V4l2Buffer.timestamp;
-    if (itemTimestamp.tv_sec > lastBufferTimestamp.tv_sec ||
-      (itemTimestamp.tv_sec == lastBufferTimestamp.tv_sec && itemTimestamp.tv_usec > lastBufferTimestamp.tv_usec)) {
-      return &(*it);
+    isEverythingDequeued = frameQueue.ReturnAllBuffers(buffers);
+    if (isEverythingDequeued) {
+      drainStartMs = 0;
     }
   }
   
-  return nullptr;
+  return isEverythingDequeued;
 }
 
-HttpServer::QueueItem* HttpServer::GetBuffer(uint32_t videoBufferIdx)
+void HttpServer::ServeRequests()
 {
-  for (QueueItem& queueItem : _incomeQueue) {
-    if (queueItem.SourceData->Idx == videoBufferIdx) {
-      return &queueItem;
-    }
+  if (1 == _shards.size()) {
+    _shards[0]->ServeRequests();
   }
-  
-  return nullptr;
 }
 
-bool HttpServer::QueueBuffer(const VideoBuffer* videoBuffer)
+std::size_t HttpServer::GetClientsNumber() const
 {
-  std::vector<Buffer> mjpegFrameData = CreateMjpegFrameBufferSet(videoBuffer);
-  if (mjpegFrameData.empty()) {
-    return false;
-  }
-  
-  uint32_t frameSize = 0;
-  for (const Buffer& buff : mjpegFrameData) {
-    frameSize += buff.Size;
-  }
-  
-  static const char frameHeaderTemplate[] = 
-    "Content-Type: image/jpeg\r\n" \
-    "Content-Length: %d\r\n" \
-    "X-Timestamp: %ld.%06ld\r\n" \
-    "\r\n";
-
-  std::vector<uint8_t> frameHeaderBuff(sizeof(frameHeaderTemplate) + 100, 0);
-  int result = std::snprintf(reinterpret_cast<char*>(frameHeaderBuff.data()),
-                        frameHeaderBuff.size() - 1, frameHeaderTemplate, 
-                        frameSize, videoBuffer->V4l2Buffer.timestamp.tv_sec,
-                        videoBuffer->V4l2Buffer.timestamp.tv_usec);
-  if (result <= 0) {
-    Tracer::Log("Failed to create HTTP header for MJPEG frame: snprintf.\n");
-    return false;
+  std::size_t clientsNumber = 0;
+  for (auto& shard : _shards) {
+    clientsNumber += shard->GetClientsNumber();
   }
   
-  uint32_t headerSize = static_cast<uint32_t>(result);
-  if (headerSize > frameHeaderBuff.size()) {
-    Tracer::Log("Failed to create HTTP header for MJPEG frame. buffer is \n");
-    return false;
-  }
-
-  QueueItem newFrame;
-  newFrame.Header.swap(frameHeaderBuff);
-
-  newFrame.Data.reserve(mjpegFrameData.size() + 2);
-  newFrame.Data.push_back(Buffer {newFrame.Header.data(), headerSize});
-  newFrame.Data.insert(newFrame.Data.end(), mjpegFrameData.begin(), mjpegFrameData.end());
-  newFrame.Data.push_back(Buffer {HttpBoundaryValue, sizeof(HttpBoundaryValue) - 1});
-  newFrame.SourceData = videoBuffer;
-  newFrame.UsageCounter = 0;
-  newFrame.SentCounter = 0;
-
-  _incomeQueue.push_back(std::move(newFrame));
-  
-  return true;
+  return clientsNumber;
 }
 
-const VideoBuffer* HttpServer::DequeueBuffer()
+bool HttpServer::IsCameraWatched(uint32_t cameraIdx) const
 {
-  auto currIt = _incomeQueue.begin();
-  while (currIt != _incomeQueue.end()) {
-    auto nextIt = currIt;
-    ++nextIt;
-    
-    if (nextIt != _incomeQueue.end() && 0 == currIt->UsageCounter) {
-      const VideoBuffer* dequeuedBuffer = currIt->SourceData;
-
-// This code is for debugging slow clients      
-//       if (!_beingServedClients.empty()) {
-//         if (0 == currIt->SentCounter) {
-//           Tracer::Log("HttpServer missed frame %d %ld.%06ld\n",
-//                  dequeuedBuffer->V4l2Buffer.sequence,
-//                  dequeuedBuffer->V4l2Buffer.timestamp.tv_sec,
-//                  dequeuedBuffer->V4l2Buffer.timestamp.tv_usec);
-//         }
-//         
-//         static timeval lastSentTs = dequeuedBuffer->V4l2Buffer.timestamp;
-//         
-//         long int delta = 0;
-//         long int seconds = dequeuedBuffer->V4l2Buffer.timestamp.tv_sec - lastSentTs.tv_sec;
-//         
-//         if (seconds > 0) {
-//           delta = seconds * 1000000;
-//           delta -= lastSentTs.tv_usec;
-//           delta += dequeuedBuffer->V4l2Buffer.timestamp.tv_usec;
-//         }
-//         else {
-//           delta = dequeuedBuffer->V4l2Buffer.timestamp.tv_usec - lastSentTs.tv_usec;
-//         }
-//         
-//         if (delta > 40000) {
-//           Tracer::Log("Latency detected for frame %d: %ld\n", dequeuedBuffer->V4l2Buffer.sequence, delta);
-//         }
-//         
-//         lastSentTs = dequeuedBuffer->V4l2Buffer.timestamp;
-//       }
-      
-      _incomeQueue.erase(currIt);
-      return dequeuedBuffer;
+  for (auto& shard : _shards) {
+    if (shard->GetWatchedCameras() & (1U << cameraIdx)) {
+      return true;
     }
-    
-    currIt = nextIt;
   }
   
-  return nullptr;
+  return false;
 }
 
-std::vector<const VideoBuffer*> HttpServer::DequeueAllBuffers()
+HttpServer::Stats HttpServer::GetStats()
 {
-  std::vector<const VideoBuffer*> result;
-  result.reserve(_incomeQueue.size());
-  for (auto item : _incomeQueue) {
-    result.push_back(item.SourceData);
+  Stats stats = {0};
+  stats.ClientsNumber = GetClientsNumber();
+  
+  // Copy pools of all cameras are summed.
+  for (auto& frameQueue : _frameQueues) {
+    const FrameQueue::CopyStats copyStats = frameQueue->GetCopyStats();
+    stats.CopyPoolSize += copyStats.PoolSize;
+    stats.CopyPoolBuffersUsed += copyStats.PoolBuffersUsed;
+    stats.CopiedFramesNumber += copyStats.CopiedFramesNumber;
+    stats.CopyPoolExhaustionsNumber += copyStats.PoolExhaustionsNumber;
   }
   
-  // We have to wait till all currenty being transmitted buffers are sent.
+  stats.AcceptedClientsNumber = _acceptedClientsNumber;
   
-  static const unsigned int SleepTimeInUSec = 5000;
-  static const unsigned int MaxTotalSleepTimeInUs = 500000U;
-  static const unsigned int MaxAttempts = MaxTotalSleepTimeInUs / SleepTimeInUSec;
-  
-  auto isUnused = [](const QueueItem& queueItem) -> bool {
-    return 0 == queueItem.UsageCounter; 
-  };
+  if (_rtpSender) {
+    const RtpSender::Stats rtpStats = _rtpSender->GetStats();
+    stats.RtpFramesNumber = rtpStats.SentFramesNumber;
+    stats.RtpDroppedFramesNumber = rtpStats.DroppedFramesNumber;
+  }
   
-  for (unsigned int attempt = 0; attempt < MaxAttempts && !_incomeQueue.empty(); ++attempt) {
-    // Remove all unused VideoBuffers from _incomeQueue.
-    _incomeQueue.remove_if(isUnused);
-    
-    // Send already being transmitted VideoBuffer-s
-    SendData(SleepTimeInUSec);
+  for (auto& shard : _shards) {
+    const ClientShard::Stats shardStats = shard->GetStats();
+    stats.SkippedFramesNumber += shardStats.SkippedFramesNumber;
+    stats.DowngradedClientsNumber += shardStats.DowngradedClientsNumber;
+    stats.DisconnectedClientsNumber += shardStats.DisconnectedClientsNumber;
+    stats.MaxFramesBehind = std::max(stats.MaxFramesBehind, shardStats.MaxFramesBehind);
+    stats.RequestsNumber += shardStats.RequestsNumber;
+    stats.IdleClosedClientsNumber += shardStats.IdleClosedClientsNumber;
   }
   
-  if (!_incomeQueue.empty()) {
-    std::list<int> brokenClientFds;
-    for (auto client : _beingServedClients) {
-      ResponseInfo& responseInfo = client.second;
-      if (responseInfo.VideoBufferIdx != ResponseInfo::InvalidBufferIdx) {
-        HttpServer::QueueItem* queueItem = GetBuffer(responseInfo.VideoBufferIdx);
-          
-        if (queueItem != nullptr) {
-           responseInfo.VideoBufferIdx = ResponseInfo::InvalidBufferIdx;
-           queueItem->UsageCounter -= 1;
-        }
-        
-        brokenClientFds.push_back(client.first);
-      }
-    }  
-    
-    for (auto clientFd : brokenClientFds) {
-      _beingServedClients.erase(clientFd);
-    
-      if (-1 == ::close(clientFd)) {
-        Tracer::LogErrNo("close().");
-      }
-      
-      Tracer::Log("Closed slow client.");
-    }  
+  return stats;
+}
+
+std::string HttpServer::GetStatsText()
+{
+  const Stats stats = GetStats();
+  
+  static const char statsTemplate[] = 
+    "clients: %u\n" \
+    "copy_pool_size: %u\n" \
+    "copy_pool_buffers_used: %u\n" \
+    "copied_frames: %llu\n" \
+    "copy_pool_exhaustions: %llu\n" \
+    "skipped_frames: %llu\n" \
+    "downgraded_clients: %llu\n" \
+    "disconnected_clients: %llu\n" \
+    "max_frames_behind: %llu\n" \
+    "accepted_clients: %llu\n" \
+    "requests: %llu\n" \
+    "idle_closed_clients: %llu\n" \
+    "rtp_frames: %llu\n" \
+    "rtp_dropped_frames: %llu\n";
+  
+  char statsText[sizeof(statsTemplate) + 256];
+  int result = std::snprintf(statsText, sizeof(statsText), statsTemplate,
+                             static_cast<uint32_t>(stats.ClientsNumber),
+                             stats.CopyPoolSize,
+                             stats.CopyPoolBuffersUsed,
+                             static_cast<unsigned long long>(stats.CopiedFramesNumber),
+                             static_cast<unsigned long long>(stats.CopyPoolExhaustionsNumber),
+                             static_cast<unsigned long long>(stats.SkippedFramesNumber),
+                             static_cast<unsigned long long>(stats.DowngradedClientsNumber),
+                             static_cast<unsigned long long>(stats.DisconnectedClientsNumber),
+                             static_cast<unsigned long long>(stats.MaxFramesBehind),
+                             static_cast<unsigned long long>(stats.AcceptedClientsNumber),
+                             static_cast<unsigned long long>(stats.RequestsNumber),
+                             static_cast<unsigned long long>(stats.IdleClosedClientsNumber),
+                             static_cast<unsigned long long>(stats.RtpFramesNumber),
+                             static_cast<unsigned long long>(stats.RtpDroppedFramesNumber));
+  if (result <= 0 || static_cast<size_t>(result) >= sizeof(statsText)) {
+    return std::string();
   }
   
-  _incomeQueue.remove_if(isUnused);
+  std::string text(statsText, result);
+  if (_config.GetSourceStatsText) {
+    text += _config.GetSourceStatsText();
+  }
   
-  return result;
+  return text;
 }
 
 void HttpServer::Shutdown()
 {
-  DequeueAllBuffers();
+  // Closed clients release all frames so the queue can be emptied at once.
+  for (auto& shard : _shards) {
+    shard->Shutdown();
+  }
   
-  for (auto client : _beingServedClients) {
-    if (-1 == ::close(client.first)) {
-      Tracer::LogErrNo("close().");
-    }
-  }  
-  _beingServedClients.clear();
+  _shards.clear();
   
-  for (auto client : _waitingClients) {
-    if (-1 == ::close(client.first)) {
-      Tracer::LogErrNo("close().");
-    }
-  }  
+  std::vector<const VideoBuffer*> buffers;
+  for (auto& frameQueue : _frameQueues) {
+    frameQueue->ReturnAllBuffers(buffers);
+  }
+  
+  _rtpSender.reset();
   
   for (auto fd : _listeningFds) {
+    _eventLoop.Remove(fd);
+    
     if (-1 == ::close(fd)) {
       Tracer::LogErrNo("close().");
     }
@@ -618,6 +403,46 @@ void HttpServer::Shutdown()
   _listeningFds.clear();
 }
 
+void HttpServer::OnEvent(int fd, uint32_t events)
+{
+  // The socket is edge triggered so accept all pending connections.
+  while (true) {
+    sockaddr_storage sockAddr = {0};
+    socklen_t sockAddrSize = sizeof(sockAddr);
+    
+    int clientFd = ::accept4(fd, reinterpret_cast<sockaddr*>(&sockAddr), &sockAddrSize, SOCK_NONBLOCK);
+    if (-1 == clientFd) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        Tracer::LogErrNo("accept().");
+      }
+      
+      if (errno != EINTR) {
+        break;
+      }
+      
+      continue;
+    }
+    
+    _acceptedClientsNumber += 1;
+    
+    if (GetClientsNumber() >= _config.MaxClientsNumber) {
+      Tracer::Log("Client dropped because of MaxClientsNumber.\n");
+      ::close(clientFd);
+      continue;
+    }
+    
+    // Pass the client to the least loaded shard.
+    ClientShard* selectedShard = _shards[0].get();
+    for (auto& shard : _shards) {
+      if (shard->GetClientsNumber() < selectedShard->GetClientsNumber()) {
+        selectedShard = shard.get();
+      }
+    }
+    
+    selectedShard->AddClient(clientFd);
+  }
+}
+
 namespace {
 
   bool SetupListeningSocket(int socketFd, const addrinfo* addrInfo, int maxPendingConnections)
@@ -650,7 +475,7 @@ namespace {
 
   int CreateListeningSocket(const addrinfo* addrInfo)
   {
-    static const int MaxPendingConnections = 4;
+    static const int MaxPendingConnections = 64;
 
     int socketFd = ::socket(addrInfo->ai_family, addrInfo->ai_socktype, 0);
     if (-1 == socketFd) {
@@ -666,4 +491,20 @@ namespace {
     
     return socketFd;
   }
+  
+  bool IsZeroCopySupported()
+  {
+    int socketFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (-1 == socketFd) {
+      Tracer::LogErrNo("Failed to create a socket.");
+      return false;
+    }
+    
+    int zeroCopyValue = 1;
+    bool result = (0 == ::setsockopt(socketFd, SOL_SOCKET, SO_ZEROCOPY, &zeroCopyValue, sizeof(zeroCopyValue)));
+    
+    ::close(socketFd);
+    
+    return result;
+  }
 }
@@ -22,99 +22,178 @@
 #ifndef HTTPSERVER_H
 #define HTTPSERVER_H
 
-#include <map>
-#include <list>
+#include <functional>
+#include <memory>
+#include <atomic>
 #include <vector>
+#include <string>
 
 #include "Buffer.h"
+#include "EventLoop.h"
+#include "FrameQueue.h"
+#include "ClientShard.h"
+#include "RtpSender.h"
 
 /*
  * @brief HttpServer implements minimal HTTP server for sending MJPEG frames.
+ *        It accepts connections and distributes clients between shards.
+ *        Every shard serves its clients in a dedicated thread
+ *        if more than one thread is configured.
+ *        Frames can be also sent as RTP/JPEG (e.g. to a multicast group).
+ *        Several cameras are served by one server: every camera has its own
+ *        frame queue and "/cam/<name>/" routes.
  * 
  * */
-class HttpServer
+class HttpServer : private EventLoop::Handler
 {
 public:
-  HttpServer();
+  
+  struct Config {
+    std::string ServicePort;
+    uint32_t MaxClientsNumber;
+    
+    // Send mmapped frames with MSG_ZEROCOPY if the kernel supports it.
+    bool ZeroCopy;
+    
+    // Number of threads which send data to clients. 
+    // 1 means that all clients are served in the caller's thread.
+    uint32_t ThreadsNumber;
+    
+    // Frames which are sent longer than CopyDelayMs are copied to one of
+    // CopyPoolSize buffers so slow clients do not hold video buffers.
+    uint32_t CopyPoolSize;
+    uint32_t CopyDelayMs;
+    
+    // Watermarks of slow clients (see ClientShard::Config). Zero disables a watermark.
+    uint32_t SkipLagBytes;
+    uint32_t DowngradeLagMs;
+    uint32_t DisconnectLagMs;
+    
+    // Sending rate limit of every client in KiB/s (0 - no limit).
+    uint32_t RateLimitKBps;
+    
+    // Stream clients get the freshest frame when the previous one left the socket (see ClientShard::Config).
+    bool LatencyMode;
+    
+    // RTP/JPEG destination "address:port" (empty - RTP is disabled) and TTL of multicast packets.
+    std::string RtpDestination;
+    uint32_t RtpTtl;
+    
+    // Connections without a complete request during IdleTimeoutMs are closed (see ClientShard::Config).
+    uint32_t IdleTimeoutMs;
+    
+    // Names of cameras in "/cam/<name>/" routes (routes without the prefix serve 
+    // the first camera). Frames of a camera are queued with its index.
+    // Empty means a single camera. RTP is sent for the first camera.
+    std::vector<std::string> CameraNames;
+    
+    // Returns additional "/stats" lines (e.g. counters of frame sources). It is called by shard threads.
+    std::function<std::string()> GetSourceStatsText;
+  };
+  
+  struct Stats {
+    std::size_t ClientsNumber;
+    uint32_t CopyPoolSize;
+    uint32_t CopyPoolBuffersUsed;
+    uint64_t CopiedFramesNumber;
+    uint64_t CopyPoolExhaustionsNumber;
+    uint64_t SkippedFramesNumber;
+    uint64_t DowngradedClientsNumber;
+    uint64_t DisconnectedClientsNumber;
+    uint64_t MaxFramesBehind;
+    uint64_t AcceptedClientsNumber;
+    uint64_t RequestsNumber;
+    uint64_t IdleClosedClientsNumber;
+    uint64_t RtpFramesNumber;
+    uint64_t RtpDroppedFramesNumber;
+  };
+  
+  explicit HttpServer(EventLoop& eventLoop);
   ~HttpServer();
 
-  bool Init(const char* servicePort);
+  bool Init(const Config& config);
   
   /*
-   * @brief Adds a buffer to a queue "to be sent". 
+   * @brief Adds a buffer to a queue "to be sent" of a camera. 
    *        Returns true if buffer was successfully queued.
    */
-  bool QueueBuffer(const VideoBuffer* videoBuffer);
+  bool QueueBuffer(const VideoBuffer* videoBuffer, uint32_t cameraIdx = 0);
   
   /*
-   * @brief Dequeues a buffer.
+   * @brief Dequeues a buffer of a camera.
    *        Finds a buffer which has already been sent to all clients and
    *        returns it otherwise returns nullptr. 
    */
-  const VideoBuffer* DequeueBuffer();
+  const VideoBuffer* DequeueBuffer(uint32_t cameraIdx = 0);
   
   /*
-   * @brief Dequeues all buffers. 
-   *        If a client connection is slow then it is dropped.
+   * @brief Appends to buffers all buffers which can be dequeued right now and
+   *        returns true if there are no more queued buffers. It does not block 
+   *        so it should be repeated while the event loop is running.
+   *        Frames which are still being sent are copied. If it is not possible then
+   *        clients are given MaxDrainTimeMs to finish and the rest are dropped.
    */
-  std::vector<const VideoBuffer*> DequeueAllBuffers();
+  bool DequeueAllBuffers(std::vector<const VideoBuffer*>& buffers, uint32_t cameraIdx = 0);
   
   /*
-   * @brief Accepts a new requests, sends images to active peers. 
+   * @brief Same as DequeueAllBuffers() but clients are never closed. Frames are not sent 
+   *        till everything is dequeued so the caller should give up by 
+   *        CancelDequeueAllBuffers() if clients hold frames for too long.
    */
-  void ServeRequests(long maxServeTimeMicroSec);
+  bool TryDequeueAllBuffers(std::vector<const VideoBuffer*>& buffers, uint32_t cameraIdx = 0);
+  
+  void CancelDequeueAllBuffers(uint32_t cameraIdx = 0);
+  
+  // @brief Returns the number of cameras (frame queues).
+  std::size_t GetCamerasNumber() const { return _frameQueues.size(); }
+  
+  // @brief Returns true if a camera has clients which wait for its frames.
+  //        The event loop is woken up when a camera gets its first client.
+  bool IsCameraWatched(uint32_t cameraIdx) const;
   
   /*
-   * @brief Returns true if there are data for client (headers or MJPEG data). 
+   * @brief Sends newly queued images to idle peers.
+   *        New connections, requests and writable peers are handled by
+   *        the event loop.
    */
-  bool HasDataToSend() const;
+  void ServeRequests();
 
   /*
    * @brief Shutdowns all connections and frees all resources. 
    */
   void Shutdown();
   
-  std::size_t GetClientsNumber() const { return _beingServedClients.size() + _waitingClients.size(); }
+  std::size_t GetClientsNumber() const;
   
+  // @brief Returns current counters. Thread safe.
+  Stats GetStats();
+  
+  HttpServer() = delete;
   HttpServer(const HttpServer& other) = delete;
   HttpServer& operator=(const HttpServer& other) = delete;
   
 private:
   
-  struct RequestInfo 
-  {
-    std::vector<uint8_t> RequestData;
-  };
-
-  struct ResponseInfo
-  {
-    uint32_t HeaderBytesSent = 0U;
-    
-    static const uint32_t InvalidBufferIdx = 0xFFFFFFFF;
-    
-    uint32_t DataBufferIdx = InvalidBufferIdx;
-    uint32_t DataBufferBytesSent = 0U;
-    timeval Timestamp = {0};
-    uint32_t VideoBufferIdx = InvalidBufferIdx;
-  }; 
-  
-  struct QueueItem {
-    std::vector<uint8_t> Header;
-    std::vector<Buffer> Data;
-    const VideoBuffer* SourceData;
-    uint32_t UsageCounter;
-    uint32_t SentCounter;
-  };
+  // @brief Accepts new connections.
+  void OnEvent(int fd, uint32_t events) override;
+  
+  // @brief Returns stats in "name: value" lines.
+  std::string GetStatsText();
+  
+  EventLoop& _eventLoop;
+  Config _config;
+  bool _isZeroCopySupported;
+  
+  // Drain start time of every camera.
+  std::vector<uint64_t> _drainStartMs;
   
-  void ReadAndParseRequests();
-  void SendData(long timeoutMicroSec);
-  QueueItem* SelectBufferForSending(const timeval& lastBufferTimestamp);
-  QueueItem* GetBuffer(uint32_t videoBufferIdx);
+  // Kept alive connections serve several requests so it grows slower than RequestsNumber.
+  std::atomic<uint64_t> _acceptedClientsNumber;
   
-  std::map<int, RequestInfo> _waitingClients;
   std::vector<int> _listeningFds;
-  std::map<int, ResponseInfo> _beingServedClients;
-  std::list<QueueItem> _incomeQueue;  
+  std::vector<std::unique_ptr<FrameQueue>> _frameQueues;
+  std::vector<std::unique_ptr<ClientShard>> _shards;
+  std::unique_ptr<RtpSender> _rtpSender;
 };
 
 #endif // HTTPSERVER_H
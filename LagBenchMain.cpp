@@ -0,0 +1,373 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Clock.h"
+#include "EventLoop.h"
+#include "FrameQueue.h"
+#include "ClientShard.h"
+
+namespace {
+  
+  const uint32_t DefaultDurationSec = 10U;
+  const uint32_t DefaultReadRateKBps = 400U;
+  const uint32_t DefaultFrameSizeKb = 100U;
+  const uint32_t DefaultFps = 30U;
+  const uint32_t VideoBuffersNumber = 8U;
+  const size_t EdgeFramesNumber = 10U;
+  
+  // The reader takes small pieces with pauses between them like a slow link. Its receive 
+  // buffer is small so the backlog stays on the sending side where the server can see it.
+  const size_t ReadPieceSize = 4 * 1024;
+  const int ReceiveBufferSize = 32 * 1024;
+  
+  const char StreamRequest[] = "GET /stream HTTP/1.1\r\n\r\n";
+  
+  /*
+   * @brief ThrottledReader receives an MJPEG stream over loopback at a limited rate
+   *        and records the lag of every frame: the time from the frame timestamp
+   *        (X-Timestamp) till its last byte is read.
+   * 
+   * */
+  class ThrottledReader
+  {
+  public:
+    
+    explicit ThrottledReader(uint32_t readRateBytes)
+      : _readRateBytes(readRateBytes)
+      , _fd(-1)
+      , _shouldStop(false) {
+    }
+    
+    ~ThrottledReader() {
+      Stop();
+    }
+    
+    // @brief Connects to the server and sends the stream request.
+    bool Connect(const sockaddr_in& serverAddr) {
+      _fd = ::socket(AF_INET, SOCK_STREAM, 0);
+      if (-1 == _fd) {
+        std::perror("socket()");
+        return false;
+      }
+      
+      // The receive timeout lets the thread check the stop flag.
+      const timeval receiveTimeout = {0, 100000};
+      if (::setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &ReceiveBufferSize, sizeof(ReceiveBufferSize)) != 0 ||
+          ::setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout)) != 0) {
+        std::perror("setsockopt()");
+        return false;
+      }
+      
+      if (-1 == ::connect(_fd, reinterpret_cast<const sockaddr*>(&serverAddr), sizeof(serverAddr))) {
+        std::perror("connect()");
+        return false;
+      }
+      
+      if (-1 == ::write(_fd, StreamRequest, sizeof(StreamRequest) - 1)) {
+        std::perror("write()");
+        return false;
+      }
+      
+      return true;
+    }
+    
+    void Start() {
+      _thread = std::thread(&ThrottledReader::ThreadFunc, this);
+    }
+    
+    void Stop() {
+      if (_thread.joinable()) {
+        _shouldStop = true;
+        _thread.join();
+      }
+      
+      if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+      }
+    }
+    
+    // @brief Returns lags of received frames in microseconds (in order of receiving).
+    const std::vector<uint64_t>& GetLags() const { return _lagsUs; }
+    
+  private:
+    
+    void ThreadFunc() {
+      std::vector<char> readBuffer(ReadPieceSize);
+      const uint64_t startUs = Clock::GetMonotonicTimeUs();
+      uint64_t totalBytes = 0;
+      
+      while (!_shouldStop) {
+        const ssize_t readBytes = ::read(_fd, readBuffer.data(), readBuffer.size());
+        if (0 == readBytes) {
+          break;
+        }
+        
+        if (readBytes < 0) {
+          continue;
+        }
+        
+        _stream.append(readBuffer.data(), static_cast<size_t>(readBytes));
+        ParseFrames();
+        
+        // The next piece is read when the rate allows it.
+        totalBytes += static_cast<uint64_t>(readBytes);
+        const uint64_t nextReadUs = startUs + totalBytes * 1000000U / _readRateBytes;
+        const uint64_t nowUs = Clock::GetMonotonicTimeUs();
+        if (nextReadUs > nowUs) {
+          ::usleep(static_cast<useconds_t>(nextReadUs - nowUs));
+        }
+      }
+    }
+    
+    // @brief Records lags of frames which are received completely and removes them from the stream.
+    void ParseFrames() {
+      static const char ContentLength[] = "Content-Length: ";
+      static const char Timestamp[] = "X-Timestamp: ";
+      static const char HeaderEnd[] = "\r\n\r\n";
+      
+      while (true) {
+        const size_t lengthPos = _stream.find(ContentLength);
+        const size_t timestampPos = (lengthPos != std::string::npos) ? _stream.find(Timestamp, lengthPos) : std::string::npos;
+        const size_t headerEndPos = (timestampPos != std::string::npos) ? _stream.find(HeaderEnd, timestampPos) : std::string::npos;
+        if (std::string::npos == headerEndPos) {
+          return;
+        }
+        
+        const size_t frameSize = std::strtoul(_stream.c_str() + lengthPos + sizeof(ContentLength) - 1, nullptr, 10);
+        const size_t frameEndPos = headerEndPos + sizeof(HeaderEnd) - 1 + frameSize;
+        if (_stream.size() < frameEndPos) {
+          return;
+        }
+        
+        char* fraction = nullptr;
+        const uint64_t seconds = std::strtoull(_stream.c_str() + timestampPos + sizeof(Timestamp) - 1, &fraction, 10);
+        const uint64_t microseconds = ('.' == *fraction) ? std::strtoull(fraction + 1, nullptr, 10) : 0;
+        const uint64_t timestampUs = seconds * 1000000U + microseconds;
+        
+        _lagsUs.push_back(Clock::GetMonotonicTimeUs() - timestampUs);
+        _stream.erase(0, frameEndPos);
+      }
+    }
+    
+    const uint32_t _readRateBytes;
+    int _fd;
+    std::atomic<bool> _shouldStop;
+    std::thread _thread;
+    
+    std::string _stream;
+    std::vector<uint64_t> _lagsUs;
+  };
+  
+  struct RunResult {
+    uint32_t QueuedFramesNumber;
+    std::vector<uint64_t> LagsUs;
+  };
+  
+  // @brief Serves synthetic frames at a given rate to a throttled reader over TCP loopback
+  //        from a single ClientShard.
+  bool RunStream(bool isLatencyMode, uint32_t durationSec, uint32_t readRateBytes, uint32_t frameSize, uint32_t fps, RunResult& result) {
+    // A frame is a JPEG image with SOF0 marker (a Huffman table is inserted before it).
+    std::vector<uint8_t> frame(frameSize, 0);
+    frame[0] = 0xFF;
+    frame[1] = 0xD8;
+    frame[2] = 0xFF;
+    frame[3] = 0xC0;
+    frame[frameSize - 2] = 0xFF;
+    frame[frameSize - 1] = 0xD9;
+    
+    std::vector<VideoBuffer> videoBuffers(VideoBuffersNumber);
+    std::vector<const VideoBuffer*> freeVideoBuffers;
+    for (uint32_t idx = 0; idx < VideoBuffersNumber; ++idx) {
+      std::memset(&videoBuffers[idx], 0, sizeof(VideoBuffer));
+      videoBuffers[idx].Data = frame.data();
+      videoBuffers[idx].Size = frameSize;
+      videoBuffers[idx].Length = frameSize;
+      videoBuffers[idx].Idx = idx;
+      freeVideoBuffers.push_back(&videoBuffers[idx]);
+    }
+    
+    FrameQueue queue;
+    queue.Init(0, 0);
+    
+    EventLoop eventLoop;
+    ClientShard shard(std::vector<ClientShard::Camera>(1, ClientShard::Camera {std::string(), &queue}));
+    
+    ClientShard::Config config;
+    config.IsZeroCopy = false;
+    config.SkipLagBytes = 0;
+    config.DowngradeLagMs = 0;
+    config.DisconnectLagMs = 0;
+    config.RateLimitBytes = 0;
+    config.IsLatencyMode = isLatencyMode;
+    config.IdleTimeoutMs = 0;
+    
+    if (!eventLoop.Init() || !shard.Init(&eventLoop, config)) {
+      std::printf("Failed to initialize the shard.\n");
+      return false;
+    }
+    
+    const int listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in serverAddr = {0};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t serverAddrSize = sizeof(serverAddr);
+    
+    if (-1 == listenFd ||
+        -1 == ::bind(listenFd, reinterpret_cast<const sockaddr*>(&serverAddr), sizeof(serverAddr)) ||
+        -1 == ::listen(listenFd, 1) ||
+        -1 == ::getsockname(listenFd, reinterpret_cast<sockaddr*>(&serverAddr), &serverAddrSize)) {
+      std::perror("Failed to listen");
+      return false;
+    }
+    
+    ThrottledReader reader(readRateBytes);
+    const bool isConnected = reader.Connect(serverAddr);
+    const int clientFd = isConnected ? ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK) : -1;
+    ::close(listenFd);
+    
+    if (-1 == clientFd) {
+      std::perror("Failed to connect");
+      return false;
+    }
+    
+    shard.AddClient(clientFd);
+    reader.Start();
+    
+    const uint64_t framePeriodUs = 1000000U / fps;
+    const uint64_t endUs = Clock::GetMonotonicTimeUs() + durationSec * 1000000ULL;
+    uint64_t nextFrameUs = 0;
+    uint32_t sequence = 0;
+    
+    while (true) {
+      const uint64_t nowUs = Clock::GetMonotonicTimeUs();
+      if (nowUs >= endUs) {
+        break;
+      }
+      
+      if (nowUs >= nextFrameUs) {
+        nextFrameUs = nowUs + framePeriodUs;
+        
+        while (const VideoBuffer* videoBuffer = queue.DequeueBuffer()) {
+          freeVideoBuffers.push_back(videoBuffer);
+        }
+        
+        // The frame is dropped like by a driver if the client holds all buffers.
+        if (!freeVideoBuffers.empty()) {
+          VideoBuffer* videoBuffer = const_cast<VideoBuffer*>(freeVideoBuffers.back());
+          freeVideoBuffers.pop_back();
+          
+          videoBuffer->V4l2Buffer.sequence = ++sequence;
+          videoBuffer->V4l2Buffer.timestamp.tv_sec = static_cast<time_t>(nowUs / 1000000U);
+          videoBuffer->V4l2Buffer.timestamp.tv_usec = static_cast<suseconds_t>(nowUs % 1000000U);
+          
+          if (queue.QueueBuffer(videoBuffer)) {
+            result.QueuedFramesNumber += 1;
+            shard.NotifyNewBuffer(0);
+          }
+          else {
+            freeVideoBuffers.push_back(videoBuffer);
+          }
+        }
+      }
+      
+      const uint64_t waitUs = nextFrameUs - Clock::GetMonotonicTimeUs();
+      eventLoop.Wait(static_cast<int>(std::max<uint64_t>(1, waitUs / 1000)));
+      shard.ServeRequests();
+    }
+    
+    reader.Stop();
+    result.LagsUs = reader.GetLags();
+    
+    shard.Shutdown();
+    eventLoop.Shutdown();
+    
+    return true;
+  }
+  
+  // @brief Returns the given percentile of lags in milliseconds.
+  double GetPercentileMs(std::vector<uint64_t> lagsUs, uint32_t percentile) {
+    if (lagsUs.empty()) {
+      return 0.0;
+    }
+    
+    const size_t idx = std::min(lagsUs.size() - 1, lagsUs.size() * percentile / 100);
+    std::nth_element(lagsUs.begin(), lagsUs.begin() + idx, lagsUs.end());
+    
+    return lagsUs[idx] / 1000.0;
+  }
+  
+  void PrintResult(const char* name, const RunResult& result) {
+    // Lags of the first and the last frames show whether the lag keeps growing.
+    const std::vector<uint64_t>& lagsUs = result.LagsUs;
+    const size_t edgeFramesNumber = std::min<size_t>(lagsUs.size(), EdgeFramesNumber);
+    const std::vector<uint64_t> firstLagsUs(lagsUs.begin(), lagsUs.begin() + edgeFramesNumber);
+    const std::vector<uint64_t> lastLagsUs(lagsUs.end() - edgeFramesNumber, lagsUs.end());
+    
+    std::printf("%s: %u of %u frames received, lag median %.0f ms, p90 %.0f ms, max %.0f ms, "
+                "median of first frames %.0f ms, of last frames %.0f ms\n",
+                name, static_cast<uint32_t>(lagsUs.size()), result.QueuedFramesNumber,
+                GetPercentileMs(lagsUs, 50), GetPercentileMs(lagsUs, 90), GetPercentileMs(lagsUs, 100),
+                GetPercentileMs(firstLagsUs, 50), GetPercentileMs(lastLagsUs, 50));
+  }
+}
+
+// Usage: uvc2http_lagbench [SECONDS [READ_KBPS [FRAME_KB [FPS]]]]
+int main(int argc, char **argv) {
+  
+  const uint32_t durationSec = (argc > 1) ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : DefaultDurationSec;
+  const uint32_t readRateKBps = (argc > 2) ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : DefaultReadRateKBps;
+  const uint32_t frameSizeKb = (argc > 3) ? static_cast<uint32_t>(std::strtoul(argv[3], nullptr, 10)) : DefaultFrameSizeKb;
+  const uint32_t fps = (argc > 4) ? static_cast<uint32_t>(std::strtoul(argv[4], nullptr, 10)) : DefaultFps;
+  
+  if (0 == durationSec || 0 == readRateKBps || 0 == frameSizeKb || frameSizeKb > 16 * 1024 || 0 == fps || fps > 1000) {
+    std::printf("Usage: uvc2http_lagbench [SECONDS [READ_KBPS [FRAME_KB [FPS]]]]\n");
+    return -1;
+  }
+  
+  std::printf("duration: %u s, read rate: %u KB/s, frame size: %u KB, fps: %u\n", durationSec, readRateKBps, frameSizeKb, fps);
+  
+  // The same stream is served without and with TCP_NOTSENT_LOWAT.
+  RunResult defaultResult = {0};
+  RunResult latencyResult = {0};
+  if (!RunStream(false, durationSec, readRateKBps * 1000, frameSizeKb * 1024, fps, defaultResult) ||
+      !RunStream(true, durationSec, readRateKBps * 1000, frameSizeKb * 1024, fps, latencyResult)) {
+    return -1;
+  }
+  
+  PrintResult("default", defaultResult);
+  PrintResult("latency mode", latencyResult);
+  
+  return 0;
+}
@@ -92,6 +92,51 @@ std::unique_ptr<MjpegFrame> CreateMjpegFrame(const VideoBuffer* videoBuffer)
 
 std::vector<Buffer> CreateMjpegFrameBufferSet(const VideoBuffer* videoBuffer)
 {
+  std::vector<Buffer> result;
+  result.reserve(3);
+  
+  if (!AppendMjpegFrameBufferSet(videoBuffer, result)) {
+    return std::vector<Buffer>();
+  }
+  
+  return result;
+}
+
+namespace {
+  // @brief Returns true if a frame has DHT marker (e.g. it is relayed from another uvc2http).
+  bool HasHaffmanTable(const VideoBuffer* videoBuffer) {
+    const uint8_t* data = videoBuffer->Data;
+    const uint32_t size = videoBuffer->Size;
+    
+    // Tables precede the scan so only marker segments before SOS are checked.
+    uint32_t offset = 2;
+    while (offset + 4 <= size && 0xFF == data[offset]) {
+      const uint8_t marker = data[offset + 1];
+      if (0xC4 == marker) {
+        return true;
+      }
+      
+      if (0xDA == marker) {
+        break;
+      }
+      
+      offset += 2 + ((static_cast<uint32_t>(data[offset + 2]) << 8) | data[offset + 3]);
+    }
+    
+    return false;
+  }
+}
+
+bool AppendMjpegFrameBufferSet(const VideoBuffer* videoBuffer, std::vector<Buffer>& bufferSet)
+{
+  // UVC cameras omit Huffman tables so the standard one is inserted before SOF0
+  // unless the frame already has tables.
+  if (videoBuffer->Size >= 4 && HasHaffmanTable(videoBuffer)) {
+    bufferSet.push_back(Buffer {videoBuffer->Data, videoBuffer->Size});
+    return true;
+  }
+  
+
   const uint8_t baselineDctMarkerPart1 = 0xFF;
   const uint8_t baselineDctMarkerPart2 = 0xC0;
 
@@ -102,18 +147,180 @@ std::vector<Buffer> CreateMjpegFrameBufferSet(const VideoBuffer* videoBuffer)
   }
   
   if (currPtr >= videoBuffer->Data + videoBuffer->Size) {
-    return std::vector<Buffer>();
+    return false;
   }
   
   const uint32_t headerSize = currPtr - videoBuffer->Data;
   
-  std::vector<Buffer> result(3);
-  result[0].Data = videoBuffer->Data;
-  result[0].Size = headerSize;
-  result[1].Data = HaffmanTable;
-  result[1].Size = sizeof(HaffmanTable);
-  result[2].Data = currPtr;
-  result[2].Size = videoBuffer->Size - headerSize;
+  bufferSet.push_back(Buffer {videoBuffer->Data, headerSize});
+  bufferSet.push_back(Buffer {HaffmanTable, sizeof(HaffmanTable)});
+  bufferSet.push_back(Buffer {currPtr, videoBuffer->Size - headerSize});
+  
+  return true;
+}
+
+bool ParseJpegScan(const VideoBuffer* videoBuffer, JpegScanInfo& scanInfo)
+{
+  const uint8_t* data = videoBuffer->Data;
+  const uint32_t size = videoBuffer->Size;
+  
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    return false;
+  }
+  
+  // Tables are referenced by SOF0 components so they are resolved after parsing.
+  const uint8_t* quantTables[4] = {nullptr, nullptr, nullptr, nullptr};
+  uint8_t componentTables[3] = {0, 0, 0};
+  bool hasFrameHeader = false;
+  
+  scanInfo.RestartInterval = 0;
+  
+  uint32_t offset = 2;
+  while (offset + 4 <= size) {
+    if (data[offset] != 0xFF) {
+      return false;
+    }
+    
+    const uint8_t marker = data[offset + 1];
+    if (0xFF == marker) {
+      // Fill byte.
+      ++offset;
+      continue;
+    }
+    
+    const uint32_t segmentSize = (static_cast<uint32_t>(data[offset + 2]) << 8) | data[offset + 3];
+    const uint8_t* segment = data + offset + 4;
+    if (segmentSize < 2 || offset + 2 + segmentSize > size) {
+      return false;
+    }
+    
+    const uint32_t payloadSize = segmentSize - 2;
+    
+    if (0xDB == marker) {
+      // DQT: a segment can contain several tables.
+      uint32_t tableOffset = 0;
+      while (tableOffset + 65 <= payloadSize) {
+        const uint8_t precision = segment[tableOffset] >> 4;
+        const uint8_t tableId = segment[tableOffset] & 0x0F;
+        if (precision != 0 || tableId > 3) {
+          return false;
+        }
+        
+        quantTables[tableId] = segment + tableOffset + 1;
+        tableOffset += 65;
+      }
+    }
+    else if (0xC0 == marker) {
+      // SOF0: P, Y, X, Nf and Nf components (C, HV, Tq).
+      if (payloadSize < 15 || segment[0] != 8 || segment[5] != 3) {
+        return false;
+      }
+      
+      scanInfo.Height = (static_cast<uint32_t>(segment[1]) << 8) | segment[2];
+      scanInfo.Width = (static_cast<uint32_t>(segment[3]) << 8) | segment[4];
+      scanInfo.LumaSamplingH = segment[7] >> 4;
+      scanInfo.LumaSamplingV = segment[7] & 0x0F;
+      
+      for (uint32_t componentIdx = 0; componentIdx < 3; ++componentIdx) {
+        componentTables[componentIdx] = segment[6 + componentIdx * 3 + 2] & 0x03;
+      }
+      
+      if (segment[10] != 0x11 || segment[13] != 0x11 || componentTables[1] != componentTables[2]) {
+        return false;
+      }
+      
+      hasFrameHeader = true;
+    }
+    else if (0xC1 <= marker && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      // Progressive, lossless and arithmetic coded frames.
+      return false;
+    }
+    else if (0xDD == marker) {
+      if (payloadSize < 2) {
+        return false;
+      }
+      
+      scanInfo.RestartInterval = static_cast<uint16_t>((segment[0] << 8) | segment[1]);
+    }
+    else if (0xDA == marker) {
+      if (!hasFrameHeader) {
+        return false;
+      }
+      
+      scanInfo.QuantTables[0] = quantTables[componentTables[0]];
+      scanInfo.QuantTables[1] = quantTables[componentTables[1]];
+      if (nullptr == scanInfo.QuantTables[0] || nullptr == scanInfo.QuantTables[1]) {
+        return false;
+      }
+      
+      // Buffers can be padded after EOI.
+      const uint32_t scanStart = offset + 2 + segmentSize;
+      uint32_t scanEnd = size;
+      while (scanEnd >= scanStart + 2 && !(0xFF == data[scanEnd - 2] && 0xD9 == data[scanEnd - 1])) {
+        --scanEnd;
+      }
+      
+      if (scanEnd < scanStart + 3) {
+        return false;
+      }
+      
+      scanInfo.ScanData = data + scanStart;
+      scanInfo.ScanDataSize = scanEnd - 2 - scanStart;
+      
+      return true;
+    }
+    
+    offset += 2 + segmentSize;
+  }
+  
+  return false;
+}
+
+uint32_t GetJpegSize(const uint8_t* data, uint32_t size)
+{
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    return 0;
+  }
+  
+  uint32_t offset = 2;
+  while (offset + 2 <= size) {
+    if (data[offset] != 0xFF) {
+      return 0;
+    }
+    
+    const uint8_t marker = data[offset + 1];
+    
+    // Markers can be preceded by fill bytes.
+    if (0xFF == marker) {
+      offset += 1;
+      continue;
+    }
+    
+    if (0xD9 == marker) {
+      return offset + 2;
+    }
+    
+    // Markers without a segment.
+    if ((marker >= 0xD0 && marker <= 0xD7) || 0x01 == marker) {
+      offset += 2;
+      continue;
+    }
+    
+    if (offset + 4 > size) {
+      return 0;
+    }
+    
+    offset += 2 + ((static_cast<uint32_t>(data[offset + 2]) << 8) | data[offset + 3]);
+    
+    if (0xDA == marker) {
+      // Entropy coded data can contain only stuffed 0xFF bytes and restart markers.
+      while (offset + 1 < size && 
+             (data[offset] != 0xFF || 0x00 == data[offset + 1] || 
+              (data[offset + 1] >= 0xD0 && data[offset + 1] <= 0xD7))) {
+        offset += (0xFF == data[offset]) ? 2 : 1;
+      }
+    }
+  }
   
-  return std::move(result);
+  return 0;
 }
@@ -47,5 +47,36 @@ std::unique_ptr<MjpegFrame> CreateMjpegFrame(const VideoBuffer* videoBuffer);
 
 std::vector<Buffer> CreateMjpegFrameBufferSet(const VideoBuffer* videoBuffer);
 
+// @brief Appends MJPEG frame pieces to bufferSet. Does not allocate if bufferSet has enough capacity.
+bool AppendMjpegFrameBufferSet(const VideoBuffer* videoBuffer, std::vector<Buffer>& bufferSet);
+
+// Parameters of a baseline JPEG frame which are needed to transmit its scan 
+// without headers (e.g. RTP payload, RFC 2435). All pointers refer to the frame.
+struct JpegScanInfo {
+  uint32_t Width;
+  uint32_t Height;
+  
+  // Sampling factors of the luminance component (chrominance ones are 1x1).
+  uint8_t LumaSamplingH;
+  uint8_t LumaSamplingV;
+  
+  // 8-bit quantization tables (64 bytes in zigzag order) of luminance and chrominance.
+  const uint8_t* QuantTables[2];
+  
+  uint16_t RestartInterval;
+  
+  // Entropy coded data between SOS header and EOI.
+  const uint8_t* ScanData;
+  uint32_t ScanDataSize;
+};
+
+// @brief Parses JPEG markers of a frame. Returns false if it is not a 3 component 
+//        baseline JPEG with 8-bit quantization tables.
+bool ParseJpegScan(const VideoBuffer* videoBuffer, JpegScanInfo& scanInfo);
+
+// @brief Returns the size of a JPEG image which starts at data (SOI) including EOI
+//        or 0 if it is invalid or incomplete.
+uint32_t GetJpegSize(const uint8_t* data, uint32_t size);
+
 
 #endif // MJPEGUTILS_H
\ No newline at end of file
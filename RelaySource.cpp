@@ -0,0 +1,480 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "RelaySource.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include "Clock.h"
+#include "Tracer.h"
+
+namespace {
+  static const char UrlScheme[] = "http://";
+  static const char DefaultPort[] = "80";
+  
+  static const char RequestTemplate[] = 
+    "GET %s HTTP/1.1\r\n" \
+    "Host: %s:%s\r\n" \
+    "Connection: close\r\n" \
+    "\r\n";
+  
+  static const char HeaderEnd[] = "\r\n\r\n";
+  
+  // Headers are small so longer ones mean that it is not an uvc2http stream.
+  static const size_t MaxHeaderSize = 8 * 1024;
+  static const size_t ReadChunkSize = 4 * 1024;
+  
+  static const uint32_t MaxFrameSize = 16 * 1024 * 1024;
+  
+  // Connecting is blocking (like opening a camera) so it is limited.
+  static const int ConnectTimeoutMs = 2000;
+  
+  // @brief Splits "http://host[:port][/path]".
+  bool ParseUrl(const std::string& url, std::string& host, std::string& port, std::string& path) {
+    const size_t schemeSize = sizeof(UrlScheme) - 1;
+    if (url.compare(0, schemeSize, UrlScheme) != 0) {
+      return false;
+    }
+    
+    const size_t pathStart = url.find('/', schemeSize);
+    const std::string authority = url.substr(schemeSize, std::string::npos == pathStart ? std::string::npos : pathStart - schemeSize);
+    path = std::string::npos == pathStart ? std::string("/") : url.substr(pathStart);
+    
+    const size_t portStart = authority.rfind(':');
+    host = authority.substr(0, portStart);
+    port = std::string::npos == portStart ? std::string(DefaultPort) : authority.substr(portStart + 1);
+    
+    return !host.empty() && !port.empty() && port.find_first_not_of("0123456789") == std::string::npos;
+  }
+  
+  // @brief Finds a value of a header line "Name: value". Names are case insensitive.
+  bool FindHeaderValue(const std::string& header, const char* name, std::string& value) {
+    const size_t nameSize = std::strlen(name);
+    
+    size_t lineStart = 0;
+    while (lineStart < header.size()) {
+      size_t lineEnd = header.find("\r\n", lineStart);
+      if (std::string::npos == lineEnd) {
+        lineEnd = header.size();
+      }
+      
+      if (lineEnd - lineStart > nameSize && ':' == header[lineStart + nameSize] &&
+          0 == ::strncasecmp(header.c_str() + lineStart, name, nameSize)) {
+        const size_t valueStart = header.find_first_not_of(' ', lineStart + nameSize + 1);
+        value = (valueStart != std::string::npos && valueStart < lineEnd) ? 
+          header.substr(valueStart, lineEnd - valueStart) : std::string();
+        return true;
+      }
+      
+      lineStart = lineEnd + 2;
+    }
+    
+    return false;
+  }
+  
+  int ConnectToServer(const std::string& host, const std::string& port) {
+    addrinfo addrHints;
+    std::memset(&addrHints, 0, sizeof(addrHints));
+    addrHints.ai_family = AF_UNSPEC;
+    addrHints.ai_socktype = SOCK_STREAM;
+    
+    addrinfo* addrInfoHead = nullptr;
+    int result = 0;
+    if ((result = ::getaddrinfo(host.c_str(), port.c_str(), &addrHints, &addrInfoHead)) != 0) {
+      Tracer::Log("Failed to resolve upstream server '%s': %s.\n", host.c_str(), ::gai_strerror(result));
+      return -1;
+    }
+    
+    int socketFd = -1;
+    for (addrinfo* currAddrInfo = addrInfoHead; currAddrInfo != nullptr && -1 == socketFd; currAddrInfo = currAddrInfo->ai_next) {
+      socketFd = ::socket(currAddrInfo->ai_family, currAddrInfo->ai_socktype, currAddrInfo->ai_protocol);
+      if (-1 == socketFd) {
+        continue;
+      }
+      
+      // connect() is limited by SO_SNDTIMEO.
+      timeval timeout = {ConnectTimeoutMs / 1000, (ConnectTimeoutMs % 1000) * 1000};
+      ::setsockopt(socketFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      
+      if (::connect(socketFd, currAddrInfo->ai_addr, currAddrInfo->ai_addrlen) != 0) {
+        ::close(socketFd);
+        socketFd = -1;
+      }
+    }
+    
+    ::freeaddrinfo(addrInfoHead);
+    
+    return socketFd;
+  }
+}
+
+const uint32_t RelaySource::InvalidBufferIdx;
+
+RelaySource::RelaySource(const Config& config)
+  : _config(config),
+    _socketFd(-1),
+    _isBroken(false),
+    _state(ReadingResponseHeader),
+    _bufferIdx(InvalidBufferIdx),
+    _bodySize(0),
+    _bodyBytesRead(0),
+    _frameTimestamp {0, 0},
+    _frameSequence(0),
+    _timestampOffsetUs(0),
+    _lastTimestampUs(0)
+{
+}
+
+RelaySource::~RelaySource()
+{
+  Shutdown();
+}
+
+bool RelaySource::Init()
+{
+  if (_isBroken) {
+    return false;
+  }
+  
+  if (!ParseUrl(_config.Url, _host, _port, _path)) {
+    Tracer::Log("Invalid upstream URL '%s' (http://host[:port][/path] is expected).\n", _config.Url.c_str());
+    return false;
+  }
+  
+  if (_videoBuffers.empty()) {
+    _videoBuffers.resize(_config.BuffersNumber);
+    _bufferStorages.resize(_config.BuffersNumber);
+    _isBufferQueued.assign(_config.BuffersNumber, false);
+    
+    for (uint32_t idx = 0; idx < _config.BuffersNumber; ++idx) {
+      std::memset(&_videoBuffers[idx], 0, sizeof(VideoBuffer));
+      _videoBuffers[idx].Idx = idx;
+    }
+  }
+  
+  const int socketFd = ConnectToServer(_host, _port);
+  if (-1 == socketFd) {
+    Tracer::Log("Failed to connect to upstream server %s:%s.\n", _host.c_str(), _port.c_str());
+    return false;
+  }
+  
+  char request[sizeof(RequestTemplate) + 512];
+  int requestSize = std::snprintf(request, sizeof(request), RequestTemplate, _path.c_str(), _host.c_str(), _port.c_str());
+  if (requestSize <= 0 || static_cast<size_t>(requestSize) >= sizeof(request) ||
+      ::send(socketFd, request, requestSize, MSG_NOSIGNAL) != requestSize) {
+    Tracer::Log("Failed to send a request to upstream server.\n");
+    ::close(socketFd);
+    return false;
+  }
+  
+  // The socket is polled for readiness like a camera.
+  const int flags = ::fcntl(socketFd, F_GETFL, 0);
+  if (-1 == flags || -1 == ::fcntl(socketFd, F_SETFL, flags | O_NONBLOCK)) {
+    Tracer::LogErrNo("fcntl(O_NONBLOCK).");
+    ::close(socketFd);
+    return false;
+  }
+  
+  _socketFd = socketFd;
+  _state = ReadingResponseHeader;
+  _pendingData.clear();
+  
+  Tracer::Log("Connected to upstream server %s:%s.\n", _host.c_str(), _port.c_str());
+  
+  return true;
+}
+
+bool RelaySource::ReInit()
+{
+  Shutdown();
+  
+  return Init();
+}
+
+void RelaySource::Shutdown()
+{
+  if (_socketFd != -1) {
+    ::close(_socketFd);
+    _socketFd = -1;
+  }
+  
+  _pendingData.clear();
+  _bufferIdx = InvalidBufferIdx;
+  _isBroken = false;
+}
+
+const VideoBuffer* RelaySource::DequeuFrame()
+{
+  if (-1 == _socketFd || _isBroken) {
+    return nullptr;
+  }
+  
+  // The socket is edge triggered so data is read till EAGAIN or a complete frame.
+  while (true) {
+    if (ReadingPartBody == _state) {
+      if (_bodyBytesRead == _bodySize) {
+        const VideoBuffer* videoBuffer = CompleteFrame();
+        if (videoBuffer != nullptr) {
+          return videoBuffer;
+        }
+        
+        continue;
+      }
+      
+      const ssize_t readResult = ReadBody();
+      if (0 == readResult) {
+        return nullptr;
+      }
+      
+      if (readResult < 0) {
+        _isBroken = true;
+        return nullptr;
+      }
+      
+      continue;
+    }
+    
+    const size_t headerEnd = _pendingData.find(HeaderEnd);
+    if (std::string::npos == headerEnd) {
+      if (_pendingData.size() > MaxHeaderSize) {
+        Tracer::Log("Upstream stream has too long header.\n");
+        _isBroken = true;
+        return nullptr;
+      }
+      
+      char chunk[ReadChunkSize];
+      const ssize_t readResult = ::read(_socketFd, chunk, sizeof(chunk));
+      if (readResult > 0) {
+        _pendingData.append(chunk, static_cast<size_t>(readResult));
+      }
+      else if (-1 == readResult && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return nullptr;
+      }
+      else if (-1 == readResult && errno == EINTR) {
+        continue;
+      }
+      else {
+        Tracer::Log("Upstream stream is closed.\n");
+        _isBroken = true;
+        return nullptr;
+      }
+      
+      continue;
+    }
+    
+    const std::string header = _pendingData.substr(0, headerEnd + 2);
+    _pendingData.erase(0, headerEnd + sizeof(HeaderEnd) - 1);
+    
+    const bool isParsed = (ReadingResponseHeader == _state) ? ParseResponseHeader(header) : ParsePartHeader(header);
+    if (!isParsed) {
+      _isBroken = true;
+      return nullptr;
+    }
+  }
+}
+
+void RelaySource::RequeueFrame(const VideoBuffer* buffer)
+{
+  if (buffer != nullptr && buffer->Idx < _isBufferQueued.size()) {
+    _isBufferQueued[buffer->Idx] = false;
+  }
+}
+
+bool RelaySource::ParseResponseHeader(const std::string& header)
+{
+  if (header.compare(0, 9, "HTTP/1.0 ") != 0 && header.compare(0, 9, "HTTP/1.1 ") != 0) {
+    Tracer::Log("Upstream server did not send HTTP response.\n");
+    return false;
+  }
+  
+  if (header.compare(9, 3, "200") != 0) {
+    Tracer::Log("Upstream server responded with '%s'.\n", header.substr(9, header.find("\r\n") - 9).c_str());
+    return false;
+  }
+  
+  std::string contentType;
+  const size_t boundaryStart = FindHeaderValue(header, "Content-Type", contentType) ? 
+    contentType.find("boundary=") : std::string::npos;
+  if (contentType.compare(0, 10, "multipart/") != 0 || std::string::npos == boundaryStart) {
+    Tracer::Log("Upstream server did not send a multipart stream.\n");
+    return false;
+  }
+  
+  std::string boundary = contentType.substr(boundaryStart + 9);
+  boundary = boundary.substr(0, boundary.find(';'));
+  if (boundary.size() >= 2 && '"' == boundary[0] && '"' == boundary[boundary.size() - 1]) {
+    boundary = boundary.substr(1, boundary.size() - 2);
+  }
+  
+  _delimiter = "--" + boundary;
+  _state = ReadingPartHeader;
+  
+  return true;
+}
+
+bool RelaySource::ParsePartHeader(const std::string& header)
+{
+  // A part header starts with the delimiter which follows CRLF of the previous part.
+  const size_t delimiterStart = header.find_first_not_of("\r\n");
+  if (std::string::npos == delimiterStart || header.compare(delimiterStart, _delimiter.size(), _delimiter) != 0) {
+    Tracer::Log("Upstream stream has no multipart boundary.\n");
+    return false;
+  }
+  
+  if (header.compare(delimiterStart + _delimiter.size(), 2, "--") == 0) {
+    Tracer::Log("Upstream stream is finished.\n");
+    return false;
+  }
+  
+  std::string value;
+  if (!FindHeaderValue(header, "Content-Length", value)) {
+    Tracer::Log("Upstream stream has no Content-Length of a frame.\n");
+    return false;
+  }
+  
+  char* rest = nullptr;
+  const unsigned long contentLength = std::strtoul(value.c_str(), &rest, 10);
+  if (value.empty() || *rest != 0 || 0 == contentLength || contentLength > MaxFrameSize) {
+    Tracer::Log("Upstream stream has invalid Content-Length '%s'.\n", value.c_str());
+    return false;
+  }
+  
+  _bodySize = static_cast<uint32_t>(contentLength);
+  _bodyBytesRead = 0;
+  
+  // The capture time and the sequence number are forwarded if the upstream server sends them.
+  uint64_t timestampUs = Clock::GetMonotonicTimeMs() * 1000U;
+  if (FindHeaderValue(header, "X-Timestamp", value)) {
+    const unsigned long seconds = std::strtoul(value.c_str(), &rest, 10);
+    const unsigned long microseconds = ('.' == *rest) ? std::strtoul(rest + 1, nullptr, 10) : 0;
+    timestampUs = static_cast<uint64_t>(seconds) * 1000000U + microseconds;
+  }
+  
+  if (timestampUs + _timestampOffsetUs <= _lastTimestampUs) {
+    _timestampOffsetUs = _lastTimestampUs + 1 - timestampUs;
+  }
+  
+  _lastTimestampUs = timestampUs + _timestampOffsetUs;
+  _frameTimestamp.tv_sec = static_cast<time_t>(_lastTimestampUs / 1000000U);
+  _frameTimestamp.tv_usec = static_cast<suseconds_t>(_lastTimestampUs % 1000000U);
+  
+  _frameSequence = FindHeaderValue(header, "X-Sequence", value) ? 
+    static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10)) : _frameSequence + 1;
+  
+  _bufferIdx = FindFreeBuffer();
+  if (_bufferIdx != InvalidBufferIdx && _bufferStorages[_bufferIdx].size() < _bodySize) {
+    _bufferStorages[_bufferIdx].resize(_bodySize);
+  }
+  
+  _state = ReadingPartBody;
+  
+  return true;
+}
+
+ssize_t RelaySource::ReadBody()
+{
+  const uint32_t bytesLeft = _bodySize - _bodyBytesRead;
+  
+  uint8_t* target = nullptr;
+  size_t targetSize = bytesLeft;
+  if (_bufferIdx != InvalidBufferIdx) {
+    target = _bufferStorages[_bufferIdx].data() + _bodyBytesRead;
+  }
+  else {
+    _discardBuffer.resize(ReadChunkSize);
+    target = _discardBuffer.data();
+    targetSize = std::min(targetSize, _discardBuffer.size());
+  }
+  
+  // The beginning of the body can be received with the header.
+  if (!_pendingData.empty()) {
+    const size_t pendingSize = std::min(targetSize, _pendingData.size());
+    std::memcpy(target, _pendingData.data(), pendingSize);
+    _pendingData.erase(0, pendingSize);
+    _bodyBytesRead += static_cast<uint32_t>(pendingSize);
+    
+    return static_cast<ssize_t>(pendingSize);
+  }
+  
+  while (true) {
+    const ssize_t readResult = ::read(_socketFd, target, targetSize);
+    if (readResult > 0) {
+      _bodyBytesRead += static_cast<uint32_t>(readResult);
+      return readResult;
+    }
+    
+    if (-1 == readResult && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    
+    if (-1 == readResult && errno == EINTR) {
+      continue;
+    }
+    
+    Tracer::Log("Upstream stream is closed.\n");
+    return -1;
+  }
+}
+
+const VideoBuffer* RelaySource::CompleteFrame()
+{
+  _state = ReadingPartHeader;
+  
+  if (InvalidBufferIdx == _bufferIdx) {
+    return nullptr;
+  }
+  
+  VideoBuffer& videoBuffer = _videoBuffers[_bufferIdx];
+  videoBuffer.Data = _bufferStorages[_bufferIdx].data();
+  videoBuffer.Size = _bodySize;
+  videoBuffer.Length = static_cast<uint32_t>(_bufferStorages[_bufferIdx].size());
+  videoBuffer.V4l2Buffer.index = _bufferIdx;
+  videoBuffer.V4l2Buffer.bytesused = _bodySize;
+  videoBuffer.V4l2Buffer.timestamp = _frameTimestamp;
+  videoBuffer.V4l2Buffer.sequence = _frameSequence;
+  
+  _isBufferQueued[_bufferIdx] = true;
+  _bufferIdx = InvalidBufferIdx;
+  
+  return &videoBuffer;
+}
+
+uint32_t RelaySource::FindFreeBuffer() const
+{
+  for (uint32_t idx = 0; idx < _isBufferQueued.size(); ++idx) {
+    if (!_isBufferQueued[idx]) {
+      return idx;
+    }
+  }
+  
+  return InvalidBufferIdx;
+}
@@ -0,0 +1,137 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef RELAYSOURCE_H
+#define RELAYSOURCE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/time.h>
+
+#include "Buffer.h"
+#include "FrameSource.h"
+
+/*
+ * @brief RelaySource receives frames from an upstream uvc2http MJPEG stream
+ *        (multipart/x-mixed-replace with Content-Length part headers).
+ *        Frame bodies are read directly into its buffers which are queued 
+ *        to HttpServer as they are. The interface mirrors UvcGrabber so 
+ *        the upstream stream plays the camera role.
+ * 
+ * */
+class RelaySource : public FrameSource
+{
+public:
+  
+  struct Config {
+    // Upstream stream "http://host[:port][/path]".
+    std::string Url;
+    
+    uint32_t BuffersNumber;
+  };
+  
+  explicit RelaySource(const Config& config);
+  ~RelaySource();
+  
+  // @brief Connects to the upstream server. Returns true if the request is sent.
+  bool Init() override;
+  
+  // @brief Reconnects to the upstream server.
+  bool ReInit() override;
+  
+  // @brief Closes the connection. Buffers are kept so they should be requeued before.
+  void Shutdown() override;
+  
+  // @brief Returns true if the upstream stream is broken (closed, invalid data, etc.).
+  bool IsBroken() const override { return _isBroken; }
+  
+  // @brief Returns true if the connection is established.
+  bool IsReady() const override { return _socketFd != -1; }
+  
+  // @brief Returns the socket (it becomes readable when data is received) or -1.
+  int GetFd() const override { return _socketFd; }
+  
+  // @brief Reads available data and returns a received frame or nullptr.
+  const VideoBuffer* DequeuFrame() override;
+  
+  void RequeueFrame(const VideoBuffer* buffer) override;
+  
+  RelaySource() = delete;
+  RelaySource(const RelaySource& other) = delete;
+  RelaySource& operator=(const RelaySource& other) = delete;
+  
+private:
+  
+  enum State {
+    ReadingResponseHeader,
+    ReadingPartHeader,
+    ReadingPartBody
+  };
+  
+  static const uint32_t InvalidBufferIdx = 0xFFFFFFFF;
+  
+  // @brief Parses a header which is collected in _pendingData. Returns false if the stream is invalid.
+  bool ParseResponseHeader(const std::string& header);
+  bool ParsePartHeader(const std::string& header);
+  
+  // @brief Reads a part of the frame body. Returns the number of read bytes, 0 on EAGAIN, -1 on error.
+  ssize_t ReadBody();
+  
+  // @brief Completes the received frame. Returns nullptr if it is discarded.
+  const VideoBuffer* CompleteFrame();
+  
+  uint32_t FindFreeBuffer() const;
+  
+  Config _config;
+  std::string _host;
+  std::string _port;
+  std::string _path;
+  
+  int _socketFd;
+  bool _isBroken;
+  
+  State _state;
+  
+  // Received data which is not parsed yet (headers and the beginning of a body).
+  std::string _pendingData;
+  
+  // Delimiter line of parts ("--" and the boundary).
+  std::string _delimiter;
+  
+  std::vector<VideoBuffer> _videoBuffers;
+  std::vector<std::vector<uint8_t>> _bufferStorages;
+  std::vector<bool> _isBufferQueued;
+  
+  // A frame is discarded if there is no free buffer (all of them are sent to clients).
+  uint32_t _bufferIdx;
+  uint32_t _bodySize;
+  uint32_t _bodyBytesRead;
+  std::vector<uint8_t> _discardBuffer;
+  
+  // Timestamps of the upstream server are shifted to stay increasing after reconnects.
+  timeval _frameTimestamp;
+  uint32_t _frameSequence;
+  uint64_t _timestampOffsetUs;
+  uint64_t _lastTimestampUs;
+};
+
+#endif // RELAYSOURCE_H
@@ -0,0 +1,374 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "ReplaySource.h"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+
+#include "Clock.h"
+#include "Tracer.h"
+#include "MjpegUtils.h"
+
+namespace {
+  bool IsJpegFileName(const std::string& fileName) {
+    const size_t extensionStart = fileName.rfind('.');
+    if (std::string::npos == extensionStart) {
+      return false;
+    }
+    
+    const char* extension = fileName.c_str() + extensionStart;
+    return 0 == ::strcasecmp(extension, ".jpg") || 0 == ::strcasecmp(extension, ".jpeg");
+  }
+  
+  bool ReadFile(const std::string& fileName, std::vector<uint8_t>& data) {
+    const int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (-1 == fd) {
+      Tracer::LogErrNo("open() of a replayed file.");
+      return false;
+    }
+    
+    struct stat fileStat;
+    if (-1 == ::fstat(fd, &fileStat)) {
+      Tracer::LogErrNo("fstat().");
+      ::close(fd);
+      return false;
+    }
+    
+    data.resize(static_cast<size_t>(fileStat.st_size));
+    
+    size_t bytesRead = 0;
+    while (bytesRead < data.size()) {
+      const ssize_t readResult = ::read(fd, data.data() + bytesRead, data.size() - bytesRead);
+      if (readResult > 0) {
+        bytesRead += static_cast<size_t>(readResult);
+      }
+      else if (-1 == readResult && errno == EINTR) {
+        continue;
+      }
+      else {
+        break;
+      }
+    }
+    
+    ::close(fd);
+    data.resize(bytesRead);
+    
+    return true;
+  }
+}
+
+const uint32_t ReplaySource::InvalidBufferIdx;
+
+ReplaySource::ReplaySource(const Config& config)
+  : _config(config),
+    _readyFd(-1),
+    _isPaused(false),
+    _nextFrameIdx(0),
+    _nextSequence(0)
+{
+}
+
+ReplaySource::~ReplaySource()
+{
+  Shutdown();
+}
+
+bool ReplaySource::Init()
+{
+  if (_frames.empty() && !LoadFrames()) {
+    return false;
+  }
+  
+  if (_videoBuffers.empty()) {
+    _videoBuffers.resize(_config.BuffersNumber);
+    _isBufferQueued.assign(_config.BuffersNumber, false);
+    
+    for (uint32_t idx = 0; idx < _config.BuffersNumber; ++idx) {
+      std::memset(&_videoBuffers[idx], 0, sizeof(VideoBuffer));
+      _videoBuffers[idx].Idx = idx;
+      _videoBuffers[idx].V4l2Buffer.index = idx;
+    }
+  }
+  
+  if (_config.FrameRate != 0) {
+    _readyFd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == _readyFd) {
+      Tracer::LogErrNo("timerfd_create().");
+      return false;
+    }
+    
+    if (!SetTimer(true)) {
+      Shutdown();
+      return false;
+    }
+  }
+  else {
+    // Every returned frame signals the eventfd so the next one is replayed at once.
+    _readyFd = ::eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == _readyFd) {
+      Tracer::LogErrNo("eventfd().");
+      return false;
+    }
+  }
+  
+  Tracer::Log("Replaying %u frames from '%s'.\n", static_cast<uint32_t>(_frames.size()), _config.Path.c_str());
+  
+  return true;
+}
+
+bool ReplaySource::ReInit()
+{
+  Shutdown();
+  
+  return Init();
+}
+
+void ReplaySource::Shutdown()
+{
+  if (_readyFd != -1) {
+    ::close(_readyFd);
+    _readyFd = -1;
+  }
+  
+  _isPaused = false;
+}
+
+const VideoBuffer* ReplaySource::DequeuFrame()
+{
+  if (-1 == _readyFd || _isPaused) {
+    return nullptr;
+  }
+  
+  // The counter is the number of timer periods (or returned frames).
+  uint64_t counter = 0;
+  const bool isSignaled = (sizeof(counter) == ::read(_readyFd, &counter, sizeof(counter)));
+  
+  uint32_t sequence = _nextSequence;
+  if (_config.FrameRate != 0) {
+    // A frame is produced every period. Periods without a free buffer 
+    // are dropped like frames of a camera which is not read in time.
+    if (!isSignaled || 0 == counter) {
+      return nullptr;
+    }
+    
+    _nextSequence += static_cast<uint32_t>(counter);
+    sequence = _nextSequence - 1;
+  }
+  
+  const uint32_t bufferIdx = FindFreeBuffer();
+  if (InvalidBufferIdx == bufferIdx) {
+    return nullptr;
+  }
+  
+  if (0 == _config.FrameRate) {
+    _nextSequence += 1;
+  }
+  
+  const Buffer& frame = _frames[_nextFrameIdx];
+  _nextFrameIdx = (_nextFrameIdx + 1) % static_cast<uint32_t>(_frames.size());
+  
+  const uint64_t timestampUs = Clock::GetMonotonicTimeUs();
+  
+  VideoBuffer& videoBuffer = _videoBuffers[bufferIdx];
+  videoBuffer.Data = frame.Data;
+  videoBuffer.Size = frame.Size;
+  videoBuffer.Length = frame.Size;
+  videoBuffer.V4l2Buffer.bytesused = frame.Size;
+  videoBuffer.V4l2Buffer.sequence = sequence;
+  videoBuffer.V4l2Buffer.timestamp.tv_sec = static_cast<time_t>(timestampUs / 1000000U);
+  videoBuffer.V4l2Buffer.timestamp.tv_usec = static_cast<suseconds_t>(timestampUs % 1000000U);
+  
+  _isBufferQueued[bufferIdx] = true;
+  
+  return &videoBuffer;
+}
+
+void ReplaySource::RequeueFrame(const VideoBuffer* buffer)
+{
+  if (nullptr == buffer || buffer->Idx >= _isBufferQueued.size()) {
+    return;
+  }
+  
+  _isBufferQueued[buffer->Idx] = false;
+  
+  if (0 == _config.FrameRate && _readyFd != -1 && !_isPaused) {
+    const uint64_t counter = 1;
+    if (-1 == ::write(_readyFd, &counter, sizeof(counter)) && errno != EAGAIN) {
+      Tracer::LogErrNo("write(eventfd).");
+    }
+  }
+}
+
+bool ReplaySource::LoadFrames()
+{
+  struct stat pathStat;
+  if (-1 == ::stat(_config.Path.c_str(), &pathStat)) {
+    Tracer::Log("Failed to find replayed path '%s'.\n", _config.Path.c_str());
+    return false;
+  }
+  
+  if (S_ISDIR(pathStat.st_mode)) {
+    DIR* dir = ::opendir(_config.Path.c_str());
+    if (nullptr == dir) {
+      Tracer::LogErrNo("opendir().");
+      return false;
+    }
+    
+    std::vector<std::string> fileNames;
+    for (dirent* entry = ::readdir(dir); entry != nullptr; entry = ::readdir(dir)) {
+      if (IsJpegFileName(entry->d_name)) {
+        fileNames.push_back(_config.Path + "/" + entry->d_name);
+      }
+    }
+    
+    ::closedir(dir);
+    
+    std::sort(fileNames.begin(), fileNames.end());
+    
+    for (const std::string& fileName : fileNames) {
+      LoadFile(fileName);
+    }
+  }
+  else {
+    LoadFile(_config.Path);
+  }
+  
+  if (_frames.empty()) {
+    Tracer::Log("There are no JPEG images in '%s'.\n", _config.Path.c_str());
+    return false;
+  }
+  
+  return true;
+}
+
+bool ReplaySource::LoadFile(const std::string& fileName)
+{
+  std::vector<uint8_t> data;
+  if (!ReadFile(fileName, data)) {
+    return false;
+  }
+  
+  // Frames refer to the file data which is not moved by later loading.
+  _files.push_back(std::vector<uint8_t>());
+  _files.back().swap(data);
+  
+  const uint8_t* fileData = _files.back().data();
+  const uint32_t fileSize = static_cast<uint32_t>(_files.back().size());
+  
+  // Anything between images (e.g. multipart headers of a saved stream) is skipped.
+  uint32_t offset = 0;
+  while (offset + 4 <= fileSize) {
+    const uint8_t* start = static_cast<const uint8_t*>(std::memchr(fileData + offset, 0xFF, fileSize - offset));
+    if (nullptr == start) {
+      break;
+    }
+    
+    offset = static_cast<uint32_t>(start - fileData);
+    
+    const uint32_t jpegSize = (offset + 1 < fileSize && 0xD8 == start[1]) ? GetJpegSize(start, fileSize - offset) : 0;
+    if (jpegSize != 0) {
+      _frames.push_back(Buffer {start, jpegSize});
+      offset += jpegSize;
+    }
+    else {
+      offset += 1;
+    }
+  }
+  
+  return true;
+}
+
+bool ReplaySource::Pause()
+{
+  if (-1 == _readyFd || _isPaused) {
+    return false;
+  }
+  
+  if (_config.FrameRate != 0 && !SetTimer(false)) {
+    return false;
+  }
+  
+  _isPaused = true;
+  
+  return true;
+}
+
+bool ReplaySource::Resume()
+{
+  if (-1 == _readyFd || !_isPaused) {
+    return false;
+  }
+  
+  _isPaused = false;
+  
+  if (_config.FrameRate != 0) {
+    return SetTimer(true);
+  }
+  
+  // Replaying as fast as possible starts with a signaled eventfd.
+  const uint64_t counter = 1;
+  if (-1 == ::write(_readyFd, &counter, sizeof(counter)) && errno != EAGAIN) {
+    Tracer::LogErrNo("write(eventfd).");
+  }
+  
+  return true;
+}
+
+bool ReplaySource::SetTimer(bool isEnabled)
+{
+  // A zero timer value disarms the timer. Expirations are counted from the last setting.
+  itimerspec timerSpec = {{0}};
+  if (isEnabled) {
+    const uint64_t periodNs = 1000000000ULL / _config.FrameRate;
+    timerSpec.it_interval.tv_sec = static_cast<time_t>(periodNs / 1000000000ULL);
+    timerSpec.it_interval.tv_nsec = static_cast<long>(periodNs % 1000000000ULL);
+    timerSpec.it_value = timerSpec.it_interval;
+  }
+  
+  if (-1 == ::timerfd_settime(_readyFd, 0, &timerSpec, nullptr)) {
+    Tracer::LogErrNo("timerfd_settime().");
+    return false;
+  }
+  
+  return true;
+}
+
+uint32_t ReplaySource::FindFreeBuffer() const
+{
+  for (uint32_t idx = 0; idx < _isBufferQueued.size(); ++idx) {
+    if (!_isBufferQueued[idx]) {
+      return idx;
+    }
+  }
+  
+  return InvalidBufferIdx;
+}
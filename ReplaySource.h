@@ -0,0 +1,115 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef REPLAYSOURCE_H
+#define REPLAYSOURCE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "Buffer.h"
+#include "FrameSource.h"
+
+/*
+ * @brief ReplaySource replays recorded frames in a loop: JPEG images found in 
+ *        a file (raw MJPEG or a saved multipart stream) or JPEG files of 
+ *        a directory (in the order of names). Frames are loaded in memory so 
+ *        replaying does not depend on disk speed. Frames get timestamps of 
+ *        the replay time and increasing sequence numbers like captured ones.
+ *        It allows benchmarking the server without a camera.
+ * 
+ * */
+class ReplaySource : public FrameSource
+{
+public:
+  
+  struct Config {
+    std::string Path;
+    
+    // Frames per second. Zero means as fast as frames are returned.
+    uint32_t FrameRate;
+    
+    uint32_t BuffersNumber;
+  };
+  
+  explicit ReplaySource(const Config& config);
+  ~ReplaySource();
+  
+  // @brief Loads frames (once) and starts replaying.
+  bool Init() override;
+  
+  bool ReInit() override;
+  
+  void Shutdown() override;
+  
+  bool IsBroken() const override { return false; }
+  
+  bool IsReady() const override { return _readyFd != -1; }
+  
+  // @brief Returns timerfd of the frame rate or eventfd which is signaled when a frame is returned.
+  int GetFd() const override { return _readyFd; }
+  
+  const VideoBuffer* DequeuFrame() override;
+  
+  void RequeueFrame(const VideoBuffer* buffer) override;
+  
+  // @brief Stops the frame rate timer (or ignores returned frames) till Resume().
+  bool Pause() override;
+  
+  bool Resume() override;
+  
+  bool IsPaused() const override { return _isPaused; }
+  
+  ReplaySource() = delete;
+  ReplaySource(const ReplaySource& other) = delete;
+  ReplaySource& operator=(const ReplaySource& other) = delete;
+  
+private:
+  
+  static const uint32_t InvalidBufferIdx = 0xFFFFFFFF;
+  
+  bool LoadFrames();
+  
+  // @brief Reads a file and appends all JPEG images of it to _frames.
+  bool LoadFile(const std::string& fileName);
+  
+  uint32_t FindFreeBuffer() const;
+  
+  // @brief Starts or stops the frame rate timer.
+  bool SetTimer(bool isEnabled);
+  
+  Config _config;
+  
+  int _readyFd;
+  bool _isPaused;
+  
+  // Loaded files and frames which refer to them.
+  std::vector<std::vector<uint8_t>> _files;
+  std::vector<Buffer> _frames;
+  uint32_t _nextFrameIdx;
+  uint32_t _nextSequence;
+  
+  std::vector<VideoBuffer> _videoBuffers;
+  std::vector<bool> _isBufferQueued;
+};
+
+#endif // REPLAYSOURCE_H
@@ -0,0 +1,375 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "RtpSender.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+
+#include "Buffer.h"
+#include "MjpegUtils.h"
+#include "Tracer.h"
+
+namespace {
+  // Packets fit into Ethernet MTU with IP and UDP headers.
+  static const uint32_t MaxPacketSize = 1400;
+  
+  // RTP payload type of JPEG (RFC 3551).
+  static const uint8_t JpegPayloadType = 26;
+  
+  // RTP/JPEG timestamps are in 90 kHz units.
+  static const uint64_t RtpClockRate = 90000;
+  
+  // In-band quantization tables (RFC 2435, 4.2).
+  static const uint8_t DynamicTablesQ = 255;
+  static const uint32_t QuantTableSize = 64;
+  
+  // A whole frame is sent at once so the socket buffer should hold it.
+  static const int SocketBufferSize = 1024 * 1024;
+  
+  // Per packet: headers, two quantization tables and scan data.
+  static const uint32_t MaxIoVectorsPerPacket = 4;
+  
+  void WriteUInt16(uint8_t* data, uint32_t value) {
+    data[0] = static_cast<uint8_t>(value >> 8);
+    data[1] = static_cast<uint8_t>(value);
+  }
+  
+  void WriteUInt24(uint8_t* data, uint32_t value) {
+    data[0] = static_cast<uint8_t>(value >> 16);
+    data[1] = static_cast<uint8_t>(value >> 8);
+    data[2] = static_cast<uint8_t>(value);
+  }
+  
+  void WriteUInt32(uint8_t* data, uint32_t value) {
+    data[0] = static_cast<uint8_t>(value >> 24);
+    data[1] = static_cast<uint8_t>(value >> 16);
+    data[2] = static_cast<uint8_t>(value >> 8);
+    data[3] = static_cast<uint8_t>(value);
+  }
+  
+  // @brief Fills data with random bytes from /dev/urandom. The global rand() is not touched.
+  bool ReadRandomBytes(void* data, size_t size) {
+    const int fd = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (-1 == fd) {
+      Tracer::LogErrNo("open(/dev/urandom).");
+      return false;
+    }
+    
+    const bool result = (static_cast<ssize_t>(size) == ::read(fd, data, size));
+    if (!result) {
+      Tracer::LogErrNo("read(/dev/urandom).");
+    }
+    
+    ::close(fd);
+    
+    return result;
+  }
+  
+  bool ParseDestination(const std::string& destination, sockaddr_in& address) {
+    const std::size_t portStart = destination.rfind(':');
+    if (std::string::npos == portStart) {
+      return false;
+    }
+    
+    char* rest = nullptr;
+    const unsigned long port = std::strtoul(destination.c_str() + portStart + 1, &rest, 10);
+    if (*rest != 0 || 0 == port || port > 0xFFFF) {
+      return false;
+    }
+    
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    
+    return 1 == ::inet_pton(AF_INET, destination.substr(0, portStart).c_str(), &address.sin_addr);
+  }
+}
+
+RtpSender::RtpSender()
+  : _socketFd(-1),
+    _ssrc(0),
+    _sequenceNumber(0),
+    _sentFramesNumber(0),
+    _droppedFramesNumber(0),
+    _isFirstDropLogged(false)
+{
+}
+
+RtpSender::~RtpSender()
+{
+  Shutdown();
+}
+
+bool RtpSender::Init(const Config& config)
+{
+  sockaddr_in address;
+  if (!ParseDestination(config.Destination, address)) {
+    Tracer::Log("Invalid RTP destination '%s' (address:port is expected).\n", config.Destination.c_str());
+    return false;
+  }
+  
+  _socketFd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (-1 == _socketFd) {
+    Tracer::LogErrNo("Failed to create RTP socket.");
+    return false;
+  }
+  
+  const bool isMulticast = IN_MULTICAST(ntohl(address.sin_addr.s_addr));
+  if (isMulticast) {
+    int ttl = static_cast<int>(config.MulticastTtl);
+    if (::setsockopt(_socketFd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0) {
+      Tracer::LogErrNo("setsockopt(IP_MULTICAST_TTL).");
+    }
+  }
+  
+  int bufferSize = SocketBufferSize;
+  if (::setsockopt(_socketFd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize)) != 0) {
+    Tracer::LogErrNo("setsockopt(SO_SNDBUF).");
+  }
+  
+  // The socket is connected so packets do not need addresses.
+  if (::connect(_socketFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+    Tracer::LogErrNo("connect() of RTP socket.");
+    Shutdown();
+    return false;
+  }
+  
+  // SSRC and the initial sequence number should be random (RFC 3550, 5.1).
+  uint32_t randomValues[2] = {0, 0};
+  if (!ReadRandomBytes(randomValues, sizeof(randomValues))) {
+    Shutdown();
+    return false;
+  }
+  
+  _ssrc = randomValues[0];
+  _sequenceNumber = static_cast<uint16_t>(randomValues[1]);
+  
+  _packetHeaders.resize(MaxBatchSize);
+  _ioVectors.resize(MaxBatchSize * MaxIoVectorsPerPacket);
+  _messages.resize(MaxBatchSize);
+  
+  char addressText[INET_ADDRSTRLEN] = {0};
+  ::inet_ntop(AF_INET, &address.sin_addr, addressText, sizeof(addressText));
+  
+  static const char SdpTemplate[] = 
+    "v=0\r\n" \
+    "o=- %u 1 IN IP4 0.0.0.0\r\n" \
+    "s=uvc2http\r\n" \
+    "c=IN IP4 %s%s\r\n" \
+    "t=0 0\r\n" \
+    "m=video %u RTP/AVP %u\r\n" \
+    "a=rtpmap:%u JPEG/90000\r\n";
+  
+  char ttlText[16] = {0};
+  if (isMulticast) {
+    std::snprintf(ttlText, sizeof(ttlText), "/%u", config.MulticastTtl);
+  }
+  
+  char sdp[sizeof(SdpTemplate) + 128];
+  int sdpSize = std::snprintf(sdp, sizeof(sdp), SdpTemplate, _ssrc, addressText, ttlText, 
+                              static_cast<uint32_t>(ntohs(address.sin_port)), 
+                              static_cast<uint32_t>(JpegPayloadType), static_cast<uint32_t>(JpegPayloadType));
+  if (sdpSize > 0 && static_cast<size_t>(sdpSize) < sizeof(sdp)) {
+    _sdp.assign(sdp, sdpSize);
+  }
+  
+  Tracer::Log("RTP/JPEG is sent to %s.\n", config.Destination.c_str());
+  
+  return true;
+}
+
+void RtpSender::Shutdown()
+{
+  if (_socketFd != -1) {
+    if (-1 == ::close(_socketFd)) {
+      Tracer::LogErrNo("close().");
+    }
+    
+    _socketFd = -1;
+  }
+}
+
+RtpSender::Stats RtpSender::GetStats() const
+{
+  Stats stats = {0};
+  stats.SentFramesNumber = _sentFramesNumber;
+  stats.DroppedFramesNumber = _droppedFramesNumber;
+  
+  return stats;
+}
+
+bool RtpSender::SendFrame(const VideoBuffer* videoBuffer)
+{
+  if (-1 == _socketFd) {
+    return false;
+  }
+  
+  JpegScanInfo scanInfo;
+  const bool isParsed = ParseJpegScan(videoBuffer, scanInfo);
+  
+  // Type 0 is 4:2:2 and type 1 is 4:2:0. Dimensions are sent in 8 pixel blocks.
+  uint8_t type = 0xFF;
+  if (isParsed && 2 == scanInfo.LumaSamplingH) {
+    type = (1 == scanInfo.LumaSamplingV) ? 0 : (2 == scanInfo.LumaSamplingV ? 1 : 0xFF);
+  }
+  
+  if (0xFF == type || scanInfo.Width > 2040 || scanInfo.Height > 2040) {
+    _droppedFramesNumber += 1;
+    
+    if (!_isFirstDropLogged) {
+      Tracer::Log("Frame can not be sent as RTP/JPEG (unsupported JPEG format or size).\n");
+      _isFirstDropLogged = true;
+    }
+    
+    return false;
+  }
+  
+  // Packets are not aligned to restart intervals so F, L and count are set as 
+  // required for this case (RFC 2435, 3.1.7).
+  const bool hasRestartMarkers = (scanInfo.RestartInterval != 0);
+  if (hasRestartMarkers) {
+    type += 64;
+  }
+  
+  const timeval& timestamp = videoBuffer->V4l2Buffer.timestamp;
+  const uint32_t rtpTimestamp = static_cast<uint32_t>(
+    static_cast<uint64_t>(timestamp.tv_sec) * RtpClockRate + static_cast<uint64_t>(timestamp.tv_usec) * RtpClockRate / 1000000);
+  
+  uint32_t scanOffset = 0;
+  uint32_t packetsNumber = 0;
+  
+  while (scanOffset < scanInfo.ScanDataSize) {
+    const bool isFirst = (0 == scanOffset);
+    
+    uint8_t* header = _packetHeaders[packetsNumber].Data;
+    uint32_t headerSize = 12 + 8 + (hasRestartMarkers ? 4 : 0) + (isFirst ? 4 : 0);
+    const uint32_t tablesSize = isFirst ? 2 * QuantTableSize : 0;
+    
+    const uint32_t dataSize = std::min(scanInfo.ScanDataSize - scanOffset, MaxPacketSize - headerSize - tablesSize);
+    const bool isLast = (scanOffset + dataSize == scanInfo.ScanDataSize);
+    
+    // RTP header: V=2, M is set for the last packet of a frame.
+    header[0] = 0x80;
+    header[1] = JpegPayloadType | (isLast ? 0x80 : 0);
+    WriteUInt16(header + 2, _sequenceNumber++);
+    WriteUInt32(header + 4, rtpTimestamp);
+    WriteUInt32(header + 8, _ssrc);
+    
+    // JPEG header.
+    uint8_t* jpegHeader = header + 12;
+    jpegHeader[0] = 0;
+    WriteUInt24(jpegHeader + 1, scanOffset);
+    jpegHeader[4] = type;
+    jpegHeader[5] = DynamicTablesQ;
+    jpegHeader[6] = static_cast<uint8_t>((scanInfo.Width + 7) / 8);
+    jpegHeader[7] = static_cast<uint8_t>((scanInfo.Height + 7) / 8);
+    
+    uint8_t* nextHeader = jpegHeader + 8;
+    if (hasRestartMarkers) {
+      WriteUInt16(nextHeader, scanInfo.RestartInterval);
+      WriteUInt16(nextHeader + 2, 0xFFFF);
+      nextHeader += 4;
+    }
+    
+    if (isFirst) {
+      // Quantization table header: MBZ, precision (8-bit tables) and length.
+      nextHeader[0] = 0;
+      nextHeader[1] = 0;
+      WriteUInt16(nextHeader + 2, tablesSize);
+    }
+    
+    iovec* ioVectors = &_ioVectors[packetsNumber * MaxIoVectorsPerPacket];
+    uint32_t ioVectorsNumber = 0;
+    
+    ioVectors[ioVectorsNumber].iov_base = header;
+    ioVectors[ioVectorsNumber].iov_len = headerSize;
+    ++ioVectorsNumber;
+    
+    if (isFirst) {
+      for (uint32_t tableIdx = 0; tableIdx < 2; ++tableIdx) {
+        ioVectors[ioVectorsNumber].iov_base = const_cast<uint8_t*>(scanInfo.QuantTables[tableIdx]);
+        ioVectors[ioVectorsNumber].iov_len = QuantTableSize;
+        ++ioVectorsNumber;
+      }
+    }
+    
+    ioVectors[ioVectorsNumber].iov_base = const_cast<uint8_t*>(scanInfo.ScanData + scanOffset);
+    ioVectors[ioVectorsNumber].iov_len = dataSize;
+    ++ioVectorsNumber;
+    
+    mmsghdr& message = _messages[packetsNumber];
+    std::memset(&message, 0, sizeof(message));
+    message.msg_hdr.msg_iov = ioVectors;
+    message.msg_hdr.msg_iovlen = ioVectorsNumber;
+    
+    ++packetsNumber;
+    scanOffset += dataSize;
+    
+    if (packetsNumber == MaxBatchSize || isLast) {
+      if (!SendBatch(packetsNumber)) {
+        // Receivers drop the incomplete frame.
+        _droppedFramesNumber += 1;
+        return false;
+      }
+      
+      packetsNumber = 0;
+    }
+  }
+  
+  _sentFramesNumber += 1;
+  
+  return true;
+}
+
+bool RtpSender::SendBatch(uint32_t packetsNumber)
+{
+  uint32_t sentPacketsNumber = 0;
+  
+  while (sentPacketsNumber < packetsNumber) {
+    int result = ::sendmmsg(_socketFd, &_messages[sentPacketsNumber], packetsNumber - sentPacketsNumber, 0);
+    if (result > 0) {
+      sentPacketsNumber += static_cast<uint32_t>(result);
+    }
+    else if (-1 == result && EINTR == errno) {
+      continue;
+    }
+    else {
+      // EAGAIN: the socket buffer is full. Other errors (e.g. no route) are not fatal either.
+      if (errno != EAGAIN && errno != EWOULDBLOCK && !_isFirstDropLogged) {
+        Tracer::LogErrNo("sendmmsg() of RTP packets.");
+        _isFirstDropLogged = true;
+      }
+      
+      return false;
+    }
+  }
+  
+  return true;
+}
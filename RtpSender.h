@@ -0,0 +1,106 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef RTPSENDER_H
+#define RTPSENDER_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct VideoBuffer;
+
+/*
+ * @brief RtpSender sends MJPEG frames as RTP/JPEG (RFC 2435) over UDP, e.g. to 
+ *        a multicast group, so any number of viewers costs one stream.
+ *        Scan data is sent directly from video buffers. Quantization tables 
+ *        are sent in-band (Q=255) so frames are decoded with standard Huffman tables.
+ * 
+ * */
+class RtpSender
+{
+public:
+  
+  struct Config {
+    // Destination "address:port" (IPv4). A multicast group is usually used.
+    std::string Destination;
+    
+    // TTL of multicast packets.
+    uint32_t MulticastTtl;
+  };
+  
+  struct Stats {
+    uint64_t SentFramesNumber;
+    uint64_t DroppedFramesNumber;
+  };
+  
+  RtpSender();
+  ~RtpSender();
+  
+  bool Init(const Config& config);
+  void Shutdown();
+  
+  // @brief Sends a frame. It does not block: a frame which does not fit
+  //        into the socket buffer is dropped.
+  bool SendFrame(const VideoBuffer* videoBuffer);
+  
+  // @brief Returns a session description for receivers (RFC 4566).
+  const std::string& GetSdp() const { return _sdp; }
+  
+  // @brief Returns counters. Thread safe.
+  Stats GetStats() const;
+  
+  RtpSender(const RtpSender& other) = delete;
+  RtpSender& operator=(const RtpSender& other) = delete;
+  
+private:
+  
+  // RTP header, JPEG header, restart marker header and quantization table header.
+  static const uint32_t MaxPacketHeaderSize = 12 + 8 + 4 + 4;
+  
+  // Packets are sent by batches with one sendmmsg() call.
+  static const uint32_t MaxBatchSize = 64;
+  
+  struct PacketHeader {
+    uint8_t Data[MaxPacketHeaderSize];
+  };
+  
+  // @brief Sends prepared packets. Returns false if not all of them were sent.
+  bool SendBatch(uint32_t packetsNumber);
+  
+  int _socketFd;
+  std::string _sdp;
+  
+  uint32_t _ssrc;
+  uint16_t _sequenceNumber;
+  
+  std::vector<PacketHeader> _packetHeaders;
+  std::vector<iovec> _ioVectors;
+  std::vector<mmsghdr> _messages;
+  
+  std::atomic<uint64_t> _sentFramesNumber;
+  std::atomic<uint64_t> _droppedFramesNumber;
+  bool _isFirstDropLogged;
+};
+
+#endif // RTPSENDER_H
@@ -0,0 +1,103 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+/*
+ * @brief SpscRing is a bounded lock-free queue for exactly one producer 
+ *        thread and one consumer thread.
+ * 
+ * */
+template <typename T>
+class SpscRing
+{
+public:
+  
+  // @brief Capacity is rounded up to a power of two.
+  explicit SpscRing(std::size_t capacity)
+    : _items(RoundUpToPowerOfTwo(capacity)),
+      _mask(_items.size() - 1),
+      _head(0),
+      _tail(0)
+  {
+  }
+  
+  std::size_t GetCapacity() const { return _items.size(); }
+  
+  // @brief Producer side. Returns false if the ring is full.
+  bool Push(const T& item)
+  {
+    const std::size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == _items.size()) {
+      return false;
+    }
+    
+    _items[tail & _mask] = item;
+    _tail.store(tail + 1, std::memory_order_release);
+    
+    return true;
+  }
+  
+  // @brief Consumer side. Returns false if the ring is empty.
+  bool Pop(T& item)
+  {
+    const std::size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    
+    item = _items[head & _mask];
+    _head.store(head + 1, std::memory_order_release);
+    
+    return true;
+  }
+  
+  SpscRing() = delete;
+  SpscRing(const SpscRing& other) = delete;
+  SpscRing& operator=(const SpscRing& other) = delete;
+  
+private:
+  
+  static std::size_t RoundUpToPowerOfTwo(std::size_t value)
+  {
+    std::size_t result = 1;
+    while (result < value) {
+      result <<= 1;
+    }
+    
+    return result;
+  }
+  
+  std::vector<T> _items;
+  const std::size_t _mask;
+  
+  // Head is written only by the consumer and tail only by the producer.
+  // They are kept on different cache lines to avoid false sharing.
+  alignas(64) std::atomic<std::size_t> _head;
+  alignas(64) std::atomic<std::size_t> _tail;
+};
+
+#endif // SPSCRING_H
@@ -21,71 +21,725 @@
 
 #include "StreamFunc.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
-#include <time.h>
+#include <memory>
+#include <vector>
+#include <sys/epoll.h>
 
+#include "Clock.h"
 #include "Tracer.h"
+#include "EventLoop.h"
 #include "UvcGrabber.h"
+#include "RelaySource.h"
+#include "ReplaySource.h"
 #include "HttpServer.h"
+#include "CaptureThread.h"
+#include "DeviceWatcher.h"
+#include "StreamWatchdog.h"
 #include "MjpegUtils.h"
 
 namespace UvcStreamer {
   
-  int StreamFunc(const UvcStreamerCfg& config, ShouldExit shouldExit) {
+  namespace {
     
-    HttpServer httpServer;
-    if (!httpServer.Init(config.ServerCfg.ServicePort.c_str())) {
-      Tracer::Log("Failed to initialize HTTP server.\n");
-      return -2;
+    // @brief Registers an fd (a camera or a device watcher) in an event loop and remembers its readiness.
+    class FdWatcher : private EventLoop::Handler {
+    public:
+      FdWatcher(EventLoop& eventLoop)
+        : _eventLoop(eventLoop), _fd(-1), _isReady(false) {}
+      
+      ~FdWatcher() { Unwatch(); }
+      
+      bool IsWatching() const { return _fd != -1; }
+      
+      bool Watch(int fd) {
+        // The fd is edge triggered so all ready data (frames) should be read on every event.
+        if (!_eventLoop.Add(fd, EPOLLIN | EPOLLET, this)) {
+          return false;
+        }
+        
+        _fd = fd;
+        
+        // Data could be ready before registration.
+        _isReady = true;
+        
+        return true;
+      }
+      
+      void Unwatch() {
+        if (_fd != -1) {
+          _eventLoop.Remove(_fd);
+          _fd = -1;
+        }
+        
+        _isReady = false;
+      }
+      
+      // @brief Returns true if the fd reported readiness since the previous call.
+      bool TakeReady() {
+        const bool isReady = _isReady;
+        _isReady = false;
+        
+        return isReady;
+      }
+      
+      FdWatcher(const FdWatcher&) = delete;
+      FdWatcher& operator=(const FdWatcher&) = delete;
+      
+    private:
+      void OnEvent(int, uint32_t) override { _isReady = true; }
+      
+      EventLoop& _eventLoop;
+      int _fd;
+      bool _isReady;
+    };
+    
+    // @brief Counters of capturing. They are read by "/stats" from shard threads.
+    struct CaptureStats {
+      // Capturing on demand.
+      std::atomic<uint64_t> PausesNumber;
+      std::atomic<uint64_t> ResumesNumber;
+      
+      // Time from resuming capturing till the first queued frame.
+      std::atomic<uint64_t> LastFirstFrameMs;
+      std::atomic<uint64_t> MaxFirstFrameMs;
+      
+      // Successful reinitializations of broken sources and the time from a failure till the recovery.
+      std::atomic<uint64_t> RecoveriesNumber;
+      std::atomic<uint64_t> LastRecoveryMs;
+      
+      // Watchdog: detected stalls and windows with too many drops, frames dropped by 
+      // the driver (sequence gaps) and escalated actions.
+      std::atomic<uint64_t> StallsNumber;
+      std::atomic<uint64_t> DropWindowsNumber;
+      std::atomic<uint64_t> DroppedFramesNumber;
+      std::atomic<uint64_t> RequeuesNumber;
+      std::atomic<uint64_t> RestartsNumber;
+      std::atomic<uint64_t> ReinitsNumber;
+      
+      // Capture buffers of all cameras and their reallocations (see BufferSizer).
+      std::atomic<uint64_t> BuffersNumber;
+      std::atomic<uint64_t> BufferGrowsNumber;
+      std::atomic<uint64_t> BufferShrinksNumber;
+      std::atomic<uint64_t> BufferResizeCancelsNumber;
+      
+      std::string GetText() const {
+        char text[1024];
+        int result = std::snprintf(text, sizeof(text), 
+                                   "capture_pauses: %llu\n" \
+                                   "capture_resumes: %llu\n" \
+                                   "capture_first_frame_ms: %llu\n" \
+                                   "capture_max_first_frame_ms: %llu\n" \
+                                   "capture_recoveries: %llu\n" \
+                                   "capture_recovery_ms: %llu\n" \
+                                   "watchdog_stalls: %llu\n" \
+                                   "watchdog_drop_windows: %llu\n" \
+                                   "driver_dropped_frames: %llu\n" \
+                                   "watchdog_requeues: %llu\n" \
+                                   "watchdog_restarts: %llu\n" \
+                                   "watchdog_reinits: %llu\n" \
+                                   "capture_buffers: %llu\n" \
+                                   "capture_buffer_grows: %llu\n" \
+                                   "capture_buffer_shrinks: %llu\n" \
+                                   "capture_buffer_resize_cancels: %llu\n",
+                                   static_cast<unsigned long long>(PausesNumber),
+                                   static_cast<unsigned long long>(ResumesNumber),
+                                   static_cast<unsigned long long>(LastFirstFrameMs),
+                                   static_cast<unsigned long long>(MaxFirstFrameMs),
+                                   static_cast<unsigned long long>(RecoveriesNumber),
+                                   static_cast<unsigned long long>(LastRecoveryMs),
+                                   static_cast<unsigned long long>(StallsNumber),
+                                   static_cast<unsigned long long>(DropWindowsNumber),
+                                   static_cast<unsigned long long>(DroppedFramesNumber),
+                                   static_cast<unsigned long long>(RequeuesNumber),
+                                   static_cast<unsigned long long>(RestartsNumber),
+                                   static_cast<unsigned long long>(ReinitsNumber),
+                                   static_cast<unsigned long long>(BuffersNumber),
+                                   static_cast<unsigned long long>(BufferGrowsNumber),
+                                   static_cast<unsigned long long>(BufferShrinksNumber),
+                                   static_cast<unsigned long long>(BufferResizeCancelsNumber));
+        
+        return (result > 0 && static_cast<size_t>(result) < sizeof(text)) ? std::string(text, result) : std::string();
+      }
+    };
+    
+    // @brief A frame source with its camera index and readiness watcher.
+    struct SourceSlot {
+      SourceSlot(FrameSource& frameSource, uint32_t cameraIdx, EventLoop& eventLoop, uint32_t stallTimeoutMs)
+        : Source(frameSource), CameraIdx(cameraIdx), IsDevice(!frameSource.GetDevicePath().empty()), 
+          Watcher(eventLoop), RecoveryStartMs(0), 
+          RetryTimeMs(0), RetryDelayMs(0), NodeFdWatcher(eventLoop), IdleStartMs(0), ResumeTimeUs(0),
+          Watchdog(stallTimeoutMs), PendingAction(StreamWatchdog::NoAction), 
+          PendingBuffersNumber(0), ResizeStartMs(0), ResizeRetryTimeMs(0) {}
+      
+      FrameSource& Source;
+      uint32_t CameraIdx;
+      
+      // The source has a device node (a camera). The path does not change so it is checked once.
+      bool IsDevice;
+      
+      FdWatcher Watcher;
+      
+      // Recovery of a broken source: the time of the failure (zero while the source works), 
+      // the time of the next attempt and the current delay between attempts. The device node 
+      // is watched meanwhile so a reconnected camera is reopened at once.
+      uint64_t RecoveryStartMs;
+      uint64_t RetryTimeMs;
+      uint64_t RetryDelayMs;
+      DeviceWatcher NodeWatcher;
+      FdWatcher NodeFdWatcher;
+      
+      // Capturing on demand: the time when the last client has left (zero while 
+      // there are clients) and the time of resuming till the first frame is queued.
+      uint64_t IdleStartMs;
+      uint64_t ResumeTimeUs;
+      
+      // Requeuing and restarting wait till all frames are returned. Reinitialization is done by the recovery.
+      StreamWatchdog Watchdog;
+      StreamWatchdog::Action PendingAction;
+      
+      // Buffers are reallocated when all frames are returned. A resize which waits
+      // for clients too long is cancelled and is not retried till ResizeRetryTimeMs.
+      uint32_t PendingBuffersNumber;
+      uint64_t ResizeStartMs;
+      uint64_t ResizeRetryTimeMs;
+    };
+    
+    // @brief Returns true if clients hold all buffers of a source but one so the driver drops 
+    //        frames (or stops) because it has nothing to fill. It is not a fault of the camera.
+    bool IsDriverStarved(const FrameSource& frameSource) {
+      const uint32_t buffersNumber = frameSource.GetBuffersNumber();
+      return buffersNumber != 0 && frameSource.GetDequeuedFramesNumber() + 1 >= buffersNumber;
     }
     
-    // Init and configure UVC video camera
-    UvcGrabber uvcGrabber(config.GrabberCfg);
-    if (!uvcGrabber.Init()) {
-      Tracer::Log("Failed to initialize UvcGrabber (is there a UVC camera?). The app will try to initialize later.\n");
+    // @brief Returns frames of a source from the server. Returns true if all frames are returned.
+    //        It does not block so it should be repeated till it returns true.
+    bool RequeueAllFrames(SourceSlot& slot, HttpServer& httpServer) {
+      std::vector<const VideoBuffer*> buffers;
+      const bool isDrained = httpServer.DequeueAllBuffers(buffers, slot.CameraIdx);
+      for (auto buffer : buffers) {
+        slot.Source.RequeueFrame(buffer);
+      }
+      
+      return isDrained;
     }
     
-    static const long Kilo = 1000;
+    // @brief Pauses capturing of a source without clients for onDemandIdleMs and resumes it
+    //        when a client comes. Returns the time to wait till the source should be checked again.
+    int CaptureOnDemand(SourceSlot& slot, HttpServer& httpServer, uint32_t onDemandIdleMs, CaptureStats& stats, int waitTimeMs) {
+      FrameSource& frameSource = slot.Source;
+      
+      if (httpServer.IsCameraWatched(slot.CameraIdx)) {
+        slot.IdleStartMs = 0;
+        
+        if (frameSource.IsPaused()) {
+          // Device is open and buffers are mapped so only streaming is restarted.
+          slot.ResumeTimeUs = Clock::GetMonotonicTimeUs();
+          if (frameSource.Resume()) {
+            slot.Watchdog.Reset(Clock::GetMonotonicTimeMs());
+            stats.ResumesNumber += 1;
+          }
+          else {
+            Tracer::Log("Failed to resume capturing.\n");
+          }
+          
+          // The source fd is watched again without waiting.
+          return 0;
+        }
+        
+        return waitTimeMs;
+      }
+      
+      if (frameSource.IsPaused()) {
+        return waitTimeMs;
+      }
+      
+      const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+      if (0 == slot.IdleStartMs) {
+        slot.IdleStartMs = nowMs;
+      }
+      
+      if (nowMs - slot.IdleStartMs < onDemandIdleMs) {
+        return std::min(waitTimeMs, static_cast<int>(slot.IdleStartMs + onDemandIdleMs - nowMs));
+      }
+      
+      // The source can be paused only when all its frames are returned. The queue 
+      // keeps the newest frames (and copies of them) while there are no clients.
+      if (!RequeueAllFrames(slot, httpServer)) {
+        return waitTimeMs;
+      }
+      
+      if (frameSource.Pause()) {
+        slot.Watcher.Unwatch();
+        slot.ResumeTimeUs = 0;
+        stats.PausesNumber += 1;
+      }
+      
+      // Sources which can not be paused are not tried again till a client comes and leaves.
+      slot.IdleStartMs = 0;
+      
+      return waitTimeMs;
+    }
     
-    while (!shouldExit()) {
+    // @brief Drains frames of a broken (or not initialized) source and reinitializes it without blocking.
+    //        Returns the time to wait till the source should be checked again.
+    int RecoverSource(SourceSlot& slot, HttpServer& httpServer, CaptureStats& stats, int waitTimeMs) {
+      // Attempts are repeated with growing delays. A new device node triggers an attempt at once.
+      static const uint64_t MinRetryDelayMs = 250;
+      static const uint64_t MaxRetryDelayMs = 4000;
+      static const int DrainWaitTimeMs = 100;
       
-      if (uvcGrabber.IsCameraReady() && !uvcGrabber.IsBroken()) {
-        const VideoBuffer* videoBuffer = uvcGrabber.DequeuFrame();
-        if (videoBuffer != nullptr) {
-            if (!httpServer.QueueBuffer(videoBuffer)) {
-              uvcGrabber.RequeueFrame(videoBuffer);
-            }
+      FrameSource& frameSource = slot.Source;
+      
+      // Buffers must not be used by clients when they are unmapped by ReInit(). Clients are 
+      // not closed: frames being sent are copied or the drain is repeated till clients send 
+      // them. Clients stay connected and get frames when the source is recovered.
+      std::vector<const VideoBuffer*> buffers;
+      const bool isDrained = httpServer.TryDequeueAllBuffers(buffers, slot.CameraIdx);
+      for (auto buffer : buffers) {
+        frameSource.RequeueFrame(buffer);
+      }
+      
+      if (!isDrained) {
+        return std::min(waitTimeMs, DrainWaitTimeMs);
+      }
+      
+      const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+      if (0 == slot.RecoveryStartMs) {
+        // The first attempt is made at once as a glitch does not always remove the device.
+        slot.RecoveryStartMs = nowMs;
+        slot.RetryTimeMs = nowMs;
+        slot.RetryDelayMs = MinRetryDelayMs;
+        
+        const std::string devicePath = frameSource.GetDevicePath();
+        if (!devicePath.empty() && slot.NodeWatcher.Init(devicePath)) {
+          slot.NodeFdWatcher.Watch(slot.NodeWatcher.GetFd());
         }
+      }
+      
+      // The fd only wakes the loop up. Events are read on every check as the watched directory can reappear.
+      slot.NodeFdWatcher.TakeReady();
+      const bool hasNodeChanged = slot.NodeWatcher.ReadEvents();
+      if (!hasNodeChanged && nowMs < slot.RetryTimeMs) {
+        return std::min(waitTimeMs, static_cast<int>(slot.RetryTimeMs - nowMs));
+      }
       
-        static const long MaxServeTimeMicroSec = (Kilo * Kilo) / config.GrabberCfg.FrameRate / 2;
-        httpServer.ServeRequests(MaxServeTimeMicroSec);
+      // The fd is closed by ReInit().
+      slot.Watcher.Unwatch();
+      slot.PendingAction = StreamWatchdog::NoAction;
+      slot.PendingBuffersNumber = 0;
+      
+      if (!frameSource.ReInit()) {
+        const uint64_t failureMs = Clock::GetMonotonicTimeMs();
+        slot.RetryTimeMs = failureMs + slot.RetryDelayMs;
+        slot.RetryDelayMs = std::min(slot.RetryDelayMs * 2, MaxRetryDelayMs);
         
-        // It is safe to sleep for 1 ms. There is no significant 
-        // difference (in terms of CPU utilization) in comparison with 
-        // sleeping for a rest of time.
-        const timespec SleepTime {0, Kilo * Kilo};
-        ::nanosleep(&SleepTime, nullptr);
-
-        const VideoBuffer* releasedBuffer = httpServer.DequeueBuffer();
-        while (releasedBuffer != nullptr) {
-          uvcGrabber.RequeueFrame(releasedBuffer);
+        return std::min(waitTimeMs, static_cast<int>(slot.RetryTimeMs - failureMs));
+      }
+      
+      const uint64_t recoveryMs = Clock::GetMonotonicTimeMs() - slot.RecoveryStartMs;
+      stats.RecoveriesNumber += 1;
+      stats.LastRecoveryMs = recoveryMs;
+      
+      Tracer::Log("Frame source is initialized in %u ms.\n", static_cast<uint32_t>(recoveryMs));
+      
+      slot.RecoveryStartMs = 0;
+      slot.NodeFdWatcher.Unwatch();
+      slot.NodeWatcher.Shutdown();
+      slot.Watchdog.Reset(Clock::GetMonotonicTimeMs());
+      
+      // A recovered source is watched without waiting.
+      return 0;
+    }
+    
+    // @brief Performs actions of the watchdog of a working source. Returns the time to wait till the next check.
+    int WatchSource(SourceSlot& slot, HttpServer& httpServer, CaptureStats& stats, int waitTimeMs) {
+      static const int DrainWaitTimeMs = 100;
+      
+      FrameSource& frameSource = slot.Source;
+      
+      if (StreamWatchdog::NoAction == slot.PendingAction) {
+        const StreamWatchdog::Action action = slot.Watchdog.Check(IsDriverStarved(frameSource), Clock::GetMonotonicTimeMs());
+        if (StreamWatchdog::NoAction == action) {
+          const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+          const uint64_t nextCheckMs = slot.Watchdog.GetNextCheckMs();
+          return (nextCheckMs > nowMs) ? std::min(waitTimeMs, static_cast<int>(nextCheckMs - nowMs)) : 0;
+        }
+        
+        const bool isStall = (StreamWatchdog::Stall == slot.Watchdog.GetLastProblem());
+        (isStall ? stats.StallsNumber : stats.DropWindowsNumber) += 1;
+        
+        static const char* const ActionNames[] = {"", "requeuing buffers", "restarting streaming", "reinitializing"};
+        Tracer::Log("Camera %u %s, %s.\n", slot.CameraIdx, isStall ? "stalled" : "drops frames", ActionNames[action]);
         
-          releasedBuffer = httpServer.DequeueBuffer();
+        switch (action) {
+          case StreamWatchdog::RequeueBuffers:
+            stats.RequeuesNumber += 1;
+            break;
+          case StreamWatchdog::RestartStreaming:
+            stats.RestartsNumber += 1;
+            break;
+          default:
+            stats.ReinitsNumber += 1;
+            break;
         }
+        
+        // The drain of the watchdog replaces a pending resize.
+        slot.PendingAction = action;
+        slot.PendingBuffersNumber = 0;
+      }
+      
+      // A broken source is reinitialized by the recovery.
+      if (StreamWatchdog::Reinitialize == slot.PendingAction) {
+        return 0;
+      }
+      
+      // The driver gets all buffers back. Frames which are being sent are copied.
+      if (!RequeueAllFrames(slot, httpServer)) {
+        return std::min(waitTimeMs, DrainWaitTimeMs);
+      }
+      
+      const StreamWatchdog::Action action = slot.PendingAction;
+      slot.PendingAction = StreamWatchdog::NoAction;
+      
+      if (StreamWatchdog::RestartStreaming == action) {
+        // VIDIOC_STREAMOFF and VIDIOC_STREAMON for a camera. Sources which can not 
+        // be paused are reinitialized, a failed one becomes broken.
+        if (!frameSource.Pause() || !frameSource.Resume()) {
+          slot.PendingAction = StreamWatchdog::Reinitialize;
+          return 0;
+        }
+        
+        slot.Watchdog.Reset(Clock::GetMonotonicTimeMs());
+      }
+      
+      return 0;
+    }
+    
+    // @brief Reallocates buffers of a source which wants another number of them. Returns the time to wait.
+    int AdjustBuffers(SourceSlot& slot, HttpServer& httpServer, CaptureStats& stats, int waitTimeMs) {
+      static const int DrainWaitTimeMs = 100;
+      
+      // Clients are not closed for a resize. Frames being sent are copied to the copy pool,
+      // if clients hold mapped frames longer (the pool is exhausted) the resize is postponed.
+      static const uint64_t MaxDrainTimeMs = 1000;
+      static const uint64_t ResizeRetryDelayMs = 60000;
+      
+      FrameSource& frameSource = slot.Source;
+      const uint32_t buffersNumber = frameSource.GetBuffersNumber();
+      const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+      
+      if (0 == slot.PendingBuffersNumber) {
+        if (nowMs < slot.ResizeRetryTimeMs) {
+          return waitTimeMs;
+        }
+        
+        const uint32_t wantedNumber = frameSource.GetWantedBuffersNumber();
+        if (0 == wantedNumber || wantedNumber == buffersNumber) {
+          return waitTimeMs;
+        }
+        
+        slot.PendingBuffersNumber = wantedNumber;
+        slot.ResizeStartMs = nowMs;
+      }
+      
+      // Buffers are unmapped so clients should not use them.
+      std::vector<const VideoBuffer*> buffers;
+      const bool isDrained = httpServer.TryDequeueAllBuffers(buffers, slot.CameraIdx);
+      for (auto buffer : buffers) {
+        frameSource.RequeueFrame(buffer);
+      }
+      
+      if (!isDrained) {
+        if (nowMs - slot.ResizeStartMs < MaxDrainTimeMs) {
+          return std::min(waitTimeMs, DrainWaitTimeMs);
+        }
+        
+        httpServer.CancelDequeueAllBuffers(slot.CameraIdx);
+        
+        Tracer::Log("Camera %u keeps %u buffers: clients hold frames.\n", slot.CameraIdx, buffersNumber);
+        stats.BufferResizeCancelsNumber += 1;
+        slot.PendingBuffersNumber = 0;
+        slot.ResizeRetryTimeMs = nowMs + ResizeRetryDelayMs;
+        
+        return waitTimeMs;
+      }
+      
+      const uint32_t wantedNumber = slot.PendingBuffersNumber;
+      slot.PendingBuffersNumber = 0;
+      
+      const bool isResized = frameSource.ResizeBuffers(wantedNumber);
+      const uint32_t newBuffersNumber = frameSource.GetBuffersNumber();
+      
+      if (isResized && newBuffersNumber != buffersNumber) {
+        (newBuffersNumber > buffersNumber ? stats.BufferGrowsNumber : stats.BufferShrinksNumber) += 1;
+        stats.BuffersNumber -= buffersNumber;
+        stats.BuffersNumber += newBuffersNumber;
+        Tracer::Log("Camera %u uses %u buffers instead of %u.\n", slot.CameraIdx, newBuffersNumber, buffersNumber);
+      }
+      else if (!frameSource.IsBroken()) {
+        // E.g. there is no memory for more buffers and the previous number is restored.
+        // The same resize (and its restart of streaming) is not requested again at once.
+        Tracer::Log("Camera %u keeps %u buffers: failed to allocate %u.\n", slot.CameraIdx, buffersNumber, wantedNumber);
+        stats.BufferResizeCancelsNumber += 1;
+        slot.ResizeRetryTimeMs = nowMs + ResizeRetryDelayMs;
       }
       else {
-        std::vector<const VideoBuffer*> buffers = httpServer.DequeueAllBuffers();
-        for (auto buffer : buffers) {
-          uvcGrabber.RequeueFrame(buffer);
+        // A broken source is reinitialized by the recovery.
+        Tracer::Log("Camera %u failed to use %u buffers.\n", slot.CameraIdx, wantedNumber);
+      }
+      
+      // Streaming was restarted. A broken source is left to the recovery.
+      if (!frameSource.IsBroken()) {
+        slot.Watchdog.Reset(Clock::GetMonotonicTimeMs());
+      }
+      
+      return 0;
+    }
+    
+    // @brief Captures frames of all sources and serves clients in the current thread.
+    void StreamFromSources(std::vector<std::unique_ptr<FrameSource>>& frameSources, HttpServer& httpServer, EventLoop& eventLoop, 
+                           uint32_t onDemandIdleMs, uint32_t stallTimeoutMs, CaptureStats& captureStats, ShouldExit shouldExit) {
+      
+      std::vector<std::unique_ptr<SourceSlot>> slots;
+      for (uint32_t cameraIdx = 0; cameraIdx < frameSources.size(); ++cameraIdx) {
+        FrameSource& frameSource = *frameSources[cameraIdx];
+        if (!frameSource.Init()) {
+          Tracer::Log("Failed to initialize frame source (is there a UVC camera or an upstream server?). The app will try to initialize later.\n");
+        }
+        
+        slots.emplace_back(new SourceSlot(frameSource, cameraIdx, eventLoop, stallTimeoutMs));
+        slots.back()->Watchdog.Reset(Clock::GetMonotonicTimeMs());
+        captureStats.BuffersNumber += frameSource.GetBuffersNumber();
+      }
+      
+      // The loop is woken up by cameras and by clients. The timeout only
+      // limits a delay of reaction on an exit request.
+      static const int WaitTimeMs = 1000;
+      
+      while (!shouldExit()) {
+        
+        for (auto& slot : slots) {
+          FrameSource& frameSource = slot->Source;
+          if (!frameSource.IsReady() || frameSource.IsBroken() || frameSource.IsPaused() ||
+              StreamWatchdog::Reinitialize == slot->PendingAction) {
+            // The camera fd is closed by ReInit() and is not readable while capturing is paused.
+            slot->Watcher.Unwatch();
+            continue;
+          }
+          
+          if (!slot->Watcher.IsWatching() && !slot->Watcher.Watch(frameSource.GetFd())) {
+            Tracer::Log("Failed to watch camera fd.\n");
+            return;
+          }
+          
+          if (slot->Watcher.TakeReady()) {
+            const VideoBuffer* videoBuffer = frameSource.DequeuFrame();
+            while (videoBuffer != nullptr) {
+              captureStats.DroppedFramesNumber += 
+                slot->Watchdog.OnFrame(videoBuffer->V4l2Buffer.sequence, IsDriverStarved(frameSource), Clock::GetMonotonicTimeMs());
+              
+              if (!httpServer.QueueBuffer(videoBuffer, slot->CameraIdx)) {
+                // A source which always has frames (e.g. replaying as fast as possible)
+                // would return the same invalid frame again so the rest waits for the next event.
+                frameSource.RequeueFrame(videoBuffer);
+                break;
+              }
+              
+              if (slot->ResumeTimeUs != 0) {
+                const uint64_t firstFrameMs = (Clock::GetMonotonicTimeUs() - slot->ResumeTimeUs) / 1000U;
+                captureStats.LastFirstFrameMs = firstFrameMs;
+                captureStats.MaxFirstFrameMs = std::max<uint64_t>(captureStats.MaxFirstFrameMs, firstFrameMs);
+                slot->ResumeTimeUs = 0;
+                
+                Tracer::Log("Capturing is resumed, the first frame in %u ms.\n", static_cast<uint32_t>(firstFrameMs));
+              }
+              
+              videoBuffer = frameSource.DequeuFrame();
+            }
+          }
+        }
+        
+        // Idle connections are closed meanwhile broken cameras are recovered.
+        httpServer.ServeRequests();
+        
+        int waitTimeMs = WaitTimeMs;
+        
+        for (auto& slot : slots) {
+          FrameSource& frameSource = slot->Source;
+          
+          if (frameSource.IsReady() && !frameSource.IsBroken() && StreamWatchdog::Reinitialize != slot->PendingAction) {
+            const VideoBuffer* releasedBuffer = httpServer.DequeueBuffer(slot->CameraIdx);
+            while (releasedBuffer != nullptr) {
+              frameSource.RequeueFrame(releasedBuffer);
+            
+              releasedBuffer = httpServer.DequeueBuffer(slot->CameraIdx);
+            }
+            
+            if (onDemandIdleMs != 0 && StreamWatchdog::NoAction == slot->PendingAction && 0 == slot->PendingBuffersNumber) {
+              waitTimeMs = CaptureOnDemand(*slot, httpServer, onDemandIdleMs, captureStats, waitTimeMs);
+            }
+            
+            // Replayed and relayed frames can pause legitimately, only cameras are watched.
+            if (stallTimeoutMs != 0 && !frameSource.IsPaused() && slot->IsDevice) {
+              waitTimeMs = WatchSource(*slot, httpServer, captureStats, waitTimeMs);
+            }
+            
+            if (!frameSource.IsPaused() && StreamWatchdog::NoAction == slot->PendingAction) {
+              waitTimeMs = AdjustBuffers(*slot, httpServer, captureStats, waitTimeMs);
+            }
+            
+            continue;
+          }
+          
+          // Clients and other cameras are served meanwhile.
+          waitTimeMs = RecoverSource(*slot, httpServer, captureStats, waitTimeMs);
+        }
+        
+        // Accept connections, read requests, send pending data and wait for next frames.
+        eventLoop.Wait(waitTimeMs);
+      }
+    }
+    
+    // @brief Serves clients in the current thread while frames are captured by CaptureThread of every source.
+    void StreamFromCaptureThreads(std::vector<std::unique_ptr<CaptureThread>>& captureThreads, HttpServer& httpServer, EventLoop& eventLoop, ShouldExit shouldExit) {
+      
+      for (auto& captureThread : captureThreads) {
+        if (!captureThread->Start(&eventLoop)) {
+          Tracer::Log("Failed to start capture thread.\n");
+          return;
         }
+      }
+      
+      // Capture threads wake the loop up when a frame is captured and
+      // sender threads wake it up when a frame is released.
+      static const int WaitTimeMs = 1000;
+      
+      std::vector<bool> isDraining(captureThreads.size(), false);
+      
+      while (!shouldExit()) {
         
-        // Repeat recovery attempts every second.
-        const timespec RecoveryDelay {1, 0};
-        ::nanosleep(&RecoveryDelay, nullptr);
+        for (uint32_t cameraIdx = 0; cameraIdx < captureThreads.size(); ++cameraIdx) {
+          CaptureThread& captureThread = *captureThreads[cameraIdx];
+          
+          if (!captureThread.IsBroken()) {
+            // Frames are selected again if the camera is back before the drain is finished.
+            if (isDraining[cameraIdx]) {
+              httpServer.CancelDequeueAllBuffers(cameraIdx);
+              isDraining[cameraIdx] = false;
+            }
+            
+            const VideoBuffer* videoBuffer = captureThread.DequeuFrame();
+            while (videoBuffer != nullptr) {
+              if (!httpServer.QueueBuffer(videoBuffer, cameraIdx)) {
+                captureThread.RequeueFrame(videoBuffer);
+              }
+              
+              videoBuffer = captureThread.DequeuFrame();
+            }
+          }
+          else {
+            // Return all frames so the capture thread can recover the camera.
+            const VideoBuffer* videoBuffer = captureThread.DequeuFrame();
+            while (videoBuffer != nullptr) {
+              captureThread.RequeueFrame(videoBuffer);
+              videoBuffer = captureThread.DequeuFrame();
+            }
+            
+            // Clients are not closed, the drain is repeated on every pass till they send their frames.
+            std::vector<const VideoBuffer*> buffers;
+            isDraining[cameraIdx] = !httpServer.TryDequeueAllBuffers(buffers, cameraIdx);
+            for (auto buffer : buffers) {
+              captureThread.RequeueFrame(buffer);
+            }
+          }
+        }
+        
+        // Keep serving connections while broken cameras are being recovered.
+        httpServer.ServeRequests();
         
-        uvcGrabber.ReInit();
+        // Frames replaced by the queued ones are returned before waiting as 
+        // the capture thread may wait for a free buffer (e.g. replaying as fast as possible).
+        for (uint32_t cameraIdx = 0; cameraIdx < captureThreads.size(); ++cameraIdx) {
+          const VideoBuffer* releasedBuffer = httpServer.DequeueBuffer(cameraIdx);
+          while (releasedBuffer != nullptr) {
+            captureThreads[cameraIdx]->RequeueFrame(releasedBuffer);
+          
+            releasedBuffer = httpServer.DequeueBuffer(cameraIdx);
+          }
+        }
+        
+        eventLoop.Wait(WaitTimeMs);
+      }
+      
+      httpServer.Shutdown();
+      for (auto& captureThread : captureThreads) {
+        captureThread->Stop();
+      }
+    }
+    
+  }
+  
+  int StreamFunc(const UvcStreamerCfg& config, ShouldExit shouldExit) {
+    
+    EventLoop eventLoop;
+    if (!eventLoop.Init()) {
+      Tracer::Log("Failed to initialize event loop.\n");
+      return -2;
+    }
+    
+    // Counters are kept till the server is destroyed as "/stats" reads them.
+    CaptureStats captureStats = {{0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}, {0}};
+    
+    HttpServer::Config serverCfg = config.ServerCfg;
+    if (!config.UseCaptureThread) {
+      serverCfg.GetSourceStatsText = [&captureStats]() { return captureStats.GetText(); };
+    }
+    
+    HttpServer httpServer(eventLoop);
+    if (!httpServer.Init(serverCfg)) {
+      Tracer::Log("Failed to initialize HTTP server.\n");
+      return -2;
+    }
+    
+    // Frames are received from an upstream server, replayed or captured by UVC video cameras.
+    std::vector<std::unique_ptr<FrameSource>> frameSources;
+    if (!config.RelayCfg.Url.empty()) {
+      frameSources.emplace_back(new RelaySource(config.RelayCfg));
+    }
+    else if (!config.ReplayCfg.Path.empty()) {
+      frameSources.emplace_back(new ReplaySource(config.ReplayCfg));
+    }
+    else if (!config.CamerasCfg.empty()) {
+      for (const CameraCfg& cameraCfg : config.CamerasCfg) {
+        frameSources.emplace_back(new UvcGrabber(cameraCfg.GrabberCfg));
       }
     }
+    else {
+      frameSources.emplace_back(new UvcGrabber(config.GrabberCfg));
+    }
+    
+    if (config.UseCaptureThread) {
+      std::vector<std::unique_ptr<CaptureThread>> captureThreads;
+      for (auto& frameSource : frameSources) {
+        captureThreads.emplace_back(new CaptureThread(*frameSource, config.GrabberCfg.BuffersNumber));
+        if (!captureThreads.back()) {
+          Tracer::Log("Failed to allocate capture thread.\n");
+          httpServer.Shutdown();
+          return -3;
+        }
+      }
+      
+      StreamFromCaptureThreads(captureThreads, httpServer, eventLoop, shouldExit);
+    }
+    else {
+      StreamFromSources(frameSources, httpServer, eventLoop, config.OnDemandIdleMs, config.StallTimeoutMs, captureStats, shouldExit);
+    }
+    
+    // Buffers must not be used by HttpServer after they are unmapped or freed by the source.
+    httpServer.Shutdown();
     
     return 0;
   }
@@ -0,0 +1,124 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "StreamWatchdog.h"
+
+namespace {
+  // Drops are evaluated in windows. A window with more than MaxDropPercent of
+  // frames dropped is a problem, a window without problems resets the escalation.
+  const uint64_t WindowMs = 5000;
+  const uint32_t MaxDropPercent = 50;
+  
+  // A larger gap means that the sequence was restarted (e.g. by STREAMON).
+  const uint32_t MaxSequenceGap = 1000;
+}
+
+StreamWatchdog::StreamWatchdog(uint32_t stallTimeoutMs)
+  : _stallTimeoutMs(stallTimeoutMs),
+    _lastFrameMs(0),
+    _hasSequence(false),
+    _lastSequence(0),
+    _windowStartMs(0),
+    _windowFramesNumber(0),
+    _windowDropsNumber(0),
+    _lastAction(NoAction),
+    _lastProblem(NoProblem)
+{
+}
+
+void StreamWatchdog::Reset(uint64_t nowMs)
+{
+  _lastFrameMs = nowMs;
+  _hasSequence = false;
+  _windowStartMs = nowMs;
+  _windowFramesNumber = 0;
+  _windowDropsNumber = 0;
+}
+
+uint32_t StreamWatchdog::OnFrame(uint32_t sequence, bool isDriverStarved, uint64_t nowMs)
+{
+  uint32_t droppedFramesNumber = 0;
+  
+  const uint32_t gap = sequence - _lastSequence;
+  if (_hasSequence && gap > 1 && gap <= MaxSequenceGap) {
+    droppedFramesNumber = gap - 1;
+  }
+  
+  _hasSequence = true;
+  _lastSequence = sequence;
+  _lastFrameMs = nowMs;
+  
+  _windowFramesNumber += 1;
+  
+  if (!isDriverStarved) {
+    _windowDropsNumber += droppedFramesNumber;
+  }
+  
+  return droppedFramesNumber;
+}
+
+StreamWatchdog::Action StreamWatchdog::Check(bool isDriverStarved, uint64_t nowMs)
+{
+  Problem problem = NoProblem;
+  
+  if (isDriverStarved) {
+    _lastFrameMs = nowMs;
+  }
+  else if (nowMs - _lastFrameMs >= _stallTimeoutMs) {
+    problem = Stall;
+  }
+  
+  if (nowMs - _windowStartMs >= WindowMs) {
+    const uint32_t totalFramesNumber = _windowFramesNumber + _windowDropsNumber;
+    if (NoProblem == problem && _windowDropsNumber * 100ULL > totalFramesNumber * static_cast<uint64_t>(MaxDropPercent)) {
+      problem = Drops;
+    }
+    
+    if (NoProblem == problem) {
+      _lastAction = NoAction;
+    }
+    
+    _windowStartMs = nowMs;
+    _windowFramesNumber = 0;
+    _windowDropsNumber = 0;
+  }
+  
+  if (NoProblem == problem) {
+    return NoAction;
+  }
+  
+  _lastProblem = problem;
+  _lastFrameMs = nowMs;
+  
+  if (_lastAction != Reinitialize) {
+    _lastAction = static_cast<Action>(_lastAction + 1);
+  }
+  
+  return _lastAction;
+}
+
+uint64_t StreamWatchdog::GetNextCheckMs() const
+{
+  const uint64_t stallMs = _lastFrameMs + _stallTimeoutMs;
+  const uint64_t windowEndMs = _windowStartMs + WindowMs;
+  
+  return stallMs < windowEndMs ? stallMs : windowEndMs;
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef STREAMWATCHDOG_H
+#define STREAMWATCHDOG_H
+
+#include <cstdint>
+
+/*
+ * @brief StreamWatchdog detects a source which keeps its fd healthy but stops 
+ *        delivering frames (no frame for StallTimeoutMs) or drops most of them 
+ *        (gaps of sequence numbers in a window). Every detection escalates 
+ *        the recovery action: requeue all buffers, restart streaming and then 
+ *        reinitialize the source. A window without problems resets the escalation.
+ *        Drops and pauses of a driver without free buffers (clients hold them) 
+ *        are not problems of the source.
+ *        It only keeps the state, the owner performs actions.
+ * 
+ * */
+class StreamWatchdog
+{
+public:
+  
+  enum Action {
+    NoAction,
+    RequeueBuffers,
+    RestartStreaming,
+    Reinitialize
+  };
+  
+  // Detected problem of the last action.
+  enum Problem {
+    NoProblem,
+    Stall,
+    Drops
+  };
+  
+  explicit StreamWatchdog(uint32_t stallTimeoutMs);
+  
+  // @brief Restarts monitoring (e.g. after the source is initialized or resumed). The escalation is kept.
+  void Reset(uint64_t nowMs);
+  
+  // @brief Registers a frame. Returns the number of frames dropped before it. 
+  //        IsDriverStarved tells that the driver had (almost) no buffers to fill.
+  uint32_t OnFrame(uint32_t sequence, bool isDriverStarved, uint64_t nowMs);
+  
+  // @brief Returns an action if a problem was detected. The next stall is detected 
+  //        StallTimeoutMs later so the action has time to help. A starved driver
+  //        is not stalled, the stall timeout starts when it gets buffers back.
+  Action Check(bool isDriverStarved, uint64_t nowMs);
+  
+  Problem GetLastProblem() const { return _lastProblem; }
+  
+  // @brief Returns the time of the next check which can detect a problem.
+  uint64_t GetNextCheckMs() const;
+  
+private:
+  
+  uint32_t _stallTimeoutMs;
+  
+  uint64_t _lastFrameMs;
+  bool _hasSequence;
+  uint32_t _lastSequence;
+  
+  // Frames and drops of the current window.
+  uint64_t _windowStartMs;
+  uint32_t _windowFramesNumber;
+  uint32_t _windowDropsNumber;
+  
+  Action _lastAction;
+  Problem _lastProblem;
+};
+
+#endif // STREAMWATCHDOG_H
@@ -35,9 +35,17 @@
 
 #include "Tracer.h"
 #include "Buffer.h"
+#include "Clock.h"
 
 static const uint32_t IoctlMaxTries = 5U;
 
+// The camera fd is non-blocking and is polled for readiness so
+// EAGAIN from VIDIOC_DQBUF means that there is no ready frame.
+static const uint32_t DequeueIoctlMaxTries = 1U;
+
+// Estimated size of MJPEG data per pixel (a typical scene is compressed to 1.5-2 bits).
+static const uint64_t MjpegBitsPerPixel = 2U;
+
 namespace 
 {
   // @brief Executes ioctl and if it fails then try to repeat.
@@ -46,6 +54,19 @@ namespace
 
   // @brief Configures camera according to a given configuration except V4L buffers.
   bool SetupCamera(int cameraFd, const UvcGrabber::Config& config);
+  
+  struct CaptureMode {
+    uint32_t Width;
+    uint32_t Height;
+    v4l2_fract Interval;
+  };
+  
+  // @brief Returns MJPEG modes of the camera (VIDIOC_ENUM_FRAMESIZES and VIDIOC_ENUM_FRAMEINTERVALS). 
+  //        Stepwise ranges are represented by their bounds and by the requested values.
+  std::vector<CaptureMode> EnumerateModes(int cameraFd, const UvcGrabber::Config& config);
+  
+  // @brief Selects the best mode for a given configuration. Returns false if there are no modes.
+  bool SelectMode(const std::vector<CaptureMode>& modes, const UvcGrabber::Config& config, CaptureMode& mode);
 
   // @brief Allocates and maps V4L buffers for a given camera file descriptor.
   std::vector<VideoBuffer> SetupBuffers(int cameraFd, uint32_t buffersNumber);
@@ -57,8 +78,15 @@ namespace
 UvcGrabber::UvcGrabber(const UvcGrabber::Config& config)
   : _config(config),
     _cameraFd(-1),
-    _isBroken(false)
+    _isBroken(false),
+    _isPaused(false),
+    _buffersNumber(config.BuffersNumber),
+    _dequeuedNumber(0),
+    _bufferSizer(config.MinBuffersNumber, config.MaxBuffersNumber)
 {
+  if (_bufferSizer.IsEnabled()) {
+    _buffersNumber = _bufferSizer.ClampNumber(_buffersNumber);
+  }
 }
 
 UvcGrabber::~UvcGrabber()
@@ -83,7 +111,7 @@ bool UvcGrabber::Init()
     return false;
   }
   
-  std::vector<VideoBuffer> videoBuffers = SetupBuffers(cameraFd, _config.BuffersNumber);
+  std::vector<VideoBuffer> videoBuffers = SetupBuffers(cameraFd, _buffersNumber);
   if (videoBuffers.empty()) {
     Tracer::Log("Failed SetupBuffers().\n");
     ::close(cameraFd);
@@ -102,6 +130,10 @@ bool UvcGrabber::Init()
   _cameraFd = cameraFd;
   _videoBuffers.swap(videoBuffers);
   
+  _dequeuedNumber = 0;
+  _dequeueTimesMs.assign(_videoBuffers.size(), 0);
+  _bufferSizer.Reset(Clock::GetMonotonicTimeMs());
+  
   return true;
 }
     
@@ -128,6 +160,7 @@ void UvcGrabber::Shutdown()
   }
   
   _isBroken = false;
+  _isPaused = false;
 }
 
 const VideoBuffer* UvcGrabber::DequeuFrame()
@@ -137,11 +170,16 @@ const VideoBuffer* UvcGrabber::DequeuFrame()
     return nullptr;
   }
   
+  // VIDIOC_DQBUF fails when streaming is off.
+  if (_isPaused) {
+    return nullptr;
+  }
+  
   v4l2_buffer v4l2Buffer = {0};
   v4l2Buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   v4l2Buffer.memory = V4L2_MEMORY_MMAP;
   
-  int ioctlResult = Ioctl(_cameraFd, VIDIOC_DQBUF, IoctlMaxTries, &v4l2Buffer);
+  int ioctlResult = Ioctl(_cameraFd, VIDIOC_DQBUF, DequeueIoctlMaxTries, &v4l2Buffer);
   if (ioctlResult != 0) {
     if (errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
       Tracer::Log("Failed Ioctl(VIDIOC_DQBUF) %d.\n", errno);
@@ -167,6 +205,11 @@ const VideoBuffer* UvcGrabber::DequeuFrame()
   _videoBuffers[v4l2Buffer.index].Size = v4l2Buffer.bytesused;
   _videoBuffers[v4l2Buffer.index].V4l2Buffer = v4l2Buffer;
   
+  const uint64_t nowMs = Clock::GetMonotonicTimeMs();
+  _dequeuedNumber += 1;
+  _dequeueTimesMs[v4l2Buffer.index] = nowMs;
+  _bufferSizer.OnDequeue(v4l2Buffer.sequence, _dequeuedNumber, nowMs);
+  
   return &(_videoBuffers[v4l2Buffer.index]);
 }
 
@@ -178,6 +221,12 @@ void UvcGrabber::RequeueFrame(const VideoBuffer* videoBuffer)
   }
   
   VideoBuffer& origVideoBuffer = _videoBuffers[videoBuffer->Idx];
+  
+  if (_dequeuedNumber != 0) {
+    _dequeuedNumber -= 1;
+  }
+  
+  _bufferSizer.OnRequeue(Clock::GetMonotonicTimeMs() - _dequeueTimesMs[videoBuffer->Idx]);
 
   int ioctlResult = Ioctl(_cameraFd, VIDIOC_QBUF, IoctlMaxTries, &(origVideoBuffer.V4l2Buffer));
   if (ioctlResult < 0) {
@@ -186,6 +235,118 @@ void UvcGrabber::RequeueFrame(const VideoBuffer* videoBuffer)
   }
 }
 
+bool UvcGrabber::Pause()
+{
+  if (-1 == _cameraFd || _isBroken || _isPaused) {
+    return false;
+  }
+  
+  // All buffers are removed from the driver's queues.
+  int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  int ioctlResult = Ioctl(_cameraFd, VIDIOC_STREAMOFF, IoctlMaxTries, &type);
+  if (ioctlResult != 0) {
+    Tracer::Log("Failed Ioctl(VIDIOC_STREAMOFF).\n");
+    _isBroken = true;
+    return false;
+  }
+  
+  _isPaused = true;
+  
+  return true;
+}
+
+bool UvcGrabber::Resume()
+{
+  if (-1 == _cameraFd || _isBroken || !_isPaused) {
+    return false;
+  }
+  
+  for (const VideoBuffer& videoBuffer : _videoBuffers) {
+    v4l2_buffer v4l2Buffer = {0};
+    v4l2Buffer.index = videoBuffer.Idx;
+    v4l2Buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    v4l2Buffer.memory = V4L2_MEMORY_MMAP;
+    
+    int ioctlResult = Ioctl(_cameraFd, VIDIOC_QBUF, IoctlMaxTries, &v4l2Buffer);
+    if (ioctlResult != 0) {
+      Tracer::Log("Failed Ioctl(VIDIOC_QBUF).\n");
+      _isBroken = true;
+      return false;
+    }
+  }
+  
+  int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  int ioctlResult = Ioctl(_cameraFd, VIDIOC_STREAMON, IoctlMaxTries, &type);
+  if (ioctlResult != 0) {
+    Tracer::Log("Failed Ioctl(VIDIOC_STREAMON).\n");
+    _isBroken = true;
+    return false;
+  }
+  
+  _isPaused = false;
+  _dequeuedNumber = 0;
+  _bufferSizer.Reset(Clock::GetMonotonicTimeMs());
+  
+  return true;
+}
+
+uint32_t UvcGrabber::GetWantedBuffersNumber()
+{
+  if (!_bufferSizer.IsEnabled() || -1 == _cameraFd || _isBroken || _isPaused) {
+    return 0;
+  }
+  
+  return _bufferSizer.GetWantedNumber(_buffersNumber, Clock::GetMonotonicTimeMs());
+}
+
+bool UvcGrabber::ResizeBuffers(uint32_t buffersNumber)
+{
+  if (-1 == _cameraFd || _isBroken || _isPaused) {
+    return false;
+  }
+  
+  // Buffers can be freed only when streaming is off.
+  int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  int ioctlResult = Ioctl(_cameraFd, VIDIOC_STREAMOFF, IoctlMaxTries, &type);
+  if (ioctlResult != 0) {
+    Tracer::Log("Failed Ioctl(VIDIOC_STREAMOFF).\n");
+    _isBroken = true;
+    return false;
+  }
+  
+  const uint32_t prevBuffersNumber = _videoBuffers.size();
+  FreeBuffers(_cameraFd, _videoBuffers);
+  
+  std::vector<VideoBuffer> videoBuffers = SetupBuffers(_cameraFd, buffersNumber);
+  if (videoBuffers.empty()) {
+    // E.g. there is no memory for more buffers. The previous number is restored.
+    Tracer::Log("Failed SetupBuffers(%u).\n", buffersNumber);
+    videoBuffers = SetupBuffers(_cameraFd, prevBuffersNumber);
+    if (videoBuffers.empty()) {
+      Tracer::Log("Failed SetupBuffers().\n");
+      _isBroken = true;
+      return false;
+    }
+  }
+  
+  ioctlResult = Ioctl(_cameraFd, VIDIOC_STREAMON, IoctlMaxTries, &type);
+  if (ioctlResult != 0) {
+    Tracer::Log("Failed Ioctl(VIDIOC_STREAMON).\n");
+    FreeBuffers(_cameraFd, videoBuffers);
+    _isBroken = true;
+    return false;
+  }
+  
+  _videoBuffers.swap(videoBuffers);
+  _buffersNumber = _videoBuffers.size();
+  
+  _dequeuedNumber = 0;
+  _dequeueTimesMs.assign(_videoBuffers.size(), 0);
+  _bufferSizer.Reset(Clock::GetMonotonicTimeMs());
+  
+  return true;
+}
+
 namespace 
 {
   // @brief Executes ioctl and if it fails then try to repeat.
@@ -282,6 +443,188 @@ namespace
     return videoBuffers;
   }
 
+  bool IsMjpegSupported(int cameraFd)
+  {
+    v4l2_fmtdesc formatDesc = {0};
+    formatDesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    
+    while (0 == Ioctl(cameraFd, VIDIOC_ENUM_FMT, IoctlMaxTries, &formatDesc)) {
+      if (V4L2_PIX_FMT_MJPEG == formatDesc.pixelformat) {
+        return true;
+      }
+      
+      formatDesc.index += 1;
+    }
+    
+    return false;
+  }
+  
+  uint32_t ClampToStep(uint32_t value, uint32_t minValue, uint32_t maxValue, uint32_t step)
+  {
+    if (value <= minValue) {
+      return minValue;
+    }
+    
+    if (value >= maxValue) {
+      return maxValue;
+    }
+    
+    return (step > 1) ? minValue + (value - minValue) / step * step : value;
+  }
+  
+  void AddIntervals(int cameraFd, uint32_t width, uint32_t height, 
+                    const UvcGrabber::Config& config, std::vector<CaptureMode>& modes)
+  {
+    v4l2_frmivalenum intervalEnum = {0};
+    intervalEnum.pixel_format = V4L2_PIX_FMT_MJPEG;
+    intervalEnum.width = width;
+    intervalEnum.height = height;
+    
+    while (0 == Ioctl(cameraFd, VIDIOC_ENUM_FRAMEINTERVALS, IoctlMaxTries, &intervalEnum)) {
+      if (V4L2_FRMIVAL_TYPE_DISCRETE == intervalEnum.type) {
+        modes.push_back(CaptureMode {width, height, intervalEnum.discrete});
+        intervalEnum.index += 1;
+        continue;
+      }
+      
+      // The shortest interval, the longest one and the requested one if it is in the range.
+      const v4l2_fract& minInterval = intervalEnum.stepwise.min;
+      const v4l2_fract& maxInterval = intervalEnum.stepwise.max;
+      modes.push_back(CaptureMode {width, height, minInterval});
+      modes.push_back(CaptureMode {width, height, maxInterval});
+      
+      const uint64_t frameRate = config.FrameRate;
+      if (frameRate * minInterval.numerator <= minInterval.denominator && 
+          frameRate * maxInterval.numerator >= maxInterval.denominator) {
+        modes.push_back(CaptureMode {width, height, v4l2_fract {1U, config.FrameRate}});
+      }
+      
+      return;
+    }
+    
+    // Some drivers do not enumerate intervals, the camera decides.
+    if (0 == intervalEnum.index) {
+      modes.push_back(CaptureMode {width, height, v4l2_fract {1U, config.FrameRate}});
+    }
+  }
+  
+  std::vector<CaptureMode> EnumerateModes(int cameraFd, const UvcGrabber::Config& config)
+  {
+    std::vector<CaptureMode> modes;
+    
+    v4l2_frmsizeenum sizeEnum = {0};
+    sizeEnum.pixel_format = V4L2_PIX_FMT_MJPEG;
+    
+    while (0 == Ioctl(cameraFd, VIDIOC_ENUM_FRAMESIZES, IoctlMaxTries, &sizeEnum)) {
+      if (V4L2_FRMSIZE_TYPE_DISCRETE == sizeEnum.type) {
+        AddIntervals(cameraFd, sizeEnum.discrete.width, sizeEnum.discrete.height, config, modes);
+        sizeEnum.index += 1;
+        continue;
+      }
+      
+      // The largest size and the requested one fitted to the range.
+      const v4l2_frmsize_stepwise& stepwise = sizeEnum.stepwise;
+      AddIntervals(cameraFd, stepwise.max_width, stepwise.max_height, config, modes);
+      
+      const uint32_t width = ClampToStep(config.FrameWidth, stepwise.min_width, stepwise.max_width, stepwise.step_width);
+      const uint32_t height = ClampToStep(config.FrameHeight, stepwise.min_height, stepwise.max_height, stepwise.step_height);
+      if (width != stepwise.max_width || height != stepwise.max_height) {
+        AddIntervals(cameraFd, width, height, config, modes);
+      }
+      
+      break;
+    }
+    
+    return modes;
+  }
+  
+  bool SelectMode(const std::vector<CaptureMode>& modes, const UvcGrabber::Config& config, CaptureMode& mode)
+  {
+    // Preferred: the largest size with the requested frame rate (the lowest frame rate which is not less).
+    // Then: the largest size with the highest frame rate. At last (no mode fits the bandwidth and 
+    // size limits): the mode with the lowest data rate, it is logged as the limits are broken.
+    const CaptureMode* bestMode = nullptr;
+    const CaptureMode* fallbackMode = nullptr;
+    const CaptureMode* minRateMode = nullptr;
+    
+    uint64_t bestArea = 0;
+    uint64_t fallbackArea = 0;
+    uint64_t minBitRate = UINT64_MAX;
+    
+    for (const CaptureMode& candidate : modes) {
+      const v4l2_fract& interval = candidate.Interval;
+      if (0 == interval.numerator || 0 == interval.denominator) {
+        continue;
+      }
+      
+      const uint64_t area = static_cast<uint64_t>(candidate.Width) * candidate.Height;
+      const uint64_t bitRate = area * MjpegBitsPerPixel * interval.denominator / interval.numerator;
+      
+      if (bitRate < minBitRate) {
+        minBitRate = bitRate;
+        minRateMode = &candidate;
+      }
+      
+      if (config.MaxBandwidthKBps != 0 && bitRate > config.MaxBandwidthKBps * 8ULL * 1024ULL) {
+        continue;
+      }
+      
+      if (!config.AutoMode && (candidate.Width > config.FrameWidth || candidate.Height > config.FrameHeight)) {
+        continue;
+      }
+      
+      // Interval a/b gives at least FrameRate fps if b >= FrameRate * a.
+      const bool hasFrameRate = interval.denominator >= static_cast<uint64_t>(config.FrameRate) * interval.numerator;
+      if (hasFrameRate) {
+        const bool isSlower = (bestMode != nullptr) && 
+          static_cast<uint64_t>(interval.numerator) * bestMode->Interval.denominator > 
+          static_cast<uint64_t>(bestMode->Interval.numerator) * interval.denominator;
+        
+        if (area > bestArea || (area == bestArea && isSlower)) {
+          bestArea = area;
+          bestMode = &candidate;
+        }
+      }
+      else {
+        const bool isFaster = (fallbackMode != nullptr) && 
+          static_cast<uint64_t>(interval.numerator) * fallbackMode->Interval.denominator < 
+          static_cast<uint64_t>(fallbackMode->Interval.numerator) * interval.denominator;
+        
+        const bool isSameRate = (fallbackMode != nullptr) && 
+          static_cast<uint64_t>(interval.numerator) * fallbackMode->Interval.denominator == 
+          static_cast<uint64_t>(fallbackMode->Interval.numerator) * interval.denominator;
+        
+        if (nullptr == fallbackMode || isFaster || (isSameRate && area > fallbackArea)) {
+          fallbackArea = area;
+          fallbackMode = &candidate;
+        }
+      }
+    }
+    
+    const CaptureMode* selectedMode = (bestMode != nullptr) ? bestMode : 
+                                      (fallbackMode != nullptr) ? fallbackMode : minRateMode;
+    if (nullptr == selectedMode) {
+      return false;
+    }
+    
+    if (nullptr == bestMode && nullptr == fallbackMode) {
+      if (config.AutoMode) {
+        Tracer::Log("No capture mode fits %u KB/s, the lowest data rate %ux%u at %u/%u s is used.\n",
+                    config.MaxBandwidthKBps, selectedMode->Width, selectedMode->Height, 
+                    selectedMode->Interval.numerator, selectedMode->Interval.denominator);
+      }
+      else {
+        Tracer::Log("No capture mode fits %ux%u and %u KB/s (zero - no limit), the lowest data rate %ux%u at %u/%u s is used.\n",
+                    config.FrameWidth, config.FrameHeight, config.MaxBandwidthKBps, selectedMode->Width, selectedMode->Height, 
+                    selectedMode->Interval.numerator, selectedMode->Interval.denominator);
+      }
+    }
+    
+    mode = *selectedMode;
+    
+    return true;
+  }
+  
   bool SetupCamera(int cameraFd, const UvcGrabber::Config& config) 
   {
     v4l2_capability cameraCaps = {0};
@@ -301,10 +644,21 @@ namespace
       return false;
     }
 
+    if (!IsMjpegSupported(cameraFd)) {
+      Tracer::Log("Error: device does not support MJPEG.\n");
+      return false;
+    }
+    
+    // Drivers which do not enumerate modes get the requested one.
+    CaptureMode mode = {config.FrameWidth, config.FrameHeight, v4l2_fract {1U, config.FrameRate}};
+    if (!SelectMode(EnumerateModes(cameraFd, config), config, mode)) {
+      Tracer::Log("Capture modes are not enumerated, requested mode is used.\n");
+    }
+
     v4l2_format streamFormat = {0};
     streamFormat.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    streamFormat.fmt.pix.width = config.FrameWidth;
-    streamFormat.fmt.pix.height = config.FrameHeight;  
+    streamFormat.fmt.pix.width = mode.Width;
+    streamFormat.fmt.pix.height = mode.Height;  
     streamFormat.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;  
     streamFormat.fmt.pix.field = V4L2_FIELD_ANY;  
     ioctlResult = Ioctl(cameraFd, VIDIOC_S_FMT, IoctlMaxTries, &streamFormat);
@@ -313,7 +667,17 @@ namespace
       return false;
     }
 
-    // TODO: Check if output format is same as input.
+    // The driver adjusts the format to the nearest supported one.
+    if (streamFormat.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG) {
+      Tracer::Log("Error: device did not accept MJPEG format.\n");
+      return false;
+    }
+    
+    if (streamFormat.fmt.pix.width != mode.Width || streamFormat.fmt.pix.height != mode.Height) {
+      Tracer::Log("Device adjusted frame size %ux%u to %ux%u.\n", 
+                  mode.Width, mode.Height, streamFormat.fmt.pix.width, streamFormat.fmt.pix.height);
+    }
+
     {
       v4l2_streamparm streamParm = {0};
       streamParm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -327,13 +691,21 @@ namespace
     {
       v4l2_streamparm streamParm = {0};
       streamParm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      streamParm.parm.capture.timeperframe.numerator = 1;
-      streamParm.parm.capture.timeperframe.denominator = config.FrameRate;
+      streamParm.parm.capture.timeperframe = mode.Interval;
       ioctlResult = Ioctl(cameraFd, VIDIOC_S_PARM, IoctlMaxTries, &streamParm);
       if (ioctlResult < 0) {
         Tracer::Log("Failed Ioctl(VIDIOC_S_PARM + V4L2_BUF_TYPE_VIDEO_CAPTURE), error: %d\n", ioctlResult);
         return false;
       }
+      
+      // The driver returns the interval it uses.
+      const v4l2_fract& interval = streamParm.parm.capture.timeperframe;
+      const double frameRate = (interval.numerator != 0) ? 
+        static_cast<double>(interval.denominator) / interval.numerator : 0.0;
+      
+      Tracer::Log("Capture mode %ux%u MJPEG at %.2f fps (requested %ux%u at %u fps).\n", 
+                  streamFormat.fmt.pix.width, streamFormat.fmt.pix.height, frameRate,
+                  config.FrameWidth, config.FrameHeight, config.FrameRate);
     }
 
     if (config.SetupCamera != nullptr && !config.SetupCamera(cameraFd)) {
@@ -25,6 +25,9 @@
 #include <string>
 #include <vector>
 
+#include "FrameSource.h"
+#include "BufferSizer.h"
+
 struct VideoBuffer;
 
 
@@ -32,7 +35,7 @@ struct VideoBuffer;
  * @brief UvcGrabber captures data from UVC camera device.
  * 
  * */
-class UvcGrabber
+class UvcGrabber : public FrameSource
 {
 public:
   
@@ -44,6 +47,18 @@ public:
     uint32_t FrameHeight;
     uint32_t FrameRate; 
     uint32_t BuffersNumber;
+    
+    // BuffersNumber is adjusted within these bounds (see BufferSizer) if they differ.
+    uint32_t MinBuffersNumber;
+    uint32_t MaxBuffersNumber;
+    
+    // The capture mode is selected from modes supported by the camera. By default the 
+    // largest one which fits FrameWidth x FrameHeight and gives at least FrameRate fps.
+    // With AutoMode the size is not limited, the largest mode with FrameRate fps is used.
+    bool AutoMode;
+    
+    // Modes which would produce more data are not used. Zero means no limit.
+    uint32_t MaxBandwidthKBps;
 
     // Function which is called for app specific camera configuration.
     SetupCameraFunc SetupCamera;
@@ -53,24 +68,47 @@ public:
   ~UvcGrabber();
   
   // @brief Initializes video capture. Returns true if initialization was successfull.
-  bool Init();
+  bool Init() override;
   
   // @brief ReInitializes video capture. Returns true if initialization was successfull.
-  bool ReInit();
+  bool ReInit() override;
   
   // @brief Shutdowns video capture and free all used resources.
-  void Shutdown();
+  void Shutdown() override;
 
   // @brief Return true if fatal error happened during dequeuing/requeing of frames
   //        Expected recovery steps: requeu all dequed frames, call Shutdown() and then Init().
-  bool IsBroken() const { return _isBroken; }
+  bool IsBroken() const override { return _isBroken; }
 
   // @brief Return true if camera was successfully initialized.
-  bool IsCameraReady() const { return _cameraFd != -1; }
+  bool IsReady() const override { return _cameraFd != -1; }
+  
+  // @brief Returns file descriptor of the camera (it becomes readable when a frame is ready) or -1.
+  int GetFd() const override { return _cameraFd; }
 
-  const VideoBuffer* DequeuFrame();
+  const VideoBuffer* DequeuFrame() override;
 
-  void RequeueFrame(const VideoBuffer* buffer);
+  void RequeueFrame(const VideoBuffer* buffer) override;
+  
+  // @brief Stops streaming (VIDIOC_STREAMOFF). The device is kept open and buffers
+  //        are kept mapped so capturing is restarted without setting the camera up.
+  bool Pause() override;
+  
+  // @brief Queues all buffers and starts streaming again.
+  bool Resume() override;
+  
+  bool IsPaused() const override { return _isPaused; }
+  
+  std::string GetDevicePath() const override { return _config.CameraDeviceName; }
+  
+  uint32_t GetBuffersNumber() const override { return _buffersNumber; }
+  
+  uint32_t GetDequeuedFramesNumber() const override { return _dequeuedNumber; }
+  
+  uint32_t GetWantedBuffersNumber() override;
+  
+  // @brief Stops streaming, frees buffers, allocates a new number of them and starts streaming.
+  bool ResizeBuffers(uint32_t buffersNumber) override;
 
   UvcGrabber() = delete;
   UvcGrabber(const UvcGrabber& other) = delete;
@@ -82,6 +120,15 @@ private:
   std::vector<VideoBuffer> _videoBuffers;
   int _cameraFd;
   bool _isBroken;
+  bool _isPaused;
+  
+  // The number of buffers survives reinitialization.
+  uint32_t _buffersNumber;
+  
+  // Buffers which are held by the application and the time when they were dequeued.
+  uint32_t _dequeuedNumber;
+  std::vector<uint64_t> _dequeueTimesMs;
+  BufferSizer _bufferSizer;
 };
 
 #endif // UVCGRABBER_H
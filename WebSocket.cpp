@@ -0,0 +1,219 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include "WebSocket.h"
+
+#include <cstring>
+
+namespace {
+  static const char HandshakeGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  
+  uint32_t RotateLeft(uint32_t value, uint32_t bits) {
+    return (value << bits) | (value >> (32 - bits));
+  }
+  
+  // @brief SHA-1 (RFC 3174). It is used only for the handshake so it is not optimized.
+  void CalculateSha1(const std::string& message, uint8_t digest[20]) {
+    uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    
+    std::string data = message;
+    const uint64_t messageBits = static_cast<uint64_t>(message.size()) * 8;
+    data.push_back(static_cast<char>(0x80));
+    while (data.size() % 64 != 56) {
+      data.push_back(0);
+    }
+    
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      data.push_back(static_cast<char>(messageBits >> shift));
+    }
+    
+    for (std::size_t blockStart = 0; blockStart < data.size(); blockStart += 64) {
+      const uint8_t* block = reinterpret_cast<const uint8_t*>(data.data() + blockStart);
+      
+      uint32_t words[80];
+      for (uint32_t idx = 0; idx < 16; ++idx) {
+        words[idx] = (static_cast<uint32_t>(block[idx * 4]) << 24) | (static_cast<uint32_t>(block[idx * 4 + 1]) << 16) |
+                     (static_cast<uint32_t>(block[idx * 4 + 2]) << 8) | static_cast<uint32_t>(block[idx * 4 + 3]);
+      }
+      
+      for (uint32_t idx = 16; idx < 80; ++idx) {
+        words[idx] = RotateLeft(words[idx - 3] ^ words[idx - 8] ^ words[idx - 14] ^ words[idx - 16], 1);
+      }
+      
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+      
+      for (uint32_t idx = 0; idx < 80; ++idx) {
+        uint32_t f = 0;
+        uint32_t k = 0;
+        if (idx < 20) {
+          f = (b & c) | (~b & d);
+          k = 0x5A827999;
+        }
+        else if (idx < 40) {
+          f = b ^ c ^ d;
+          k = 0x6ED9EBA1;
+        }
+        else if (idx < 60) {
+          f = (b & c) | (b & d) | (c & d);
+          k = 0x8F1BBCDC;
+        }
+        else {
+          f = b ^ c ^ d;
+          k = 0xCA62C1D6;
+        }
+        
+        const uint32_t temp = RotateLeft(a, 5) + f + e + k + words[idx];
+        e = d;
+        d = c;
+        c = RotateLeft(b, 30);
+        b = a;
+        a = temp;
+      }
+      
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+    }
+    
+    for (uint32_t idx = 0; idx < 20; ++idx) {
+      digest[idx] = static_cast<uint8_t>(state[idx / 4] >> (24 - (idx % 4) * 8));
+    }
+  }
+  
+  std::string EncodeBase64(const uint8_t* data, std::size_t size) {
+    static const char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    std::string result;
+    result.reserve((size + 2) / 3 * 4);
+    
+    for (std::size_t idx = 0; idx < size; idx += 3) {
+      const uint32_t group = (static_cast<uint32_t>(data[idx]) << 16) |
+                             (idx + 1 < size ? static_cast<uint32_t>(data[idx + 1]) << 8 : 0) |
+                             (idx + 2 < size ? static_cast<uint32_t>(data[idx + 2]) : 0);
+      
+      result.push_back(Alphabet[(group >> 18) & 0x3F]);
+      result.push_back(Alphabet[(group >> 12) & 0x3F]);
+      result.push_back(idx + 1 < size ? Alphabet[(group >> 6) & 0x3F] : '=');
+      result.push_back(idx + 2 < size ? Alphabet[group & 0x3F] : '=');
+    }
+    
+    return result;
+  }
+}
+
+namespace WebSocket {
+  
+  std::string CreateAcceptKey(const std::string& clientKey)
+  {
+    uint8_t digest[20];
+    CalculateSha1(clientKey + HandshakeGuid, digest);
+    
+    return EncodeBase64(digest, sizeof(digest));
+  }
+  
+  uint32_t CreateFrameHeader(Opcode opcode, uint64_t payloadSize, uint8_t* header)
+  {
+    header[0] = 0x80 | static_cast<uint8_t>(opcode);
+    
+    if (payloadSize < 126) {
+      header[1] = static_cast<uint8_t>(payloadSize);
+      return 2;
+    }
+    
+    if (payloadSize <= 0xFFFF) {
+      header[1] = 126;
+      header[2] = static_cast<uint8_t>(payloadSize >> 8);
+      header[3] = static_cast<uint8_t>(payloadSize);
+      return 4;
+    }
+    
+    header[1] = 127;
+    for (uint32_t idx = 0; idx < 8; ++idx) {
+      header[2 + idx] = static_cast<uint8_t>(payloadSize >> (56 - idx * 8));
+    }
+    
+    return 10;
+  }
+  
+  std::size_t ParseClientFrame(const char* data, std::size_t size, std::size_t maxPayloadSize, 
+                               ClientFrame& frame, bool& isValid)
+  {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    isValid = true;
+    
+    if (size < 2) {
+      return 0;
+    }
+    
+    // Clients must mask all frames (RFC 6455, 5.1).
+    if (0 == (bytes[1] & 0x80)) {
+      isValid = false;
+      return 0;
+    }
+    
+    std::size_t headerSize = 2;
+    uint64_t payloadSize = bytes[1] & 0x7F;
+    
+    if (126 == payloadSize) {
+      headerSize += 2;
+      if (size < headerSize) {
+        return 0;
+      }
+      
+      payloadSize = (static_cast<uint64_t>(bytes[2]) << 8) | bytes[3];
+    }
+    else if (127 == payloadSize) {
+      headerSize += 8;
+      if (size < headerSize) {
+        return 0;
+      }
+      
+      payloadSize = 0;
+      for (uint32_t idx = 0; idx < 8; ++idx) {
+        payloadSize = (payloadSize << 8) | bytes[2 + idx];
+      }
+    }
+    
+    if (payloadSize > maxPayloadSize) {
+      isValid = false;
+      return 0;
+    }
+    
+    const uint8_t* mask = bytes + headerSize;
+    headerSize += 4;
+    
+    if (size < headerSize + payloadSize) {
+      return 0;
+    }
+    
+    frame.FrameOpcode = static_cast<Opcode>(bytes[0] & 0x0F);
+    frame.IsFinal = (0 != (bytes[0] & 0x80));
+    frame.Payload.resize(static_cast<std::size_t>(payloadSize));
+    
+    for (std::size_t idx = 0; idx < payloadSize; ++idx) {
+      frame.Payload[idx] = static_cast<char>(bytes[headerSize + idx] ^ mask[idx % 4]);
+    }
+    
+    return headerSize + static_cast<std::size_t>(payloadSize);
+  }
+}
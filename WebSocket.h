@@ -0,0 +1,67 @@
+/*******************************************************************************
+#                                                                              #
+# This file is part of uvc2http.                                               #
+#                                                                              #
+# Copyright (C) 2015 Oleg Efremov                                              #
+#                                                                              #
+# Uvc_streamer is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/*
+ * @brief Minimal WebSocket (RFC 6455) support: the opening handshake, headers of 
+ *        server frames and parsing of (masked) client frames.
+ * 
+ * */
+namespace WebSocket {
+  
+  enum Opcode {
+    ContinuationFrame = 0x0,
+    TextFrame = 0x1,
+    BinaryFrame = 0x2,
+    CloseFrame = 0x8,
+    PingFrame = 0x9,
+    PongFrame = 0xA
+  };
+  
+  // 2 bytes + 8 bytes of extended payload length (server frames are not masked).
+  static const uint32_t MaxFrameHeaderSize = 10;
+  
+  // @brief Returns Sec-WebSocket-Accept value for Sec-WebSocket-Key of a client.
+  std::string CreateAcceptKey(const std::string& clientKey);
+  
+  // @brief Writes a header of a final unmasked frame. Returns the header size.
+  uint32_t CreateFrameHeader(Opcode opcode, uint64_t payloadSize, uint8_t* header);
+  
+  struct ClientFrame {
+    Opcode FrameOpcode;
+    bool IsFinal;
+    std::string Payload;
+  };
+  
+  // @brief Parses a client frame and unmasks its payload. Returns the number of
+  //        consumed bytes, 0 if the frame is incomplete. Sets isValid to false 
+  //        if the frame is not masked or its payload is larger than maxPayloadSize.
+  std::size_t ParseClientFrame(const char* data, std::size_t size, std::size_t maxPayloadSize, 
+                               ClientFrame& frame, bool& isValid);
+}
+
+#endif // WEBSOCKET_H